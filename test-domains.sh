@@ -0,0 +1,146 @@
+#!/bin/sh
+# Runs uniqued on a private bus shared by several users, like a
+# terminal server, and checks the sharing domains: blobs of peers in
+# different domains must never share an fd, peers in the same domain
+# must, and only uniqued's own user may write global class cache keys.
+# Needs root, to run clients as other users.
+
+set -e
+
+if [ "$(id -u)" != 0 ] || ! command -v setpriv > /dev/null; then
+  echo "SKIP: needs root and setpriv"
+  exit 0
+fi
+
+tmpdir=$(mktemp -d)
+chmod 755 "$tmpdir"
+pids=
+
+cleanup ()
+{
+  kill $pids 2>/dev/null || true
+  rm -rf "$tmpdir"
+}
+trap cleanup EXIT
+
+fail ()
+{
+  echo "FAIL: $*"
+  for log in "$tmpdir"/*.log; do
+    echo "== $log"
+    cat "$log"
+  done
+  exit 1
+}
+
+# Two users with the same primary group, and one with another group
+pick_users ()
+{
+  getent passwd | awk -F: '
+    $3 != 0 && $4 != 0 { users[$4] = users[$4] " " $3; n[$4]++ }
+    END {
+      for (g in n) if (n[g] >= 2 && same == "") same = g
+      for (g in n) if (g != same && other == "") other = g
+      if (same != "" && other != "") {
+        split (users[same], s, " "); split (users[other], o, " ")
+        print s[1], s[2], o[1]
+      }
+    }'
+}
+
+set -- $(pick_users)
+[ $# = 3 ] || fail "no suitable users in the user database"
+uid_a=$1 # Same group as uid_b
+uid_b=$2
+uid_c=$3
+
+# Other users can't get at the tree we run from
+cp ./unique-client "$tmpdir/unique-client"
+
+cat > "$tmpdir/bus.conf" <<EOF
+<busconfig>
+  <type>session</type>
+  <listen>unix:path=$tmpdir/bus</listen>
+  <auth>EXTERNAL</auth>
+  <policy context="default">
+    <allow user="*"/>
+    <allow send_destination="*" eavesdrop="true"/>
+    <allow eavesdrop="true"/>
+    <allow own="*"/>
+  </policy>
+</busconfig>
+EOF
+
+dbus-daemon --config-file="$tmpdir/bus.conf" --fork --print-pid > "$tmpdir/bus.pid"
+pids="$pids $(cat "$tmpdir/bus.pid")"
+
+start_uniqued ()
+{
+  name=$1
+  shift
+  [ -n "$uniqued" ] && kill $uniqued && sleep 0.3
+  ./uniqued -v --address="unix:path=$tmpdir/bus" "$@" > "$tmpdir/uniqued-$name.log" 2>&1 &
+  uniqued=$!
+  pids="$pids $uniqued"
+  sleep 0.5
+}
+
+client ()
+{
+  uid=$1
+  shift
+  setpriv --reuid="$uid" --regid="$(id -g "$uid")" --clear-groups \
+    env HOME="$tmpdir" UNIQUED_BUS="unix:path=$tmpdir/bus" "$tmpdir/unique-client" "$@"
+}
+
+# Sets inode to the inode of the memfd that user uid maps for value.
+# The client must not run inside $(), it would die with the subshell.
+shared_inode ()
+{
+  client "$1" share "$2" 6 > /dev/null &
+  sleep 1
+  # $! is the subshell running client, unique-client may be its child
+  inode=$(cat "/proc/$!/maps" $(pgrep -P $! | sed 's|.*|/proc/&/maps|') 2>/dev/null |
+    awk '/memfd:/ { print $5; exit }')
+}
+
+# Runs all of uid_a, uid_b and uid_c with the same content, and checks
+# which of them got the same fd
+check_sharing ()
+{
+  domain=$1
+  expect_ab=$2
+  expect_ac=$3
+  value="content for $domain"
+
+  shared_inode $uid_a "$value"; inode_a=$inode
+  shared_inode $uid_b "$value"; inode_b=$inode
+  shared_inode $uid_c "$value"; inode_c=$inode
+  shared_inode $uid_a "$value"; inode_a2=$inode
+
+  [ -n "$inode_a" ] && [ -n "$inode_b" ] && [ -n "$inode_c" ] || fail "$domain: a client mapped no memfd"
+  [ "$inode_a" = "$inode_a2" ] || fail "$domain: one user didn't share with itself"
+  [ "$(test "$inode_a" = "$inode_b" && echo same || echo different)" = "$expect_ab" ] ||
+    fail "$domain: users of the same group didn't get $expect_ab fds"
+  [ "$(test "$inode_a" = "$inode_c" && echo same || echo different)" = "$expect_ac" ] ||
+    fail "$domain: users of different groups didn't get $expect_ac fds"
+}
+
+start_uniqued uid --sharing-domain=uid --global-class=test
+check_sharing uid different different
+
+# Only uniqued's own user may write the global class
+client $uid_a put test:forged "forged value" > /dev/null || fail "put as uid $uid_a"
+if client $uid_b get test:forged > /dev/null; then
+  fail "uid $uid_a wrote a global class key"
+fi
+client 0 put test:real "real value" > /dev/null || fail "put as root"
+[ "$(client $uid_b get test:real)" = "real value" ] || fail "global class key not shared"
+
+start_uniqued group --sharing-domain=group
+check_sharing group same different
+
+start_uniqued global --sharing-domain=global
+check_sharing global same same
+
+echo "PASS"
@@ -0,0 +1,100 @@
+#!/bin/sh
+# Runs a parent uniqued and children that forward to it, each on a
+# private bus, like the host and containers. An entry put through one
+# child must be found through another via the parent, global blobs must
+# be forwarded and the parent's copy adopted, blobs of other domains
+# must stay in their child, and the children must keep working on their
+# own once the parent is gone.
+
+set -e
+
+tmpdir=$(mktemp -d)
+pids=
+
+cleanup ()
+{
+  kill $pids 2>/dev/null || true
+  rm -rf "$tmpdir"
+}
+trap cleanup EXIT
+
+start_bus ()
+{
+  dbus-daemon --session --fork --address="unix:path=$tmpdir/$1" --print-pid > "$tmpdir/$1.pid"
+  pids="$pids $(cat "$tmpdir/$1.pid")"
+}
+
+start_uniqued ()
+{
+  bus=$1
+  shift
+  DBUS_SESSION_BUS_ADDRESS="unix:path=$tmpdir/$bus" ./uniqued -v "$@" > "$tmpdir/uniqued-$bus.log" 2>&1 &
+  pids="$pids $!"
+  eval "uniqued_$bus=$!"
+}
+
+client ()
+{
+  bus=$1
+  shift
+  UNIQUED_BUS="unix:path=$tmpdir/$bus" ./unique-client "$@"
+}
+
+fail ()
+{
+  echo "FAIL: $*"
+  for log in "$tmpdir"/*.log; do
+    echo "== $log"
+    cat "$log"
+  done
+  exit 1
+}
+
+start_bus parent
+start_bus child1
+start_bus child2
+start_bus child3
+start_bus child4
+
+# The children use per-uid domains, so their entries reach the parent
+# qualified by domain
+start_uniqued parent
+sleep 0.5
+start_uniqued child1 --sharing-domain=uid --parent="unix:path=$tmpdir/parent"
+start_uniqued child2 --sharing-domain=uid --parent="unix:path=$tmpdir/parent"
+start_uniqued child3 --parent="unix:path=$tmpdir/parent"
+start_uniqued child4 --parent="unix:path=$tmpdir/parent"
+sleep 1
+
+client child1 put test:shared "shared value" > /dev/null || fail "put through child1"
+sleep 0.5
+[ "$(client child2 get test:shared)" = "shared value" ] || fail "get through child2 via the parent"
+grep -q "Got Get request" "$tmpdir/uniqued-parent.log" || fail "child2 didn't ask the parent"
+grep -q "Got Put request" "$tmpdir/uniqued-parent.log" || fail "child1 didn't forward to the parent"
+
+# Blobs of the global domain go to the parent, and a second child with
+# the same content uses the parent's copy
+client child3 share "global value" 3 > /dev/null &
+sleep 1
+client child4 share "global value" 1 > /dev/null || fail "share through child4"
+grep -q "Adopting parent copy" "$tmpdir/uniqued-child4.log" || fail "child4 didn't adopt the parent's copy"
+
+# Blobs of a per-uid domain never leave their child
+client child1 share "private value" 1 > /dev/null || fail "share through child1"
+sleep 0.5
+[ "$(grep -c "Got MakeUnique request" "$tmpdir/uniqued-parent.log")" = 2 ] || fail "wrong blobs forwarded to the parent"
+if grep -q "Adopting parent copy" "$tmpdir/uniqued-child1.log"; then
+  fail "child1 adopted a parent copy for a per-uid blob"
+fi
+wait $!
+
+kill $uniqued_parent
+sleep 0.5
+
+client child1 put test:local "local value" > /dev/null || fail "put without a parent"
+[ "$(client child1 get test:local)" = "local value" ] || fail "get without a parent"
+if client child2 get test:local > /dev/null; then
+  fail "child2 found an entry only child1 has"
+fi
+
+echo "PASS"
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Builds unique tables through uniqued on a private bus. Every key added
+# must be found with its value, keys that weren't added must not be, and
+# a table that is cached already must be used as it is rather than
+# built again.
+
+set -e
+
+tmpdir=$(mktemp -d)
+pids=
+
+cleanup ()
+{
+  kill $pids 2>/dev/null || true
+  rm -rf "$tmpdir"
+}
+trap cleanup EXIT
+
+fail ()
+{
+  echo "FAIL: $*"
+  cat "$tmpdir/uniqued.log"
+  exit 1
+}
+
+client ()
+{
+  UNIQUED_BUS="unix:path=$tmpdir/bus" ./unique-client "$@"
+}
+
+dbus-daemon --session --fork --address="unix:path=$tmpdir/bus" --print-pid > "$tmpdir/bus.pid"
+pids="$pids $(cat "$tmpdir/bus.pid")"
+
+DBUS_SESSION_BUS_ADDRESS="unix:path=$tmpdir/bus" ./uniqued -v > "$tmpdir/uniqued.log" 2>&1 &
+pids="$pids $!"
+sleep 0.5
+
+# Enough keys that the hash has to resolve collisions
+pairs=$(seq 1 500 | sed 's/.*/key&=value&/')
+[ "$(client table many $pairs)" = "$pairs" ] || fail "lookup in a new table"
+
+[ "$(client table small a=1 b=2 c=3)" = "a=1
+b=2
+c=3" ] || fail "lookup in a small table"
+
+# The cached table wins, and has nothing for keys it wasn't built with
+[ "$(client table small a=9 d=4)" = "a=1
+d missing" ] || fail "lookup in a cached table"
+
+[ "$(client table empty)" = "" ] || fail "empty table"
+[ "$(client table empty a=1)" = "a missing" ] || fail "lookup in an empty table"
+
+echo "PASS"
@@ -1,10 +1,12 @@
 #define _GNU_SOURCE         /* See feature_test_macros(7) */
 
 #include "unique-bytes.h"
+#include "unique-intern.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <glib.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -18,12 +20,16 @@
                    F_SEAL_GROW |   \
                    F_SEAL_WRITE)
 
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
 static gboolean
-write_all_to_fd (int fd, const guchar *data, gsize len)
+write_all_to_fd (int fd, const guchar *data, gsize len, off_t offset)
 {
   while (len > 0)
     {
-      ssize_t res = write (fd, data, len);
+      ssize_t res = pwrite (fd, data, len, offset);
       if (res < 0)
         {
           if (errno == EINTR)
@@ -33,6 +39,66 @@ write_all_to_fd (int fd, const guchar *data, gsize len)
 
       len -= res;
       data += res;
+      offset += res;
+    }
+
+  return TRUE;
+}
+
+#define SPARSE_BLOCK_SIZE 4096
+
+static gboolean
+is_all_zeros (const guchar *data, gsize len)
+{
+  /* Or together a cacheline at a time, which the compiler vectorizes */
+  while (len >= 64)
+    {
+      guint64 w[8];
+
+      memcpy (w, data, sizeof w);
+      if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+        return FALSE;
+
+      data += 64;
+      len -= 64;
+    }
+
+  while (len > 0)
+    {
+      if (*data != 0)
+        return FALSE;
+      data++;
+      len--;
+    }
+
+  return TRUE;
+}
+
+/* Writes data to a freshly truncated fd, skipping pages that are all
+   zeros. Those are left as holes, which read back as zeros but are never
+   allocated unless someone faults them in. */
+static gboolean
+write_sparse_to_fd (int fd, const guchar *data, gsize len)
+{
+  gsize offset = 0;
+
+  while (offset < len)
+    {
+      gsize start;
+
+      while (offset < len &&
+             is_all_zeros (data + offset, MIN (SPARSE_BLOCK_SIZE, len - offset)))
+        offset += SPARSE_BLOCK_SIZE;
+
+      start = offset;
+      while (offset < len &&
+             !is_all_zeros (data + offset, MIN (SPARSE_BLOCK_SIZE, len - offset)))
+        offset += SPARSE_BLOCK_SIZE;
+      offset = MIN (offset, len);
+
+      if (offset > start &&
+          !write_all_to_fd (fd, data + start, offset - start, start))
+        return FALSE;
     }
 
   return TRUE;
@@ -60,19 +126,119 @@ steal_one_fd_from_list (GUnixFDList *fd_list,
   return fd;
 }
 
+static GDBusMessage *signal_filter (GDBusConnection *connection,
+                                    GDBusMessage    *message,
+                                    gboolean         incoming,
+                                    gpointer         user_data);
+
+/* The unique name of uniqued, followed through NameOwnerChanged. Only
+   it may send us Remap and ChannelUpdated signals. */
+G_LOCK_DEFINE_STATIC (owner);
+static char *uniqued_owner;
+static guint owner_serial; /* Bumped on each NameOwnerChanged */
+
+static void
+watch_uniqued_owner (GDBusConnection *bus)
+{
+  g_autoptr(GVariant) reply = NULL;
+  const char *owner;
+  guint serial;
+
+  G_LOCK (owner);
+  serial = owner_serial;
+  G_UNLOCK (owner);
+
+  /* Sent before GetNameOwner, so no change can fall in between */
+  g_dbus_connection_call (bus,
+                          "org.freedesktop.DBus",
+                          "/org/freedesktop/DBus",
+                          "org.freedesktop.DBus",
+                          "AddMatch",
+                          g_variant_new ("(s)",
+                                         "type='signal',sender='org.freedesktop.DBus',"
+                                         "interface='org.freedesktop.DBus',member='NameOwnerChanged',"
+                                         "arg0='org.freedesktop.portal.Unique'"),
+                          NULL,
+                          G_DBUS_CALL_FLAGS_NONE,
+                          -1,
+                          NULL, NULL, NULL);
+
+  reply = g_dbus_connection_call_sync (bus,
+                                       "org.freedesktop.DBus",
+                                       "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus",
+                                       "GetNameOwner",
+                                       g_variant_new ("(s)", "org.freedesktop.portal.Unique"),
+                                       G_VARIANT_TYPE ("(s)"),
+                                       G_DBUS_CALL_FLAGS_NONE,
+                                       1000, /* msec timeout */
+                                       NULL, NULL);
+  if (reply == NULL)
+    return; /* Not running, we'll see it appear */
+
+  g_variant_get (reply, "(&s)", &owner);
+
+  /* A NameOwnerChanged seen meanwhile is at least as new as the reply */
+  G_LOCK (owner);
+  if (owner_serial == serial)
+    {
+      g_free (uniqued_owner);
+      uniqued_owner = g_strdup (owner);
+    }
+  G_UNLOCK (owner);
+}
+
+static gboolean
+is_from_uniqued (GDBusMessage *message)
+{
+  gboolean result;
+
+  G_LOCK (owner);
+  result = uniqued_owner != NULL &&
+    g_strcmp0 (g_dbus_message_get_sender (message), uniqued_owner) == 0;
+  G_UNLOCK (owner);
+
+  return result;
+}
+
 /* We keek the bus alive in a static local because we need the client to keep living */
+G_LOCK_DEFINE_STATIC (bus);
+
 static GDBusConnection *
 get_bus (void)
 {
-  static gsize bus = 0;
+  static GDBusConnection *bus = NULL;
+  static gboolean initialized = FALSE;
+  GDBusConnection *the_bus;
 
-  if (g_once_init_enter (&bus))
+  /* Not g_once_init_*(), as NULL (no bus) is a valid result */
+  G_LOCK (bus);
+  if (!initialized)
     {
-      GDBusConnection *the_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
-      g_once_init_leave (&bus, (gsize)the_bus);
+      /* $UNIQUED_BUS selects a system-wide uniqued: "system", or the
+         address of a bus */
+      const char *bus_env = g_getenv ("UNIQUED_BUS");
+
+      if (bus_env == NULL || *bus_env == 0 || g_str_equal (bus_env, "session"))
+        bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+      else if (g_str_equal (bus_env, "system"))
+        bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, NULL);
+      else
+        bus = g_dbus_connection_new_for_address_sync (bus_env,
+                                                      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                      G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                      NULL, NULL, NULL);
+      if (bus)
+        {
+          g_dbus_connection_add_filter (bus, signal_filter, NULL, NULL);
+          watch_uniqued_owner (bus);
+        }
+      initialized = TRUE;
     }
+  the_bus = bus;
+  G_UNLOCK (bus);
 
-  return (GDBusConnection *)bus;
+  return the_bus;
 }
 
 
@@ -94,13 +260,134 @@ call_forget (guint32 id)
                             NULL, NULL, NULL);
 }
 
+/* uniqued packs small blobs nobody uses into segments, sealed memfds
+   holding several blobs. We map each segment once, however many of its
+   blobs we use, so that they share pages and TLB entries. */
+typedef struct {
+  guint ref_count;
+  dev_t dev;
+  ino_t ino;
+  gpointer data;
+  gsize size;
+} MappedSegment;
+
+/* What we know about the data at an address. Handles for the same
+   packed blob share their address, and so this, which lives as long as
+   any of them. */
+typedef struct {
+  guint ref_count;
+  gsize len;
+  gboolean has_digest;
+  guint8 digest[G_BYTES_UNIQUE_DIGEST_LEN];
+} MappedAddress;
+
 typedef struct {
   guint ref_count;
   gpointer data;
   gsize len;
   guint32 id;
+  MappedAddress *address;
+  MappedSegment *segment; /* If data points into a segment */
 } MappedData;
 
+/* Parsed reply of MakeUnique, Put and Get */
+typedef struct {
+  int memfd; /* -1 if no fd was returned */
+  guint32 id;
+  gboolean has_digest;
+  guint8 digest[G_BYTES_UNIQUE_DIGEST_LEN];
+  guint64 offset; /* Of the data in memfd */
+  guint64 size;
+  gboolean packed; /* memfd is a segment */
+} UniqueReply;
+
+/* Maps uniqued handles to the MappedData using them, so we can handle
+   Remap signals, and mapped addresses to MappedData, so we can find the
+   digest of a GBytes. Remapping happens in the D-Bus worker thread, so
+   these are protected by the mapped lock, which is also held when
+   mapping over or unmapping data, and when registering ids. A Remap
+   can arrive before we handled the reply with its id, so those are
+   kept until the id is registered. */
+G_LOCK_DEFINE_STATIC (mapped);
+static GHashTable *mapped_by_id;
+static GHashTable *mapped_by_address; /* Address -> MappedAddress */
+static GHashTable *mapped_segments; /* By device and inode */
+static GHashTable *pending_remaps; /* Id -> fd */
+
+/* Anyone can send us signals, so don't keep an unbounded number */
+#define MAX_PENDING_REMAPS 64
+
+static guint
+mapped_segment_hash (gconstpointer key)
+{
+  const MappedSegment *segment = key;
+
+  return g_int64_hash (&segment->ino) ^ (guint) segment->dev;
+}
+
+static gboolean
+mapped_segment_equal (gconstpointer a,
+                      gconstpointer b)
+{
+  const MappedSegment *segment_a = a;
+  const MappedSegment *segment_b = b;
+
+  return segment_a->dev == segment_b->dev && segment_a->ino == segment_b->ino;
+}
+
+/* Returns a reference to the mapping of the segment fd, which must be
+   at least min_size long. Called with the mapped lock held. */
+static MappedSegment *
+mapped_segment_get (int fd, gsize min_size)
+{
+  MappedSegment key, *segment;
+  struct stat statbuf;
+  gpointer data;
+
+  if (fstat (fd, &statbuf) != 0 || statbuf.st_size < min_size)
+    return NULL;
+
+  key.dev = statbuf.st_dev;
+  key.ino = statbuf.st_ino;
+
+  if (mapped_segments == NULL)
+    mapped_segments = g_hash_table_new (mapped_segment_hash, mapped_segment_equal);
+
+  segment = g_hash_table_lookup (mapped_segments, &key);
+  if (segment != NULL)
+    {
+      segment->ref_count++;
+      return segment;
+    }
+
+  data = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  segment = g_slice_new0 (MappedSegment);
+  segment->ref_count = 1;
+  segment->dev = statbuf.st_dev;
+  segment->ino = statbuf.st_ino;
+  segment->data = data;
+  segment->size = statbuf.st_size;
+  g_hash_table_add (mapped_segments, segment);
+
+  return segment;
+}
+
+/* Called with the mapped lock held */
+static void
+mapped_segment_unref (MappedSegment *segment)
+{
+  segment->ref_count--;
+  if (segment->ref_count == 0)
+    {
+      g_hash_table_remove (mapped_segments, segment);
+      munmap (segment->data, segment->size);
+      g_slice_free (MappedSegment, segment);
+    }
+}
+
 static MappedData *
 mapped_data_new (gpointer data, gsize len)
 {
@@ -108,6 +395,20 @@ mapped_data_new (gpointer data, gsize len)
   d->data = data;
   d->len = len;
   d->ref_count = 1;
+
+  G_LOCK (mapped);
+  if (mapped_by_address == NULL)
+    mapped_by_address = g_hash_table_new (g_direct_hash, g_direct_equal);
+  d->address = g_hash_table_lookup (mapped_by_address, d->data);
+  if (d->address == NULL)
+    {
+      d->address = g_new0 (MappedAddress, 1);
+      d->address->len = len;
+      g_hash_table_insert (mapped_by_address, d->data, d->address);
+    }
+  d->address->ref_count++;
+  G_UNLOCK (mapped);
+
   return d;
 }
 
@@ -118,81 +419,376 @@ mapped_data_ref (MappedData *d)
   return d;
 }
 
+static void record_in_manifest (const guint8 *digest, gsize len);
+
+static gboolean
+fd_is_sealed (int fd)
+{
+  int seals = fcntl (fd, F_GET_SEALS);
+
+  return seals != -1 && (seals & ALL_SEALS) == ALL_SEALS;
+}
+
+/* Switches the mapping of d over to fd, if the new fd really has the
+   same content. Data in a segment shares its pages with other blobs,
+   so that stays where it is. Called with the mapped lock held. */
+static void
+remap_mapped_data_locked (MappedData *d, int fd)
+{
+  struct stat statbuf;
+  void *new_data;
+
+  if (d->segment != NULL)
+    return;
+
+  /* Touching pages past the end of a shorter fd would be SIGBUS */
+  if (fstat (fd, &statbuf) != 0 || (gsize) statbuf.st_size < d->len)
+    return;
+
+  new_data = mmap (NULL, d->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (new_data != MAP_FAILED)
+    {
+      if (memcmp (new_data, d->data, d->len) == 0)
+        mmap (d->data, d->len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+      munmap (new_data, d->len);
+    }
+}
+
+/* Records what uniqued told us about the mapped data, and applies any
+   Remap for its id that came first. Called with the mapped lock held. */
+static void
+mapped_data_set_reply_locked (MappedData *d, const UniqueReply *reply)
+{
+  gpointer fd;
+
+  /* The same for all handles at the address, as it's the same blob */
+  if (reply->has_digest && !d->address->has_digest && d->address->len == d->len)
+    {
+      memcpy (d->address->digest, reply->digest, G_BYTES_UNIQUE_DIGEST_LEN);
+      d->address->has_digest = TRUE;
+    }
+  if (reply->id != 0)
+    {
+      if (mapped_by_id == NULL)
+        mapped_by_id = g_hash_table_new (g_direct_hash, g_direct_equal);
+      d->id = reply->id;
+      g_hash_table_insert (mapped_by_id, GUINT_TO_POINTER (d->id), d);
+
+      if (pending_remaps != NULL &&
+          g_hash_table_steal_extended (pending_remaps, GUINT_TO_POINTER (d->id), NULL, &fd))
+        {
+          remap_mapped_data_locked (d, GPOINTER_TO_INT (fd));
+          close (GPOINTER_TO_INT (fd));
+        }
+    }
+}
+
+static void
+mapped_data_set_reply (MappedData *d, const UniqueReply *reply)
+{
+  G_LOCK (mapped);
+  mapped_data_set_reply_locked (d, reply);
+  G_UNLOCK (mapped);
+
+  if (reply->has_digest)
+    record_in_manifest (reply->digest, d->len);
+}
+
+static void
+drop_pending_remap (guint32 id)
+{
+  gpointer fd;
+
+  if (pending_remaps != NULL &&
+      g_hash_table_steal_extended (pending_remaps, GUINT_TO_POINTER (id), NULL, &fd))
+    close (GPOINTER_TO_INT (fd));
+}
+
 static void
 mapped_data_unref (MappedData *d)
 {
   d->ref_count--;
   if (d->ref_count == 0)
     {
-      munmap (d->data, d->len);
+      G_LOCK (mapped);
+      if (d->id != 0)
+        {
+          g_hash_table_remove (mapped_by_id, GUINT_TO_POINTER (d->id));
+          drop_pending_remap (d->id);
+        }
+      if (--d->address->ref_count == 0)
+        {
+          g_hash_table_remove (mapped_by_address, d->data);
+          g_free (d->address);
+        }
+      if (d->segment != NULL)
+        mapped_segment_unref (d->segment);
+      else
+        munmap (d->data, d->len);
+      G_UNLOCK (mapped);
+
       if (d->id != 0)
         call_forget (d->id);
       g_slice_free (MappedData, d);
     }
 }
 
+/* Switches the mapping for handle id over to fd, now or once we know
+   the id. Anyone on the bus can send us signals, so only do this if the
+   new fd can't change. Takes over fd. */
+static void
+remap_mapped_data (guint32 id, int fd)
+{
+  MappedData *d;
+
+  if (!fd_is_sealed (fd))
+    {
+      close (fd);
+      return;
+    }
+
+  G_LOCK (mapped);
+  d = mapped_by_id ? g_hash_table_lookup (mapped_by_id, GUINT_TO_POINTER (id)) : NULL;
+  if (d != NULL)
+    remap_mapped_data_locked (d, fd);
+  else
+    {
+      if (pending_remaps == NULL)
+        pending_remaps = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+      if (g_hash_table_size (pending_remaps) < MAX_PENDING_REMAPS)
+        {
+          drop_pending_remap (id);
+          g_hash_table_insert (pending_remaps, GUINT_TO_POINTER (id), GINT_TO_POINTER (fd));
+          fd = -1;
+        }
+    }
+  G_UNLOCK (mapped);
+
+  if (fd != -1)
+    close (fd);
+}
+
+static void channel_updated (GDBusMessage *message);
+static void uniqued_owner_changed (GDBusMessage *message);
 
-static gboolean
-call_make_unique (int *memfd,
-                  guint32 *id_out)
+/* Handles the signals uniqued sends us: Remap, and ChannelUpdated for
+   the channels we subscribe to */
+static GDBusMessage *
+signal_filter (GDBusConnection *connection,
+               GDBusMessage    *message,
+               gboolean         incoming,
+               gpointer         user_data)
+{
+  const char *member;
+  GVariant *body;
+  guint32 id;
+  gint32 handle;
+  int fd;
+
+  if (!incoming ||
+      g_dbus_message_get_message_type (message) != G_DBUS_MESSAGE_TYPE_SIGNAL)
+    return message;
+
+  /* Left for others to see too, they may watch uniqued as well */
+  if (g_strcmp0 (g_dbus_message_get_sender (message), "org.freedesktop.DBus") == 0 &&
+      g_strcmp0 (g_dbus_message_get_member (message), "NameOwnerChanged") == 0)
+    {
+      uniqued_owner_changed (message);
+      return message;
+    }
+
+  if (g_strcmp0 (g_dbus_message_get_interface (message), "org.freedesktop.portal.Unique") != 0)
+    return message;
+
+  member = g_dbus_message_get_member (message);
+  if (g_strcmp0 (member, "ChannelUpdated") == 0)
+    {
+      channel_updated (message);
+      g_object_unref (message);
+      return NULL;
+    }
+
+  if (g_strcmp0 (member, "Remap") != 0)
+    return message;
+
+  /* Anyone on the bus can send us signals */
+  if (!is_from_uniqued (message))
+    {
+      g_object_unref (message);
+      return NULL;
+    }
+
+  body = g_dbus_message_get_body (message);
+  if (body != NULL && g_variant_is_of_type (body, G_VARIANT_TYPE ("(uh)")))
+    {
+      g_variant_get (body, "(uh)", &id, &handle);
+      fd = steal_one_fd_from_list (g_dbus_message_get_unix_fd_list (message), handle);
+      if (fd != -1)
+        remap_mapped_data (id, fd);
+    }
+
+  g_object_unref (message);
+  return NULL;
+}
+
+/* Records where in memfd the blob is, and whether it shares memfd with
+   other blobs */
+static void
+unique_reply_set_memfd (UniqueReply *reply,
+                        int memfd,
+                        guint64 offset,
+                        guint64 size)
+{
+  struct stat statbuf;
+
+  reply->memfd = memfd;
+  reply->offset = offset;
+  reply->size = size;
+  reply->packed = memfd != -1 &&
+    (offset != 0 || (fstat (memfd, &statbuf) == 0 && statbuf.st_size != size));
+}
+
+static void
+unique_reply_clear (UniqueReply *reply)
+{
+  if (reply->memfd != -1)
+    close (reply->memfd);
+  reply->memfd = -1;
+}
+
+/* Parses the (ahuaytt) reply of MakeUnique, Put and Get, or the same
+   fields starting at child first of a longer message body */
+static void
+parse_unique_reply (GVariant *response,
+                    gsize first,
+                    GUnixFDList *response_fd_list,
+                    UniqueReply *reply)
+{
+  GVariantIter *handle_iter;
+  GVariant *handle_v;
+  g_autoptr(GVariant) digest_v = NULL;
+  gconstpointer digest;
+  gsize digest_len;
+  guint64 offset, size;
+  int memfd = -1;
+
+  g_variant_get_child (response, first, "ah", &handle_iter);
+  g_variant_get_child (response, first + 1, "u", &reply->id);
+  g_variant_get_child (response, first + 2, "@ay", &digest_v);
+  g_variant_get_child (response, first + 3, "t", &offset);
+  g_variant_get_child (response, first + 4, "t", &size);
+
+  handle_v = g_variant_iter_next_value (handle_iter);
+  if (handle_v)
+    {
+      /* Not stolen, the message may carry fds of other replies */
+      if (response_fd_list != NULL)
+        memfd = g_unix_fd_list_get (response_fd_list, g_variant_get_handle (handle_v), NULL);
+      g_variant_unref (handle_v);
+    }
+  g_variant_iter_free (handle_iter);
+
+  unique_reply_set_memfd (reply, memfd, offset, size);
+
+  digest = g_variant_get_fixed_array (digest_v, &digest_len, 1);
+  reply->has_digest = digest_len == G_BYTES_UNIQUE_DIGEST_LEN;
+  if (reply->has_digest)
+    memcpy (reply->digest, digest, G_BYTES_UNIQUE_DIGEST_LEN);
+}
+
+/* Calls a uniqued method whose reply (of reply_type) starts with
+   (ahuaytt), optionally passing fd_list. Returns the reply, for any
+   further fields, or NULL on error. */
+static GVariant *
+call_unique_method_full (const char *method_name,
+                         GVariant *parameters,
+                         const GVariantType *reply_type,
+                         GUnixFDList *fd_list,
+                         UniqueReply *reply)
 {
   GDBusConnection *bus = get_bus ();
-  gboolean result = FALSE;
-  GUnixFDList *fd_list;
-  gint memfd_handle;
+  GUnixFDList *response_fd_list = NULL;
+  GVariant *response;
+
+  reply->memfd = -1;
 
   if (bus == NULL)
+    {
+      g_variant_unref (g_variant_ref_sink (parameters));
+      return NULL;
+    }
+
+  response = g_dbus_connection_call_with_unix_fd_list_sync (bus,
+                                                            "org.freedesktop.portal.Unique",
+                                                            "/org/freedesktop/portal/unique",
+                                                            "org.freedesktop.portal.Unique",
+                                                            method_name,
+                                                            parameters,
+                                                            reply_type,
+                                                            G_DBUS_CALL_FLAGS_NONE,
+                                                            1000, /* msec timeout */
+                                                            fd_list, &response_fd_list,
+                                                            NULL, NULL);
+  if (response == NULL)
+    return NULL;
+
+  parse_unique_reply (response, 0, response_fd_list, reply);
+
+  g_clear_object (&response_fd_list);
+
+  return response;
+}
+
+/* Calls a uniqued method that returns (ahuaytt), optionally passing fd_list */
+static gboolean
+call_unique_method_sync (const char *method_name,
+                         GVariant *parameters,
+                         GUnixFDList *fd_list,
+                         UniqueReply *reply)
+{
+  GVariant *response;
+
+  response = call_unique_method_full (method_name, parameters, G_VARIANT_TYPE ("(ahuaytt)"),
+                                      fd_list, reply);
+  if (response == NULL)
     return FALSE;
 
+  g_variant_unref (response);
+  return TRUE;
+}
+
+/* Submits memfd with MakeUnique, or with Put if cache_key is set. If
+   uniqued already had the content, memfd is replaced with its fd,
+   unless it is packed into a segment, which is left in reply. */
+static gboolean
+call_make_unique (const char *cache_key,
+                  int *memfd,
+                  UniqueReply *reply)
+{
+  gboolean result = FALSE;
+  GUnixFDList *fd_list;
+  gint memfd_handle;
+
   fd_list = g_unix_fd_list_new ();
   memfd_handle = g_unix_fd_list_append (fd_list, *memfd, NULL);
   if (memfd_handle != -1)
     {
-      GUnixFDList *response_fd_list;
-      GVariant *response =
-        g_dbus_connection_call_with_unix_fd_list_sync (bus,
-                                                       "org.freedesktop.portal.Unique",
-                                                       "/org/freedesktop/portal/unique",
-                                                       "org.freedesktop.portal.Unique",
-                                                       "MakeUnique",
-                                                       g_variant_new ("(h)", memfd_handle),
-                                                       G_VARIANT_TYPE ("(ahu)"),
-                                                       G_DBUS_CALL_FLAGS_NONE,
-                                                       1000, /* msec timeout */
-                                                       fd_list, &response_fd_list,
-                                                       NULL, NULL);
-      if (response != NULL)
+      if (cache_key)
+        result = call_unique_method_sync ("Put",
+                                          g_variant_new ("(sh)", cache_key, memfd_handle),
+                                          fd_list, reply);
+      else
+        result = call_unique_method_sync ("MakeUnique",
+                                          g_variant_new ("(h)", memfd_handle),
+                                          fd_list, reply);
+      if (result && reply->memfd != -1 && !reply->packed)
         {
-          GVariantIter *handle_iter;
-          GVariant *handle_v;
-          guint32 id;
-
-          g_variant_get (response, "(ahu)", &handle_iter, &id);
-
-          handle_v = g_variant_iter_next_value (handle_iter);
-          if (handle_v)
-            {
-              int new_memfd = steal_one_fd_from_list (response_fd_list, g_variant_get_handle (handle_v));
-              if (new_memfd != -1)
-                {
-                  close (*memfd);
-                  *memfd = new_memfd;
-                }
-
-              g_variant_unref (handle_v);
-            }
-          g_variant_iter_free (handle_iter);
-
-          *id_out = id;
-
-          result = TRUE;
-
-          g_clear_object (&response_fd_list);
-          g_variant_unref (response);
+          close (*memfd);
+          *memfd = reply->memfd;
+          reply->memfd = -1;
         }
     }
-    return FALSE;
-
 
   g_object_unref (fd_list);
   return result;
@@ -206,34 +802,33 @@ make_unique_cb (GObject *source_object,
   MappedData *mapped_data = user_data;
   GVariant *response;
   GUnixFDList *response_fd_list;
-  guint32 id;
+  UniqueReply reply;
 
   response = g_dbus_connection_call_with_unix_fd_list_finish (G_DBUS_CONNECTION (source_object),
                                                               &response_fd_list, res, NULL);
   if (response != NULL)
     {
-      GVariantIter *handle_iter;
-      GVariant *handle_v;
+      parse_unique_reply (response, 0, response_fd_list, &reply);
 
-      g_variant_get (response, "(ahu)", &handle_iter, &id);
+      /* Don't let a Remap for the id map over the data meanwhile */
+      G_LOCK (mapped);
 
-      handle_v = g_variant_iter_next_value (handle_iter);
-      if (handle_v)
+      /* A packed blob shares its pages with others, so we can't move
+         our data pointer there, keep our own copy in that case */
+      if (reply.memfd != -1 && !reply.packed)
         {
-          int new_memfd = steal_one_fd_from_list (response_fd_list, g_variant_get_handle (handle_v));
-          if (new_memfd != -1)
-            {
-              /* Switch out the mapping to the new version */
-              void *memfd_data = mmap (mapped_data->data, mapped_data->len, PROT_READ, MAP_PRIVATE | MAP_FIXED, new_memfd, 0);
-              g_assert (memfd_data == mapped_data->data);
-              close (new_memfd);
-            }
-          g_variant_unref (handle_v);
+          /* Switch out the mapping to the new version */
+          void *memfd_data = mmap (mapped_data->data, mapped_data->len, PROT_READ, MAP_PRIVATE | MAP_FIXED, reply.memfd, 0);
+          g_assert (memfd_data == mapped_data->data);
         }
-      g_variant_iter_free (handle_iter);
 
       /* Ensure we forget the new blob */
-      mapped_data->id = id;
+      mapped_data_set_reply_locked (mapped_data, &reply);
+      G_UNLOCK (mapped);
+
+      if (reply.has_digest)
+        record_in_manifest (reply.digest, mapped_data->len);
+      unique_reply_clear (&reply);
 
       g_clear_object (&response_fd_list);
       g_variant_unref (response);
@@ -261,7 +856,7 @@ call_make_unique_async (int memfd, MappedData *data)
                                               "org.freedesktop.portal.Unique",
                                               "MakeUnique",
                                               g_variant_new ("(h)", handle),
-                                              G_VARIANT_TYPE ("(ahu)"),
+                                              G_VARIANT_TYPE ("(ahuaytt)"),
                                               G_DBUS_CALL_FLAGS_NONE,
                                               G_MAXINT, /* No timeout */
                                               fd_list, NULL,
@@ -270,20 +865,38 @@ call_make_unique_async (int memfd, MappedData *data)
   g_object_unref (fd_list);
 }
 
+static void
+compute_digest (gconstpointer data, gsize len, guint8 *digest)
+{
+  g_autoptr(GChecksum) checksummer = g_checksum_new (G_CHECKSUM_SHA1);
+  gsize digest_len = G_BYTES_UNIQUE_DIGEST_LEN;
+
+  g_checksum_update (checksummer, data, len);
+  g_checksum_get_digest (checksummer, digest, &digest_len);
+}
+
+/* The memfd is named after a prefix of the digest of data, which shows
+   up in /proc/<pid>/maps of everyone who ends up sharing it, so blobs
+   can be told apart (see uniquectl mem). */
 static int
-create_sealed_memfd_for_data (gconstpointer data, gsize len)
+create_sealed_memfd_for_data (gconstpointer data, gsize len, const guint8 *digest)
 {
+  char name[32];
   int memfd = -1;
-  static int count = 0;
-  char *full_name = g_strdup_printf ("unique-%d-%d", getpid (), count++);
 
-  memfd = memfd_create (full_name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
-  g_free (full_name);
+  /* The digest only names the memfd, for debugging */
+  if (digest != NULL)
+    g_snprintf (name, sizeof (name), "unique-%02x%02x%02x%02x%02x%02x",
+                digest[0], digest[1], digest[2], digest[3], digest[4], digest[5]);
+  else
+    g_strlcpy (name, "unique-payload", sizeof (name));
+
+  memfd = memfd_create (name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
   if (memfd < 0)
     return -1;
 
   if (ftruncate (memfd, len) == 0 &&
-      write_all_to_fd (memfd, data, len) &&
+      write_sparse_to_fd (memfd, data, len) &&
       fcntl (memfd, F_ADD_SEALS, (int) F_SEAL_SEAL|F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE) == 0)
     return memfd;
 
@@ -291,39 +904,530 @@ create_sealed_memfd_for_data (gconstpointer data, gsize len)
   return -1;
 }
 
-GBytes *
-g_bytes_new_unique_sync (gconstpointer data, gsize len)
+/* Maps the blob of len bytes in the segment uniqued returned in reply */
+static GBytes *
+map_packed_blob (gsize len, const UniqueReply *reply)
 {
-  int memfd = -1;
-  void *memfd_data = NULL;
-  guint32 id = 0;
+  MappedSegment *segment = NULL;
+  MappedData *d;
+  gpointer data;
 
-  memfd = create_sealed_memfd_for_data (data, len);
-  if (memfd >= 0)
+  if (len == reply->size && fd_is_sealed (reply->memfd))
     {
-      if (call_make_unique (&memfd, &id))
-        memfd_data = mmap (NULL, len, PROT_READ, MAP_PRIVATE, memfd, 0);
-      close (memfd);
-
-      if (memfd_data)
-        {
-          MappedData *d = mapped_data_new (memfd_data, len);
-          d->id = id;
-          return g_bytes_new_with_free_func (memfd_data, len, (GDestroyNotify)mapped_data_unref, d);
-        }
+      G_LOCK (mapped);
+      segment = mapped_segment_get (reply->memfd, reply->offset + len);
+      G_UNLOCK (mapped);
+    }
+
+  if (segment == NULL)
+    {
+      if (reply->id != 0)
+        call_forget (reply->id);
+      return NULL;
+    }
+
+  data = (guchar *) segment->data + reply->offset;
+  d = mapped_data_new (data, len);
+  d->segment = segment;
+  mapped_data_set_reply (d, reply);
+  return g_bytes_new_with_free_func (data, len, (GDestroyNotify)mapped_data_unref, d);
+}
+
+/* Maps memfd, which uniqued described in reply, and wraps it in a
+   GBytes. If uniqued returned a segment the blob is packed into, that
+   is used instead. Forgets the handle on failure. */
+static GBytes *
+map_unique_memfd (int memfd, gsize len, const UniqueReply *reply)
+{
+  void *memfd_data;
+  MappedData *d;
+
+  if (reply->packed)
+    return map_packed_blob (len, reply);
+
+  memfd_data = mmap (NULL, len, PROT_READ, MAP_PRIVATE, memfd, 0);
+  if (memfd_data == MAP_FAILED)
+    {
+      if (reply->id != 0)
+        call_forget (reply->id);
+      return NULL;
+    }
+
+  d = mapped_data_new (memfd_data, len);
+  mapped_data_set_reply (d, reply);
+  return g_bytes_new_with_free_func (memfd_data, len, (GDestroyNotify)mapped_data_unref, d);
+}
+
+/* Prefetched blobs, by digest, waiting for the app to ask for them */
+G_LOCK_DEFINE_STATIC (prefetch);
+static GHashTable *prefetched;      /* digest GBytes -> GBytes */
+
+/* Manifest being recorded for the next run, see g_bytes_unique_record_manifest() */
+G_LOCK_DEFINE_STATIC (manifest);
+static char *manifest_path;
+static GHashTable *manifest_entries; /* digest GBytes -> size */
+
+static void
+record_in_manifest (const guint8 *digest, gsize len)
+{
+  G_LOCK (manifest);
+  if (manifest_entries != NULL)
+    g_hash_table_insert (manifest_entries,
+                         g_bytes_new (digest, G_BYTES_UNIQUE_DIGEST_LEN),
+                         GSIZE_TO_POINTER (len));
+  G_UNLOCK (manifest);
+}
+
+static GBytes *
+lookup_prefetched (const guint8 *digest, gsize len)
+{
+  g_autoptr(GBytes) key = NULL;
+  GBytes *bytes = NULL;
+
+  G_LOCK (prefetch);
+  if (prefetched != NULL)
+    {
+      key = g_bytes_new_static (digest, G_BYTES_UNIQUE_DIGEST_LEN);
+      bytes = g_hash_table_lookup (prefetched, key);
+      if (bytes != NULL && g_bytes_get_size (bytes) == len)
+        g_bytes_ref (bytes);
+      else
+        bytes = NULL;
+    }
+  G_UNLOCK (prefetch);
+
+  if (bytes != NULL)
+    record_in_manifest (digest, len);
+
+  return bytes;
+}
+
+/* Brokerless mode: without a session bus, or if $UNIQUE_BYTES_STORE
+   names a directory, processes share data through files named by
+   digest in a directory on tmpfs, by default /dev/shm/unique-bytes-$UID.
+
+   New entries are written to an O_TMPFILE and linked into place, so
+   nobody sees partial content. Only memfds can be sealed, so entries
+   are read-only instead, and the content of an existing entry is
+   checked through the mapping we hand out. Every process that maps an
+   entry holds a shared flock on it, which lives as long as the mapping
+   (the mapping keeps the open file description alive) and goes away if
+   the process dies. The janitor deletes entries it can get an
+   exclusive lock on, i.e. ones nobody maps. */
+
+/* Run the janitor every this many entries added to the store */
+#define STORE_COLLECT_INTERVAL 256
+
+static int
+get_store_dir_fd (void)
+{
+  static int store_dir_fd = -1;
+  static gboolean initialized = FALSE;
+  G_LOCK_DEFINE_STATIC (store);
+  int fd;
+
+  G_LOCK (store);
+  if (!initialized)
+    {
+      const char *env = g_getenv ("UNIQUE_BYTES_STORE");
+      g_autofree char *path = NULL;
+      struct stat statbuf;
+
+      initialized = TRUE;
+
+      if (env != NULL && *env != 0)
+        path = g_strdup (env);
+      else if (get_bus () == NULL)
+        path = g_strdup_printf ("/dev/shm/unique-bytes-%d", (int)getuid ());
+
+      if (path != NULL)
+        {
+          if (g_mkdir_with_parents (path, 0700) == 0)
+            store_dir_fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+          /* Don't use a directory someone else can write to */
+          if (store_dir_fd != -1 &&
+              (fstat (store_dir_fd, &statbuf) != 0 ||
+               statbuf.st_uid != getuid () ||
+               (statbuf.st_mode & (S_IWGRP | S_IWOTH)) != 0))
+            {
+              g_warning ("Not using unsafe unique store %s", path);
+              close (store_dir_fd);
+              store_dir_fd = -1;
+            }
+        }
+    }
+  fd = store_dir_fd;
+  G_UNLOCK (store);
+
+  return fd;
+}
+
+/* flock rather than OFD locks, which need a writable fd for exclusive
+   locks */
+static gboolean
+lock_store_entry (int fd, int operation, gboolean wait)
+{
+  return flock (fd, operation | (wait ? 0 : LOCK_NB)) == 0;
+}
+
+/* Deletes the entries of the store that nobody maps. Returns the
+   number of entries deleted. */
+guint
+g_bytes_unique_store_collect (void)
+{
+  int dir_fd = get_store_dir_fd ();
+  g_autoptr(GDir) dir = NULL;
+  g_autofree char *path = NULL;
+  const char *name;
+  guint n_deleted = 0;
+
+  if (dir_fd == -1)
+    return 0;
+
+  path = g_strdup_printf ("/proc/self/fd/%d", dir_fd);
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    return 0;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      int fd = openat (dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+      if (fd == -1)
+        continue;
+
+      /* Unlink while holding the lock, so that anyone waiting for a
+         shared lock sees that the entry is gone */
+      if (lock_store_entry (fd, LOCK_EX, FALSE) &&
+          unlinkat (dir_fd, name, 0) == 0)
+        n_deleted++;
+
+      close (fd);
+    }
+
+  g_debug ("Collected %u unused entries from unique store", n_deleted);
+
+  return n_deleted;
+}
+
+static void
+maybe_collect_store (void)
+{
+  static gint n_added = 0;
+
+  if (g_atomic_int_add (&n_added, 1) % STORE_COLLECT_INTERVAL == 0)
+    g_bytes_unique_store_collect ();
+}
+
+/* Opens the store entry name with a shared lock held, if it exists and
+   is a read-only entry of the expected size. Other entries by that name
+   are bad, and are deleted so that a good one can take their place. The
+   caller checks the content. */
+static int
+open_store_entry (int dir_fd, const char *name, gsize len)
+{
+  struct stat statbuf;
+  int fd;
+
+  fd = openat (dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd == -1)
+    return -1;
+
+  /* If the janitor deleted it before we got the lock, it's unlinked */
+  if (!lock_store_entry (fd, LOCK_SH, TRUE) ||
+      fstat (fd, &statbuf) != 0 ||
+      statbuf.st_nlink == 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  if (!S_ISREG (statbuf.st_mode) ||
+      (statbuf.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0 ||
+      statbuf.st_size != len)
+    {
+      unlinkat (dir_fd, name, 0);
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/* Links a new entry with data into the store, returns it with a shared
+   lock held, or -1 if someone beat us to it */
+static int
+create_store_entry (int dir_fd, const char *name, gconstpointer data, gsize len)
+{
+  g_autofree char *proc_path = NULL;
+  int fd;
+
+  /* Read-only, our fd is the only one that can write it */
+  fd = openat (dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0400);
+  if (fd == -1)
+    return -1;
+
+  proc_path = g_strdup_printf ("/proc/self/fd/%d", fd);
+
+  /* Lock before linking, so the janitor can never see it unlocked */
+  if (ftruncate (fd, len) != 0 ||
+      !write_sparse_to_fd (fd, data, len) ||
+      !lock_store_entry (fd, LOCK_SH, FALSE) ||
+      linkat (AT_FDCWD, proc_path, dir_fd, name, AT_SYMLINK_FOLLOW) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  maybe_collect_store ();
+
+  return fd;
+}
+
+static GBytes *
+new_unique_from_store (gconstpointer data, gsize len, const guint8 *digest)
+{
+  UniqueReply reply = { -1, 0, TRUE };
+  GBytes *bytes = NULL;
+  char name[G_BYTES_UNIQUE_DIGEST_LEN * 2 + 1];
+  int dir_fd = get_store_dir_fd ();
+  gboolean created;
+  int fd;
+  int i;
+
+  if (dir_fd == -1 || len == 0)
+    return NULL;
+
+  memcpy (reply.digest, digest, G_BYTES_UNIQUE_DIGEST_LEN);
+  for (i = 0; i < G_BYTES_UNIQUE_DIGEST_LEN; i++)
+    g_snprintf (name + i * 2, 3, "%02x", digest[i]);
+
+  /* Retry in case of races with other writers or the janitor */
+  for (i = 0; i < 3 && bytes == NULL; i++)
+    {
+      fd = open_store_entry (dir_fd, name, len);
+      created = fd == -1;
+      if (created)
+        fd = create_store_entry (dir_fd, name, data, len);
+      if (fd == -1)
+        continue;
+
+      /* The lock stays with the mapping after we close fd */
+      bytes = map_unique_memfd (fd, len, &reply);
+      close (fd);
+
+      /* Someone else wrote the entry, so don't trust the name. Check
+         the mapping itself, so nothing can change in between. */
+      if (bytes != NULL && !created &&
+          memcmp (g_bytes_get_data (bytes, NULL), data, len) != 0)
+        {
+          g_debug ("Unique store entry %s has the wrong content", name);
+          unlinkat (dir_fd, name, 0);
+          g_clear_pointer (&bytes, g_bytes_unref);
+        }
+    }
+
+  return bytes;
+}
+
+GBytes *
+g_bytes_new_unique_sync (gconstpointer data, gsize len)
+{
+  guint8 digest[G_BYTES_UNIQUE_DIGEST_LEN];
+  GBytes *bytes = NULL;
+  int memfd = -1;
+  UniqueReply reply = { -1 };
+
+  compute_digest (data, len, digest);
+
+  /* If we prefetched a blob with this content, use that instead of
+     asking uniqued */
+  bytes = lookup_prefetched (digest, len);
+  if (bytes)
+    return bytes;
+
+  bytes = new_unique_from_store (data, len, digest);
+  if (bytes)
+    return bytes;
+
+  memfd = create_sealed_memfd_for_data (data, len, digest);
+  if (memfd >= 0)
+    {
+      if (call_make_unique (NULL, &memfd, &reply))
+        bytes = map_unique_memfd (memfd, len, &reply);
+      unique_reply_clear (&reply);
+      close (memfd);
+
+      if (bytes)
+        return bytes;
+    }
+
+  /* Fall back to regular copy */
+  return g_bytes_new (data, len);
+}
+
+/* Returns a sealed memfd with the content of data, or -1 on error.
+   It isn't hashed or submitted to uniqued here: the receiver does that
+   when it maps it with g_bytes_new_unique_from_memfd(), and a handle we
+   took would only be forgotten again right away. */
+int
+g_bytes_unique_memfd_new (gconstpointer data, gsize len)
+{
+  return create_sealed_memfd_for_data (data, len, NULL);
+}
+
+/* Maps a sealed memfd we got from someone else, uniquing it with any
+   existing copy. The sender can't change the content under us, as it is
+   sealed, so this works without uniqued too. */
+static GBytes *
+new_unique_from_memfd (const char *cache_key, int memfd, GError **error)
+{
+  UniqueReply reply = { -1, 0, FALSE };
+  struct stat statbuf;
+  GBytes *bytes;
+  int fd;
+
+  if (!fd_is_sealed (memfd) || fstat (memfd, &statbuf) != 0 || !S_ISREG (statbuf.st_mode))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Not a sealed memfd");
+      return NULL;
+    }
+
+  if (statbuf.st_size == 0)
+    return g_bytes_new (NULL, 0);
+
+  fd = dup (memfd);
+  if (fd == -1)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Failed to dup memfd: %s", g_strerror (errsv));
+      return NULL;
+    }
+
+  if (!call_make_unique (cache_key, &fd, &reply))
+    reply.id = 0;
+
+  bytes = map_unique_memfd (fd, statbuf.st_size, &reply);
+  unique_reply_clear (&reply);
+  close (fd);
+
+  if (bytes == NULL)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to map memfd");
+
+  return bytes;
+}
+
+GBytes *
+g_bytes_new_unique_from_memfd (int memfd, GError **error)
+{
+  return new_unique_from_memfd (NULL, memfd, error);
+}
+
+/* Like g_bytes_unique_cache_put(), for data that is in a sealed memfd
+   already, which is neither read nor hashed here */
+GBytes *
+g_bytes_unique_cache_put_memfd (const char *key, int memfd, GError **error)
+{
+  return new_unique_from_memfd (key, memfd, error);
+}
+
+GBytes *
+g_bytes_unique_cache_put (const char *key, gconstpointer data, gsize len)
+{
+  guint8 digest[G_BYTES_UNIQUE_DIGEST_LEN];
+  GBytes *bytes = NULL;
+  int memfd = -1;
+  UniqueReply reply = { -1 };
+
+  compute_digest (data, len, digest);
+  memfd = create_sealed_memfd_for_data (data, len, digest);
+  if (memfd >= 0)
+    {
+      if (call_make_unique (key, &memfd, &reply))
+        bytes = map_unique_memfd (memfd, len, &reply);
+      unique_reply_clear (&reply);
+      close (memfd);
+
+      if (bytes)
+        return bytes;
     }
 
   /* Fall back to regular copy */
   return g_bytes_new (data, len);
 }
 
+GBytes *
+g_bytes_unique_cache_get (const char *key)
+{
+  GBytes *bytes = NULL;
+  UniqueReply reply;
+
+  if (!call_unique_method_sync ("Get", g_variant_new ("(s)", key), NULL, &reply))
+    return NULL;
+
+  if (reply.memfd == -1)
+    {
+      /* Not in cache */
+      if (reply.id != 0)
+        call_forget (reply.id);
+      return NULL;
+    }
+
+  bytes = map_unique_memfd (reply.memfd, reply.size, &reply);
+
+  unique_reply_clear (&reply);
+  return bytes;
+}
+
+GBytes *
+g_bytes_unique_cache_get_or_compute (const char *key,
+                                     GBytesUniqueComputeFunc compute,
+                                     gpointer user_data,
+                                     GError **error)
+{
+  GBytes *bytes;
+  GBytes *computed;
+  gconstpointer data;
+  gsize len;
+
+  bytes = g_bytes_unique_cache_get (key);
+  if (bytes != NULL)
+    return bytes;
+
+  computed = compute (user_data, error);
+  if (computed == NULL)
+    return NULL;
+
+  data = g_bytes_get_data (computed, &len);
+  bytes = g_bytes_unique_cache_put (key, data, len);
+  g_bytes_unref (computed);
+
+  return bytes;
+}
+
 GBytes *
 g_bytes_new_unique_async (gconstpointer data, gsize len)
 {
+  guint8 digest[G_BYTES_UNIQUE_DIGEST_LEN];
   int memfd = -1;
   void *memfd_data = NULL;
+  GBytes *bytes;
 
-  memfd = create_sealed_memfd_for_data (data, len);
+  compute_digest (data, len, digest);
+
+  bytes = lookup_prefetched (digest, len);
+  if (bytes)
+    return bytes;
+
+  /* There is no round trip to avoid in brokerless mode */
+  bytes = new_unique_from_store (data, len, digest);
+  if (bytes)
+    return bytes;
+
+  memfd = create_sealed_memfd_for_data (data, len, digest);
   if (memfd >= 0)
     {
       memfd_data = mmap (NULL, len, PROT_READ, MAP_PRIVATE, memfd, 0);
@@ -340,3 +1444,1137 @@ g_bytes_new_unique_async (gconstpointer data, gsize len)
 
   return g_bytes_new (data, len); /* Fall back to regular copy */
 }
+
+/* Arenas batch many payloads into one sealed memfd, which uniqued takes
+   ranges of, instead of creating, sealing and passing a memfd for each.
+   Data uniqued adopts stays in the arena, which we map only once. */
+#define ARENA_ALIGN 8
+#define MAX_RANGES_PER_CALL 1024 /* Same as MAX_ARENA_RANGES in uniqued */
+
+typedef struct {
+  guint64 offset;
+  guint64 len;
+  GBytes *bytes;
+} ArenaEntry;
+
+struct _GBytesUniqueArena {
+  int memfd;
+  gsize size;
+  GArray *entries;
+};
+
+GBytesUniqueArena *
+g_bytes_unique_arena_new (void)
+{
+  GBytesUniqueArena *arena = g_new0 (GBytesUniqueArena, 1);
+
+  arena->memfd = memfd_create ("unique-arena", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  arena->entries = g_array_new (FALSE, TRUE, sizeof (ArenaEntry));
+
+  return arena;
+}
+
+void
+g_bytes_unique_arena_free (GBytesUniqueArena *arena)
+{
+  guint i;
+
+  for (i = 0; i < arena->entries->len; i++)
+    g_clear_pointer (&g_array_index (arena->entries, ArenaEntry, i).bytes, g_bytes_unref);
+  g_array_free (arena->entries, TRUE);
+  if (arena->memfd >= 0)
+    close (arena->memfd);
+  g_free (arena);
+}
+
+/* Copies data into the arena, returns its index in the array that
+   g_bytes_unique_arena_end() returns */
+guint
+g_bytes_unique_arena_add (GBytesUniqueArena *arena,
+                          gconstpointer data,
+                          gsize len)
+{
+  ArenaEntry entry = { (arena->size + ARENA_ALIGN - 1) & ~(gsize)(ARENA_ALIGN - 1), len };
+
+  if (len == 0 || arena->memfd < 0 ||
+      !write_all_to_fd (arena->memfd, data, len, entry.offset))
+    entry.bytes = g_bytes_new (data, len);
+  else
+    arena->size = entry.offset + len;
+
+  g_array_append_val (arena->entries, entry);
+  return arena->entries->len - 1;
+}
+
+/* Submits up to MAX_RANGES_PER_CALL entries from first on, and fills in
+   the ones uniqued handled. Returns how many that was (0 on error). */
+static guint
+call_make_unique_ranges (GBytesUniqueArena *arena,
+                         guint first)
+{
+  GDBusConnection *bus = get_bus ();
+  g_autoptr(GVariantBuilder) ranges = g_variant_builder_new (G_VARIANT_TYPE ("a(tt)"));
+  g_autoptr(GUnixFDList) fd_list = g_unix_fd_list_new ();
+  g_autoptr(GUnixFDList) response_fd_list = NULL;
+  g_autoptr(GVariant) response = NULL;
+  g_autoptr(GVariant) results = NULL;
+  g_autoptr(GArray) submitted = g_array_new (FALSE, FALSE, sizeof (guint));
+  gint memfd_handle;
+  guint i;
+
+  for (i = first; i < arena->entries->len && submitted->len < MAX_RANGES_PER_CALL; i++)
+    {
+      ArenaEntry *entry = &g_array_index (arena->entries, ArenaEntry, i);
+
+      if (entry->bytes != NULL)
+        continue;
+
+      g_variant_builder_add (ranges, "(tt)", entry->offset, entry->len);
+      g_array_append_val (submitted, i);
+    }
+
+  memfd_handle = g_unix_fd_list_append (fd_list, arena->memfd, NULL);
+  if (memfd_handle == -1)
+    return 0;
+
+  response = g_dbus_connection_call_with_unix_fd_list_sync (bus,
+                                                            "org.freedesktop.portal.Unique",
+                                                            "/org/freedesktop/portal/unique",
+                                                            "org.freedesktop.portal.Unique",
+                                                            "MakeUniqueRanges",
+                                                            g_variant_new ("(ha(tt))", memfd_handle, ranges),
+                                                            G_VARIANT_TYPE ("(a(ahuaytt))"),
+                                                            G_DBUS_CALL_FLAGS_NONE,
+                                                            1000, /* msec timeout */
+                                                            fd_list, &response_fd_list,
+                                                            NULL, NULL);
+  if (response == NULL)
+    return 0;
+
+  results = g_variant_get_child_value (response, 0);
+  for (i = 0; i < g_variant_n_children (results) && i < submitted->len; i++)
+    {
+      g_autoptr(GVariant) result = g_variant_get_child_value (results, i);
+      g_autoptr(GVariant) handles = g_variant_get_child_value (result, 0);
+      ArenaEntry *entry = &g_array_index (arena->entries, ArenaEntry, g_array_index (submitted, guint, i));
+      UniqueReply reply = { -1 };
+
+      parse_unique_reply (result, 0, response_fd_list, &reply);
+      if (reply.memfd != -1)
+        entry->bytes = map_unique_memfd (reply.memfd, entry->len, &reply);
+      else if (g_variant_n_children (handles) > 0)
+        {
+          if (reply.id != 0)
+            call_forget (reply.id);
+        }
+      else
+        {
+          /* Adopted, uniqued uses our copy */
+          reply.packed = TRUE;
+          reply.memfd = arena->memfd;
+          entry->bytes = map_packed_blob (entry->len, &reply);
+          reply.memfd = -1;
+        }
+      unique_reply_clear (&reply);
+    }
+
+  return i;
+}
+
+/* Seals the arena and returns a GBytes for each payload added, in order.
+   Each is shared with uniqued like from g_bytes_new_unique_sync(), but
+   it takes only a few round trips for the whole arena. */
+GPtrArray *
+g_bytes_unique_arena_end (GBytesUniqueArena *arena)
+{
+  GPtrArray *result = g_ptr_array_new_full (arena->entries->len, (GDestroyNotify)g_bytes_unref);
+  MappedSegment *segment = NULL;
+  guint i, first;
+
+  if (arena->size > 0 &&
+      fcntl (arena->memfd, F_ADD_SEALS, (int) F_SEAL_SEAL|F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE) == 0)
+    {
+      G_LOCK (mapped);
+      segment = mapped_segment_get (arena->memfd, arena->size);
+      G_UNLOCK (mapped);
+    }
+
+  if (segment != NULL && get_bus () != NULL && get_store_dir_fd () == -1)
+    {
+      first = 0;
+      while (first < arena->entries->len)
+        {
+          guint old_first = first;
+
+          if (call_make_unique_ranges (arena, first) == 0)
+            break;
+
+          /* Skip what uniqued handled, and what we had copies of */
+          for (; first < arena->entries->len; first++)
+            {
+              ArenaEntry *entry = &g_array_index (arena->entries, ArenaEntry, first);
+              if (entry->bytes == NULL)
+                break;
+            }
+
+          if (first == old_first)
+            break;
+        }
+    }
+
+  for (i = 0; i < arena->entries->len; i++)
+    {
+      ArenaEntry *entry = &g_array_index (arena->entries, ArenaEntry, i);
+
+      /* Without uniqued, fall back like g_bytes_new_unique_sync() */
+      if (entry->bytes == NULL && segment != NULL)
+        entry->bytes = g_bytes_new_unique_sync ((guchar *)segment->data + entry->offset, entry->len);
+      if (entry->bytes == NULL)
+        {
+          gpointer data = g_malloc (entry->len);
+          if (pread (arena->memfd, data, entry->len, entry->offset) != (ssize_t)entry->len)
+            memset (data, 0, entry->len);
+          entry->bytes = g_bytes_new_take (data, entry->len);
+        }
+
+      g_ptr_array_add (result, g_steal_pointer (&entry->bytes));
+    }
+
+  if (segment != NULL)
+    {
+      G_LOCK (mapped);
+      mapped_segment_unref (segment);
+      G_UNLOCK (mapped);
+    }
+
+  return result;
+}
+
+/* Returns the digest uniqued computed for bytes, if bytes is a mapping
+   made by us and the digest is known (for async uniquing it is only known
+   once uniqued replied). */
+const guint8 *
+g_bytes_unique_get_digest (GBytes *bytes)
+{
+  const guint8 *digest = NULL;
+  gconstpointer data;
+  MappedAddress *address;
+  gsize len;
+
+  data = g_bytes_get_data (bytes, &len);
+  if (data == NULL)
+    return NULL;
+
+  G_LOCK (mapped);
+  address = mapped_by_address ? g_hash_table_lookup (mapped_by_address, data) : NULL;
+  if (address != NULL && address->len == len && address->has_digest)
+    digest = address->digest; /* Never changes once set, lives as long as bytes */
+  G_UNLOCK (mapped);
+
+  return digest;
+}
+
+/* Must give the same result for equal content whether or not it is
+   unique, so for other GBytes we compute the same digest uniqued would. */
+guint
+g_bytes_unique_hash (gconstpointer bytes)
+{
+  const guint8 *unique_digest = g_bytes_unique_get_digest ((GBytes *)bytes);
+  guint8 digest[G_BYTES_UNIQUE_DIGEST_LEN];
+  guint hash;
+
+  if (unique_digest == NULL)
+    {
+      gconstpointer data;
+      gsize len;
+
+      data = g_bytes_get_data ((GBytes *)bytes, &len);
+      compute_digest (data, len, digest);
+      unique_digest = digest;
+    }
+
+  memcpy (&hash, unique_digest, sizeof (hash));
+  return hash;
+}
+
+/* Two unique GBytes are equal exactly when they have the same blob, i.e.
+   the same digest. */
+gboolean
+g_bytes_unique_equal (gconstpointer bytes1,
+                      gconstpointer bytes2)
+{
+  const guint8 *digest1, *digest2;
+  gconstpointer data1, data2;
+  gsize len1, len2;
+
+  data1 = g_bytes_get_data ((GBytes *)bytes1, &len1);
+  data2 = g_bytes_get_data ((GBytes *)bytes2, &len2);
+  if (len1 != len2)
+    return FALSE;
+  if (data1 == data2)
+    return TRUE;
+
+  digest1 = g_bytes_unique_get_digest ((GBytes *)bytes1);
+  digest2 = g_bytes_unique_get_digest ((GBytes *)bytes2);
+  if (digest1 != NULL && digest2 != NULL)
+    return memcmp (digest1, digest2, G_BYTES_UNIQUE_DIGEST_LEN) == 0;
+
+  return g_bytes_equal (bytes1, bytes2);
+}
+
+static const UniqueInternHeader *
+map_intern_table (void)
+{
+  GDBusConnection *bus = get_bus ();
+  GUnixFDList *response_fd_list = NULL;
+  const UniqueInternHeader *header;
+  GVariant *response;
+  struct stat statbuf;
+  gint32 handle;
+  void *data;
+  int seals;
+  int fd;
+
+  if (bus == NULL)
+    return NULL;
+
+  response = g_dbus_connection_call_with_unix_fd_list_sync (bus,
+                                                            "org.freedesktop.portal.Unique",
+                                                            "/org/freedesktop/portal/unique",
+                                                            "org.freedesktop.portal.Unique",
+                                                            "GetInternTable",
+                                                            NULL,
+                                                            G_VARIANT_TYPE ("(h)"),
+                                                            G_DBUS_CALL_FLAGS_NONE,
+                                                            1000, /* msec timeout */
+                                                            NULL, &response_fd_list,
+                                                            NULL, NULL);
+  if (response == NULL)
+    return NULL;
+
+  g_variant_get (response, "(h)", &handle);
+  fd = steal_one_fd_from_list (response_fd_list, handle);
+  g_clear_object (&response_fd_list);
+  g_variant_unref (response);
+
+  if (fd == -1)
+    return NULL;
+
+  /* Make sure nobody but uniqued can change the table under us */
+  seals = fcntl (fd, F_GET_SEALS);
+  if (seals == -1 ||
+      (seals & (F_SEAL_SHRINK | F_SEAL_FUTURE_WRITE)) != (F_SEAL_SHRINK | F_SEAL_FUTURE_WRITE) ||
+      fstat (fd, &statbuf) != 0 ||
+      statbuf.st_size < sizeof (UniqueInternHeader))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  /* Shared, so we see new entries as uniqued adds them */
+  data = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  header = data;
+  if (header->magic != UNIQUE_INTERN_MAGIC ||
+      header->size != statbuf.st_size ||
+      header->n_buckets == 0 ||
+      (header->n_buckets & (header->n_buckets - 1)) != 0 ||
+      header->strings_offset != sizeof (UniqueInternHeader) + (gsize)header->n_buckets * sizeof (guint32) ||
+      header->strings_offset > header->size)
+    {
+      munmap (data, statbuf.st_size);
+      return NULL;
+    }
+
+  return header;
+}
+
+/* The table stays mapped for the lifetime of the process */
+static const UniqueInternHeader *
+get_intern_table (void)
+{
+  static gsize initialized = 0;
+  static const UniqueInternHeader *intern_table;
+
+  if (g_once_init_enter (&initialized))
+    {
+      intern_table = map_intern_table ();
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return intern_table;
+}
+
+static const char *
+intern_table_string (const UniqueInternHeader *table,
+                     guint32 offset,
+                     const char *str,
+                     gsize len)
+{
+  const UniqueInternEntry *entry;
+
+  if (offset < table->strings_offset ||
+      offset > table->size - sizeof (UniqueInternEntry) - len - 1)
+    return NULL;
+
+  entry = (const UniqueInternEntry *)((const char *)table + offset);
+  if (entry->len != len || memcmp (entry->str, str, len + 1) != 0)
+    return NULL;
+
+  return entry->str;
+}
+
+/* Strings we had to intern locally, say because the Intern call timed
+   out. They keep their local pointer even once they make it into the
+   shared table, so that a string is always interned to the same one. */
+G_LOCK_DEFINE_STATIC (local_interned);
+static GHashTable *local_interned;
+
+static const char *
+intern_table_lookup (const UniqueInternHeader *table,
+                     const char *str)
+{
+  gsize len = strlen (str);
+  guint32 offset;
+
+  if (table == NULL || len > UNIQUE_INTERN_MAX_STRING_LEN)
+    return NULL;
+
+  offset = unique_intern_lookup (table, str, len, unique_intern_hash (str, len));
+  if (offset == 0)
+    return NULL;
+
+  return intern_table_string (table, offset, str, len);
+}
+
+void
+g_unique_intern_strings (const char **strings,
+                         guint n_strings,
+                         const char **interned_out)
+{
+  const UniqueInternHeader *table = get_intern_table ();
+  g_autoptr(GArray) missing = g_array_new (FALSE, FALSE, sizeof (guint));
+  guint i;
+
+  for (i = 0; i < n_strings; i++)
+    {
+      gsize len = strlen (strings[i]);
+
+      interned_out[i] = NULL;
+      if (table == NULL || len > UNIQUE_INTERN_MAX_STRING_LEN)
+        continue;
+
+      /* Can't be sent as a D-Bus string, nor be in the table */
+      if (!g_utf8_validate (strings[i], len, NULL))
+        continue;
+
+      interned_out[i] = intern_table_lookup (table, strings[i]);
+      if (interned_out[i] == NULL)
+        g_array_append_val (missing, i);
+    }
+
+  /* Add all the new ones in one go */
+  if (missing->len > 0)
+    {
+      g_autoptr(GVariantBuilder) strings_builder = g_variant_builder_new (G_VARIANT_TYPE ("as"));
+      g_autoptr(GVariant) response = NULL;
+
+      for (i = 0; i < missing->len; i++)
+        g_variant_builder_add (strings_builder, "s", strings[g_array_index (missing, guint, i)]);
+
+      response = g_dbus_connection_call_sync (get_bus (),
+                                              "org.freedesktop.portal.Unique",
+                                              "/org/freedesktop/portal/unique",
+                                              "org.freedesktop.portal.Unique",
+                                              "Intern",
+                                              g_variant_new ("(as)", strings_builder),
+                                              G_VARIANT_TYPE ("(au)"),
+                                              G_DBUS_CALL_FLAGS_NONE,
+                                              1000, /* msec timeout */
+                                              NULL, NULL);
+      if (response != NULL)
+        {
+          g_autoptr(GVariant) offsets_v = g_variant_get_child_value (response, 0);
+          gsize n_offsets;
+          const guint32 *offsets = g_variant_get_fixed_array (offsets_v, &n_offsets, sizeof (guint32));
+
+          for (i = 0; i < missing->len && i < n_offsets; i++)
+            {
+              guint j = g_array_index (missing, guint, i);
+              if (offsets[i] != 0)
+                interned_out[j] = intern_table_string (table, offsets[i], strings[j], strlen (strings[j]));
+            }
+        }
+    }
+
+  /* Whatever didn't make it into the shared table is interned locally.
+     Local ones win, and the table is checked again before adding one,
+     as another thread may have returned the shared pointer meanwhile. */
+  G_LOCK (local_interned);
+  for (i = 0; i < n_strings; i++)
+    {
+      const char *local = local_interned ? g_hash_table_lookup (local_interned, strings[i]) : NULL;
+
+      if (local != NULL)
+        interned_out[i] = local;
+      else if (interned_out[i] == NULL)
+        {
+          if (g_utf8_validate (strings[i], -1, NULL))
+            interned_out[i] = intern_table_lookup (table, strings[i]);
+
+          if (interned_out[i] == NULL)
+            {
+              local = g_intern_string (strings[i]);
+              if (local_interned == NULL)
+                local_interned = g_hash_table_new (g_str_hash, g_str_equal);
+              g_hash_table_add (local_interned, (char *)local);
+              interned_out[i] = local;
+            }
+        }
+    }
+  G_UNLOCK (local_interned);
+}
+
+const char *
+g_unique_intern_string (const char *string)
+{
+  const char *interned;
+
+  g_unique_intern_strings (&string, 1, &interned);
+
+  return interned;
+}
+
+guint32
+g_unique_intern_string_get_id (const char *interned)
+{
+  const UniqueInternHeader *table = get_intern_table ();
+  const char *start = (const char *)table;
+
+  if (table == NULL ||
+      interned < start + table->strings_offset + sizeof (UniqueInternEntry) ||
+      interned >= start + table->size)
+    return 0;
+
+  return interned - start - G_STRUCT_OFFSET (UniqueInternEntry, str);
+}
+
+/* Keep well below the bus limit on fds per message */
+#define MAX_PREFETCH_BATCH 16
+
+static void
+call_prefetch (GVariant *batch)
+{
+  GDBusConnection *bus = get_bus ();
+  GUnixFDList *response_fd_list = NULL;
+  g_autoptr(GVariantIter) found_iter = NULL;
+  g_autoptr(GVariant) response = NULL;
+  GVariant *digest_v;
+  gint32 handle;
+  guint32 id;
+  guint64 offset, size;
+
+  if (bus == NULL)
+    {
+      g_variant_unref (g_variant_ref_sink (batch));
+      return;
+    }
+
+  response = g_dbus_connection_call_with_unix_fd_list_sync (bus,
+                                                            "org.freedesktop.portal.Unique",
+                                                            "/org/freedesktop/portal/unique",
+                                                            "org.freedesktop.portal.Unique",
+                                                            "Prefetch",
+                                                            g_variant_new ("(@a(ayt))", batch),
+                                                            G_VARIANT_TYPE ("(a(ayhutt))"),
+                                                            G_DBUS_CALL_FLAGS_NONE,
+                                                            1000, /* msec timeout */
+                                                            NULL, &response_fd_list,
+                                                            NULL, NULL);
+  if (response == NULL)
+    return;
+
+  g_variant_get (response, "(a(ayhutt))", &found_iter);
+  while (g_variant_iter_next (found_iter, "(@ayhutt)", &digest_v, &handle, &id, &offset, &size))
+    {
+      UniqueReply reply = { -1, id, FALSE };
+      gconstpointer digest;
+      gsize digest_len;
+      GBytes *bytes = NULL;
+      int fd;
+
+      fd = g_unix_fd_list_get (response_fd_list, handle, NULL);
+      digest = g_variant_get_fixed_array (digest_v, &digest_len, 1);
+      if (fd != -1 &&
+          digest_len == G_BYTES_UNIQUE_DIGEST_LEN)
+        {
+          memcpy (reply.digest, digest, G_BYTES_UNIQUE_DIGEST_LEN);
+          reply.has_digest = TRUE;
+          unique_reply_set_memfd (&reply, fd, offset, size);
+          bytes = map_unique_memfd (fd, size, &reply);
+        }
+      else
+        call_forget (id);
+
+      if (bytes != NULL)
+        {
+          G_LOCK (prefetch);
+          if (prefetched == NULL)
+            prefetched = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                                (GDestroyNotify)g_bytes_unref, (GDestroyNotify)g_bytes_unref);
+          g_hash_table_insert (prefetched, g_bytes_new (digest, digest_len), bytes);
+          G_UNLOCK (prefetch);
+        }
+
+      if (fd != -1)
+        close (fd);
+      g_variant_unref (digest_v);
+    }
+
+  g_clear_object (&response_fd_list);
+}
+
+/* Maps all blobs in manifest (of type a(ayt), digest and size) that
+   uniqued has, in as few round trips as possible. They are then returned
+   by g_bytes_unique_lookup() and g_bytes_new_unique_*() with the same
+   content, without talking to uniqued. */
+void
+g_bytes_unique_prefetch (GVariant *manifest)
+{
+  g_autoptr(GVariantBuilder) batch = NULL;
+  GVariantIter iter;
+  GVariant *entry;
+  guint n = 0;
+
+  g_variant_iter_init (&iter, manifest);
+  while ((entry = g_variant_iter_next_value (&iter)) != NULL)
+    {
+      if (batch == NULL)
+        batch = g_variant_builder_new (G_VARIANT_TYPE ("a(ayt)"));
+      g_variant_builder_add_value (batch, entry);
+      g_variant_unref (entry);
+
+      if (++n == MAX_PREFETCH_BATCH)
+        {
+          call_prefetch (g_variant_builder_end (batch));
+          g_clear_pointer (&batch, g_variant_builder_unref);
+          n = 0;
+        }
+    }
+
+  if (batch != NULL)
+    call_prefetch (g_variant_builder_end (batch));
+}
+
+/* Drops the prefetched blobs nobody used */
+void
+g_bytes_unique_prefetch_release (void)
+{
+  G_LOCK (prefetch);
+  g_clear_pointer (&prefetched, g_hash_table_unref);
+  G_UNLOCK (prefetch);
+}
+
+GBytes *
+g_bytes_unique_lookup (const guint8 *digest, gsize size)
+{
+  return lookup_prefetched (digest, size);
+}
+
+gboolean
+g_bytes_unique_save_manifest (GError **error)
+{
+  g_autoptr(GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayt)"));
+  g_autoptr(GVariant) manifest = NULL;
+  g_autofree char *path = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  G_LOCK (manifest);
+  path = g_strdup (manifest_path);
+  if (manifest_entries != NULL)
+    {
+      g_hash_table_iter_init (&iter, manifest_entries);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        g_variant_builder_add (builder, "(@ayt)",
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                          g_bytes_get_data (key, NULL),
+                                                          G_BYTES_UNIQUE_DIGEST_LEN, 1),
+                               (guint64)GPOINTER_TO_SIZE (value));
+    }
+  G_UNLOCK (manifest);
+
+  if (path == NULL)
+    return TRUE;
+
+  manifest = g_variant_ref_sink (g_variant_builder_end (builder));
+
+  return g_file_set_contents (path, g_variant_get_data (manifest), g_variant_get_size (manifest), error);
+}
+
+static void
+save_manifest_at_exit (void)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!g_bytes_unique_save_manifest (&error))
+    g_warning ("Failed to save unique manifest: %s", error->message);
+}
+
+/* Prefetches everything recorded in the manifest at path by the previous
+   run, and records the blobs this run uses into it at exit. */
+void
+g_bytes_unique_record_manifest (const char *path)
+{
+  g_autoptr(GVariant) manifest = NULL;
+  gboolean first;
+  char *contents;
+  gsize len;
+
+  if (g_file_get_contents (path, &contents, &len, NULL))
+    {
+      manifest = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("a(ayt)"),
+                                                              contents, len, FALSE,
+                                                              g_free, contents));
+      g_bytes_unique_prefetch (manifest);
+    }
+
+  G_LOCK (manifest);
+  first = manifest_path == NULL;
+  g_free (manifest_path);
+  manifest_path = g_strdup (path);
+  if (manifest_entries == NULL)
+    manifest_entries = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                              (GDestroyNotify)g_bytes_unref, NULL);
+  G_UNLOCK (manifest);
+
+  if (first)
+    atexit (save_manifest_at_exit);
+}
+
+/* Channels: each subscribed GUniqueChannel holds the latest version of
+   its channel uniqued told us about. ChannelUpdated signals are handled
+   in the D-Bus worker thread, which swaps in the new version under the
+   channels lock and then lets the subscriber know in its main context.
+   Readers keep whatever version they got for as long as they want.
+   If uniqued restarts, we subscribe again to the new instance, whose
+   versions start over. */
+struct _GUniqueChannel {
+  gint ref_count;
+  char *name;
+  gboolean subscribed;
+  GBytes *latest;
+  guint64 version;
+  GMainContext *context;
+  GUniqueChannelFunc updated;
+  gpointer user_data;
+};
+
+G_LOCK_DEFINE_STATIC (channels);
+static GHashTable *subscribed_channels; /* Name -> GList of GUniqueChannel */
+
+static GUniqueChannel *
+channel_ref (GUniqueChannel *channel)
+{
+  g_atomic_int_inc (&channel->ref_count);
+  return channel;
+}
+
+static void
+channel_unref (GUniqueChannel *channel)
+{
+  if (g_atomic_int_dec_and_test (&channel->ref_count))
+    {
+      g_clear_pointer (&channel->latest, g_bytes_unref);
+      g_main_context_unref (channel->context);
+      g_free (channel->name);
+      g_free (channel);
+    }
+}
+
+static gboolean
+channel_notify (gpointer user_data)
+{
+  GUniqueChannel *channel = user_data;
+  gboolean subscribed;
+
+  G_LOCK (channels);
+  subscribed = channel->subscribed;
+  G_UNLOCK (channels);
+
+  if (subscribed)
+    channel->updated (channel, channel->user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Makes bytes (which may be NULL) the latest version of channel, unless
+   we already have a newer one. Called with the channels lock held,
+   returns what the caller should unref after dropping it. */
+static GBytes *
+channel_set_latest (GUniqueChannel *channel,
+                    GBytes *bytes,
+                    guint64 version)
+{
+  GBytes *old;
+
+  if (bytes == NULL || version <= channel->version)
+    return bytes;
+
+  old = channel->latest;
+  channel->latest = bytes;
+  channel->version = version;
+
+  return old;
+}
+
+/* Makes bytes the latest version of every channel subscribed to as
+   name, and notifies those that changed. Takes over bytes. */
+static void
+channel_name_set_latest (const char *name,
+                         GBytes *bytes,
+                         guint64 version)
+{
+  g_autoptr(GPtrArray) unrefs = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_autoptr(GPtrArray) notify = g_ptr_array_new_with_free_func ((GDestroyNotify)channel_unref);
+  GList *l;
+  guint i;
+
+  /* If we unsubscribed in the meantime, this drops the handle again */
+  G_LOCK (channels);
+  l = subscribed_channels ? g_hash_table_lookup (subscribed_channels, name) : NULL;
+  for (; l != NULL; l = l->next)
+    {
+      GUniqueChannel *channel = l->data;
+      GBytes *old;
+
+      old = channel_set_latest (channel, g_bytes_ref (bytes), version);
+      if (old != bytes && channel->updated != NULL)
+        g_ptr_array_add (notify, channel_ref (channel));
+      if (old)
+        g_ptr_array_add (unrefs, old);
+    }
+  G_UNLOCK (channels);
+
+  g_bytes_unref (bytes);
+
+  for (i = 0; i < notify->len; i++)
+    {
+      GUniqueChannel *channel = notify->pdata[i];
+
+      g_main_context_invoke_full (channel->context, G_PRIORITY_DEFAULT,
+                                  channel_notify, channel_ref (channel),
+                                  (GDestroyNotify)channel_unref);
+    }
+}
+
+static void
+channel_updated (GDBusMessage *message)
+{
+  UniqueReply reply = { -1 };
+  GVariant *body = g_dbus_message_get_body (message);
+  GBytes *bytes = NULL;
+  const char *name;
+  guint64 version;
+
+  if (body == NULL || !g_variant_is_of_type (body, G_VARIANT_TYPE ("(stahuaytt)")))
+    return;
+
+  /* Not from uniqued, so the handle isn't ours to forget */
+  if (!is_from_uniqued (message))
+    return;
+
+  g_variant_get_child (body, 0, "&s", &name);
+  g_variant_get_child (body, 1, "t", &version);
+  parse_unique_reply (body, 2, g_dbus_message_get_unix_fd_list (message), &reply);
+
+  if (reply.memfd != -1)
+    bytes = map_unique_memfd (reply.memfd, reply.size, &reply);
+  else if (reply.id != 0)
+    call_forget (reply.id);
+  unique_reply_clear (&reply);
+
+  if (bytes != NULL)
+    channel_name_set_latest (name, bytes, version);
+}
+
+/* Subscribes to the channel called name in uniqued, and returns its
+   latest version, if any */
+static GBytes *
+call_subscribe (const char *name,
+                guint64 *version)
+{
+  g_autoptr(GVariant) response = NULL;
+  UniqueReply reply = { -1 };
+  GBytes *bytes = NULL;
+
+  response = call_unique_method_full ("Subscribe", g_variant_new ("(s)", name),
+                                      G_VARIANT_TYPE ("(ahuayttt)"), NULL, &reply);
+  if (response == NULL)
+    return NULL;
+
+  g_variant_get_child (response, 5, "t", version);
+
+  if (reply.memfd != -1)
+    bytes = map_unique_memfd (reply.memfd, reply.size, &reply);
+  else if (reply.id != 0)
+    call_forget (reply.id);
+  unique_reply_clear (&reply);
+
+  return bytes;
+}
+
+static gpointer
+resubscribe_thread (gpointer data)
+{
+  g_autoptr(GPtrArray) names = data;
+  GDBusConnection *bus = get_bus ();
+  guint i;
+
+  for (i = 0; i < names->len; i++)
+    {
+      const char *name = names->pdata[i];
+      guint64 version = 0;
+      GBytes *bytes;
+
+      bytes = call_subscribe (name, &version);
+      if (bytes != NULL)
+        channel_name_set_latest (name, bytes, version);
+
+      /* Undo the subscription if the last subscriber left meanwhile,
+         like g_unique_channel_unsubscribe() would have */
+      G_LOCK (channels);
+      if (subscribed_channels == NULL ||
+          g_hash_table_lookup (subscribed_channels, name) == NULL)
+        g_dbus_connection_call (bus,
+                                "org.freedesktop.portal.Unique",
+                                "/org/freedesktop/portal/unique",
+                                "org.freedesktop.portal.Unique",
+                                "Unsubscribe",
+                                g_variant_new ("(s)", name),
+                                G_VARIANT_TYPE ("()"),
+                                G_DBUS_CALL_FLAGS_NONE,
+                                G_MAXINT,
+                                NULL, NULL, NULL);
+      G_UNLOCK (channels);
+    }
+
+  return NULL;
+}
+
+/* A new uniqued knows nothing of our subscriptions, and numbers the
+   versions from scratch, so we start over with it. Called in the D-Bus
+   worker thread, which can't wait for replies, so a thread of its own
+   subscribes again. */
+static void
+uniqued_owner_changed (GDBusMessage *message)
+{
+  GVariant *body = g_dbus_message_get_body (message);
+  const char *name, *old_owner, *new_owner;
+  GPtrArray *names = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (body == NULL || !g_variant_is_of_type (body, G_VARIANT_TYPE ("(sss)")))
+    return;
+
+  g_variant_get (body, "(&s&s&s)", &name, &old_owner, &new_owner);
+  if (!g_str_equal (name, "org.freedesktop.portal.Unique"))
+    return;
+
+  g_debug ("uniqued owner changed from '%s' to '%s'", old_owner, new_owner);
+
+  G_LOCK (owner);
+  owner_serial++;
+  g_free (uniqued_owner);
+  uniqued_owner = *new_owner ? g_strdup (new_owner) : NULL;
+  G_UNLOCK (owner);
+
+  G_LOCK (channels);
+  if (*new_owner && subscribed_channels != NULL &&
+      g_hash_table_size (subscribed_channels) > 0)
+    {
+      names = g_ptr_array_new_with_free_func (g_free);
+      g_hash_table_iter_init (&iter, subscribed_channels);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          GList *l;
+
+          /* Keep the latest data until the new uniqued has some */
+          for (l = value; l != NULL; l = l->next)
+            ((GUniqueChannel *)l->data)->version = 0;
+          g_ptr_array_add (names, g_strdup (key));
+        }
+    }
+  G_UNLOCK (channels);
+
+  if (names != NULL)
+    g_thread_unref (g_thread_new ("unique-channels", resubscribe_thread, names));
+}
+
+/* Subscribes to the channel called name (in the same sharing domain as
+   cache keys), whose latest version is then available from
+   g_unique_channel_get_latest(). When a new version is published, updated
+   is called in the thread-default main context of the caller. */
+GUniqueChannel *
+g_unique_channel_subscribe (const char *name,
+                            GUniqueChannelFunc updated,
+                            gpointer user_data)
+{
+  GDBusConnection *bus = get_bus ();
+  GUniqueChannel *channel;
+  GBytes *bytes;
+  guint64 version = 0;
+  GList *list;
+
+  channel = g_new0 (GUniqueChannel, 1);
+  channel->ref_count = 1;
+  channel->name = g_strdup (name);
+  channel->subscribed = TRUE;
+  channel->context = g_main_context_ref_thread_default ();
+  channel->updated = updated;
+  channel->user_data = user_data;
+
+  if (bus == NULL)
+    return channel;
+
+  /* Register first, so we don't miss updates racing with the reply */
+  G_LOCK (channels);
+  if (subscribed_channels == NULL)
+    subscribed_channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  list = g_hash_table_lookup (subscribed_channels, name);
+  g_hash_table_replace (subscribed_channels, g_strdup (name), g_list_prepend (list, channel));
+  G_UNLOCK (channels);
+
+  bytes = call_subscribe (name, &version);
+
+  G_LOCK (channels);
+  bytes = channel_set_latest (channel, bytes, version);
+  G_UNLOCK (channels);
+
+  if (bytes)
+    g_bytes_unref (bytes);
+
+  return channel;
+}
+
+/* Returns the latest version of the channel we know of, or NULL if
+   nothing has been published to it yet. Version numbers start at 1 and
+   grow with each publish of new content. */
+GBytes *
+g_unique_channel_get_latest (GUniqueChannel *channel,
+                             guint64 *version)
+{
+  GBytes *bytes = NULL;
+
+  G_LOCK (channels);
+  if (channel->latest)
+    bytes = g_bytes_ref (channel->latest);
+  if (version)
+    *version = channel->version;
+  G_UNLOCK (channels);
+
+  return bytes;
+}
+
+/* Stops updates and frees channel. Versions returned by
+   g_unique_channel_get_latest() stay valid until they are unreffed. */
+void
+g_unique_channel_unsubscribe (GUniqueChannel *channel)
+{
+  GDBusConnection *bus = get_bus ();
+  GList *list;
+
+  G_LOCK (channels);
+  channel->subscribed = FALSE;
+  if (subscribed_channels != NULL &&
+      (list = g_hash_table_lookup (subscribed_channels, channel->name)) != NULL)
+    {
+      list = g_list_remove (list, channel);
+      if (list != NULL)
+        g_hash_table_replace (subscribed_channels, g_strdup (channel->name), list);
+      else
+        {
+          g_hash_table_remove (subscribed_channels, channel->name);
+
+          /* Sent with the lock held, so it can't overtake a Subscribe
+             from another thread */
+          g_dbus_connection_call (bus,
+                                  "org.freedesktop.portal.Unique",
+                                  "/org/freedesktop/portal/unique",
+                                  "org.freedesktop.portal.Unique",
+                                  "Unsubscribe",
+                                  g_variant_new ("(s)", channel->name),
+                                  G_VARIANT_TYPE ("()"),
+                                  G_DBUS_CALL_FLAGS_NONE,
+                                  G_MAXINT,
+                                  NULL, NULL, NULL);
+        }
+    }
+  G_UNLOCK (channels);
+
+  channel_unref (channel);
+}
+
+/* Publishes data as the new latest version of the channel called name,
+   and returns it (shared with uniqued, like g_bytes_unique_cache_put()).
+   Publishing the same content as the latest version is a no-op. */
+GBytes *
+g_unique_channel_publish (const char *name,
+                          gconstpointer data,
+                          gsize len,
+                          guint64 *version,
+                          GError **error)
+{
+  guint8 digest[G_BYTES_UNIQUE_DIGEST_LEN];
+  g_autoptr(GUnixFDList) fd_list = g_unix_fd_list_new ();
+  g_autoptr(GVariant) response = NULL;
+  GBytes *bytes = NULL;
+  UniqueReply reply = { -1 };
+  gint memfd_handle;
+  int memfd;
+
+  compute_digest (data, len, digest);
+  memfd = create_sealed_memfd_for_data (data, len, digest);
+  if (memfd < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to create memfd");
+      return NULL;
+    }
+
+  memfd_handle = g_unix_fd_list_append (fd_list, memfd, NULL);
+  if (memfd_handle != -1)
+    response = call_unique_method_full ("Publish", g_variant_new ("(sh)", name, memfd_handle),
+                                        G_VARIANT_TYPE ("(ahuayttt)"), fd_list, &reply);
+  if (response == NULL)
+    {
+      close (memfd);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to publish to channel %s", name);
+      return NULL;
+    }
+
+  if (version)
+    g_variant_get_child (response, 5, "t", version);
+
+  if (reply.memfd != -1 && !reply.packed)
+    {
+      close (memfd);
+      memfd = reply.memfd;
+      reply.memfd = -1;
+    }
+
+  bytes = map_unique_memfd (memfd, len, &reply);
+  unique_reply_clear (&reply);
+  close (memfd);
+
+  /* The channel has it regardless */
+  if (bytes == NULL)
+    bytes = g_bytes_new (data, len);
+
+  return bytes;
+}
@@ -1,4 +1,96 @@
 #include <glib.h>
 
+#define G_BYTES_UNIQUE_DIGEST_LEN 20 /* SHA1 */
+
 GBytes * g_bytes_new_unique_async (gconstpointer data, gsize len);
 GBytes * g_bytes_new_unique_sync (gconstpointer data, gsize len);
+
+/* Arenas: for submitting many blobs at once, the data is copied into a
+ * single memfd, which uniqued takes ranges of, instead of one memfd and
+ * round trip per blob. g_bytes_unique_arena_end() returns the GBytes for
+ * everything added, in order. */
+typedef struct _GBytesUniqueArena GBytesUniqueArena;
+
+GBytesUniqueArena * g_bytes_unique_arena_new  (void);
+guint               g_bytes_unique_arena_add  (GBytesUniqueArena *arena,
+                                               gconstpointer data,
+                                               gsize len);
+GPtrArray *         g_bytes_unique_arena_end  (GBytesUniqueArena *arena);
+void                g_bytes_unique_arena_free (GBytesUniqueArena *arena);
+
+/* For passing data to other processes: g_bytes_unique_memfd_new() returns
+ * a sealed memfd with the data, and g_bytes_new_unique_from_memfd() maps
+ * such a memfd on the other end, sharing it through uniqued. */
+int      g_bytes_unique_memfd_new (gconstpointer data, gsize len);
+GBytes * g_bytes_new_unique_from_memfd (int memfd, GError **error);
+
+/* Without a session bus, or if $UNIQUE_BYTES_STORE is set, the
+ * g_bytes_new_unique_*() functions share data through a directory of
+ * digest-named files on tmpfs instead of uniqued. Unused entries are
+ * collected automatically now and then, or by calling this. */
+guint    g_bytes_unique_store_collect (void);
+
+/* Memo cache: stores data derived from a caller-defined key (for example
+ * "path+mtime+decoder-version") in uniqued, so that other processes can
+ * fetch the result instead of computing it again. */
+typedef GBytes * (*GBytesUniqueComputeFunc) (gpointer user_data, GError **error);
+
+GBytes * g_bytes_unique_cache_put (const char *key, gconstpointer data, gsize len);
+GBytes * g_bytes_unique_cache_put_memfd (const char *key, int memfd, GError **error);
+GBytes * g_bytes_unique_cache_get (const char *key);
+GBytes * g_bytes_unique_cache_get_or_compute (const char *key,
+                                              GBytesUniqueComputeFunc compute,
+                                              gpointer user_data,
+                                              GError **error);
+
+/* Returns the content digest of a GBytes created by this library, or
+ * NULL if it isn't unique (or uniqued hasn't replied yet). The hash and
+ * equal functions use it to avoid looking at the data, and work on any
+ * GBytes, but must not be mixed with g_bytes_hash()/g_bytes_equal() in
+ * the same table. */
+const guint8 * g_bytes_unique_get_digest (GBytes *bytes);
+guint          g_bytes_unique_hash (gconstpointer bytes);
+gboolean       g_bytes_unique_equal (gconstpointer bytes1,
+                                     gconstpointer bytes2);
+
+/* Interns strings in a table shared by all processes using uniqued, so
+ * that equal strings compare equal by pointer (like g_intern_string()),
+ * without a memfd per string. Misses are added in a single round trip
+ * per call. The id is the same in every process, like a cross-process
+ * GQuark, or 0 if the string had to be interned locally. */
+const char * g_unique_intern_string (const char *string);
+void         g_unique_intern_strings (const char **strings,
+                                      guint n_strings,
+                                      const char **interned_out);
+guint32      g_unique_intern_string_get_id (const char *interned);
+
+/* Startup prefetch: maps every blob in manifest (a(ayt): digest, size)
+ * that uniqued has in a few batched calls, so later g_bytes_new_unique_*()
+ * and g_bytes_unique_lookup() calls for them need no round trips.
+ * g_bytes_unique_record_manifest() prefetches the manifest a previous run
+ * saved at path, and saves the blobs used by this run there at exit. */
+void     g_bytes_unique_prefetch (GVariant *manifest);
+void     g_bytes_unique_prefetch_release (void);
+GBytes * g_bytes_unique_lookup (const guint8 *digest, gsize size);
+void     g_bytes_unique_record_manifest (const char *path);
+gboolean g_bytes_unique_save_manifest (GError **error);
+
+/* Channels: named, versioned data (say a routing table that is replaced
+ * now and then). Subscribers always have the latest version mapped, and
+ * switch to a new one without copying when it is published; old versions
+ * are freed once nobody uses them anymore. */
+typedef struct _GUniqueChannel GUniqueChannel;
+
+typedef void (*GUniqueChannelFunc) (GUniqueChannel *channel, gpointer user_data);
+
+GBytes *         g_unique_channel_publish     (const char *name,
+                                               gconstpointer data,
+                                               gsize len,
+                                               guint64 *version,
+                                               GError **error);
+GUniqueChannel * g_unique_channel_subscribe   (const char *name,
+                                               GUniqueChannelFunc updated,
+                                               gpointer user_data);
+GBytes *         g_unique_channel_get_latest  (GUniqueChannel *channel,
+                                               guint64 *version);
+void             g_unique_channel_unsubscribe (GUniqueChannel *channel);
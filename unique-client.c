@@ -2,6 +2,7 @@
 
 #include <glib.h>
 #include "unique-bytes.h"
+#include "unique-table.h"
 
 
 static gboolean
@@ -32,6 +33,89 @@ do_exit (gpointer user_data)
   return G_SOURCE_REMOVE;
 }
 
+static void
+build_table (GUniqueTableBuilder *builder,
+             gpointer             user_data)
+{
+  char **pairs = user_data;
+  guint i;
+
+  for (i = 0; pairs[i] != NULL; i++)
+    {
+      g_auto(GStrv) pair = g_strsplit (pairs[i], "=", 2);
+
+      if (pair[1] != NULL)
+        g_unique_table_builder_add (builder, pair[0], pair[1], strlen (pair[1]) + 1);
+    }
+}
+
+/* Gets the table NAME, built from the KEY=VALUE pairs unless it is
+   cached already, and prints what it has for each KEY */
+static int
+table_command (const char *name,
+               char       *pairs[])
+{
+  g_autoptr(GUniqueTable) table = NULL;
+  g_autoptr(GError) error = NULL;
+  guint i;
+
+  table = g_unique_table_get_or_build (name, build_table, pairs, &error);
+  if (table == NULL)
+    {
+      g_printerr ("Can't get table %s: %s\n", name, error->message);
+      return 1;
+    }
+
+  for (i = 0; pairs[i] != NULL; i++)
+    {
+      g_autofree char *key = g_strndup (pairs[i], strcspn (pairs[i], "="));
+      const char *value = g_unique_table_lookup (table, key, NULL);
+
+      if (value != NULL)
+        g_print ("%s=%s\n", key, value);
+      else
+        g_print ("%s missing\n", key);
+    }
+
+  return 0;
+}
+
+/* "put KEY VALUE" and "get KEY" access the memo cache, "share VALUE
+   SECONDS" makes VALUE unique and holds it for a while, and "table NAME
+   KEY=VALUE..." looks up keys in a unique table, for scripts */
+static int
+script_command (int   argc,
+                char *argv[])
+{
+  GBytes *data;
+
+  if (argc >= 3 && strcmp (argv[1], "table") == 0)
+    return table_command (argv[2], argv + 3);
+  else if (argc == 4 && strcmp (argv[1], "put") == 0)
+    data = g_bytes_unique_cache_put (argv[2], argv[3], strlen (argv[3]) + 1);
+  else if (argc == 3 && strcmp (argv[1], "get") == 0)
+    data = g_bytes_unique_cache_get (argv[2]);
+  else if (argc == 4 && strcmp (argv[1], "share") == 0)
+    data = g_bytes_new_unique_sync (argv[2], strlen (argv[2]) + 1);
+  else
+    {
+      g_printerr ("Usage: %s [put KEY VALUE | get KEY | share VALUE SECONDS | table NAME KEY=VALUE...]\n", argv[0]);
+      return 2;
+    }
+
+  if (data == NULL)
+    return 1;
+
+  g_print ("%s\n", (char *)g_bytes_get_data (data, NULL));
+
+  if (strcmp (argv[1], "share") == 0)
+    g_usleep (atoi (argv[3]) * G_USEC_PER_SEC);
+
+  g_bytes_unref (data);
+
+  return 0;
+}
+
 int
 main (int argc,
       char *argv[])
@@ -40,6 +124,9 @@ main (int argc,
   char *str = "Hello, World!";
   GBytes *data1, *data2, *data3;
 
+  if (argc > 1)
+    return script_command (argc, argv);
+
   data1 = g_bytes_new_unique_sync (str, strlen (str) + 1);
   g_print ("data1: %p %s\n", data1, (char *)g_bytes_get_data (data1, NULL));
 
@@ -0,0 +1,105 @@
+#include "unique-dbus.h"
+#include "unique-bytes.h"
+
+#include <unistd.h>
+
+static GVariant *
+inline_payload_new (GBytes *bytes)
+{
+  return g_variant_new_variant (g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING, bytes, TRUE));
+}
+
+GVariant *
+g_dbus_unique_payload_new (GBytes      *bytes,
+                           GUnixFDList *fd_list)
+{
+  gconstpointer data;
+  gsize len;
+  gint handle;
+  int memfd;
+
+  data = g_bytes_get_data (bytes, &len);
+  if (len < G_DBUS_UNIQUE_PAYLOAD_MIN_SIZE || fd_list == NULL)
+    return inline_payload_new (bytes);
+
+  memfd = g_bytes_unique_memfd_new (data, len);
+  if (memfd == -1)
+    return inline_payload_new (bytes);
+
+  handle = g_unix_fd_list_append (fd_list, memfd, NULL);
+  close (memfd);
+  if (handle == -1)
+    return inline_payload_new (bytes);
+
+  g_debug ("Sending %" G_GSIZE_FORMAT " byte payload as memfd", len);
+
+  return g_variant_new_variant (g_variant_new_handle (handle));
+}
+
+GBytes *
+g_dbus_unique_payload_get (GVariant     *payload,
+                           GUnixFDList  *fd_list,
+                           GError      **error)
+{
+  g_autoptr(GVariant) value = NULL;
+  GBytes *bytes;
+  gint handle;
+  int memfd;
+
+  if (g_variant_is_of_type (payload, G_VARIANT_TYPE_VARIANT))
+    value = g_variant_get_variant (payload);
+  else
+    value = g_variant_ref (payload);
+
+  if (g_variant_is_of_type (value, G_VARIANT_TYPE_BYTESTRING))
+    return g_variant_get_data_as_bytes (value);
+
+  if (!g_variant_is_of_type (value, G_VARIANT_TYPE_HANDLE))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Unexpected payload type %s", g_variant_get_type_string (value));
+      return NULL;
+    }
+
+  handle = g_variant_get_handle (value);
+  if (fd_list == NULL || handle < 0 || handle >= g_unix_fd_list_get_length (fd_list))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Invalid payload handle %d", handle);
+      return NULL;
+    }
+
+  /* Don't trust the sender, g_bytes_new_unique_from_memfd() checks the seals */
+  memfd = g_unix_fd_list_get (fd_list, handle, error);
+  if (memfd == -1)
+    return NULL;
+
+  bytes = g_bytes_new_unique_from_memfd (memfd, error);
+  close (memfd);
+
+  return bytes;
+}
+
+/* Returns the payload in argument index of the body of message */
+GBytes *
+g_dbus_unique_payload_get_from_message (GDBusMessage  *message,
+                                        gsize          index,
+                                        GError       **error)
+{
+  g_autoptr(GVariant) payload = NULL;
+  GVariant *body;
+
+  body = g_dbus_message_get_body (message);
+  if (body == NULL ||
+      !g_variant_is_of_type (body, G_VARIANT_TYPE_TUPLE) ||
+      index >= g_variant_n_children (body))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "No payload argument %" G_GSIZE_FORMAT, index);
+      return NULL;
+    }
+
+  payload = g_variant_get_child_value (body, index);
+
+  return g_dbus_unique_payload_get (payload, g_dbus_message_get_unix_fd_list (message), error);
+}
@@ -0,0 +1,26 @@
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+/* Large byte array arguments for D-Bus calls and signals. Declare the
+ * argument as "v" and build it with g_dbus_unique_payload_new(): small
+ * payloads are sent inline as "ay", larger ones as an "h" referring to a
+ * sealed memfd appended to fd_list, which must be sent with the message.
+ * The bus then only copies the fd, and receivers that map it through
+ * uniqued share the same pages. g_dbus_unique_payload_get() handles both
+ * forms, given the fd list of the message.
+ *
+ * Method handlers get the fd list from the GDBusMethodInvocation. Signal
+ * handlers added with g_dbus_connection_signal_subscribe() never see it,
+ * so large payloads in signals must be received in a message filter
+ * (g_dbus_connection_add_filter()), which can use
+ * g_dbus_unique_payload_get_from_message() on the signal. */
+#define G_DBUS_UNIQUE_PAYLOAD_MIN_SIZE (64 * 1024)
+
+GVariant * g_dbus_unique_payload_new              (GBytes        *bytes,
+                                                   GUnixFDList   *fd_list);
+GBytes *   g_dbus_unique_payload_get              (GVariant      *payload,
+                                                   GUnixFDList   *fd_list,
+                                                   GError       **error);
+GBytes *   g_dbus_unique_payload_get_from_message (GDBusMessage  *message,
+                                                   gsize          index,
+                                                   GError       **error);
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include "unique-file.h"
+#include "unique-bytes.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Smaller files are not worth a memfd and a round trip */
+#define MIN_SHARED_FILE_SIZE (64 * 1024)
+
+static gboolean
+pcopy_all (int fd, int memfd, gsize len, off_t offset)
+{
+  char buffer[64 * 1024];
+
+  while (len > 0)
+    {
+      ssize_t n = pread (fd, buffer, MIN (len, sizeof (buffer)), offset);
+      ssize_t written;
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+
+      for (written = 0; written < n; )
+        {
+          ssize_t res = pwrite (memfd, buffer + written, n - written, offset + written);
+          if (res < 0 && errno == EINTR)
+            continue;
+          if (res <= 0)
+            return FALSE;
+          written += res;
+        }
+
+      len -= n;
+      offset += n;
+    }
+
+  return TRUE;
+}
+
+/* Copies page cache to page cache inside the kernel where possible.
+   copy_file_range() between different filesystems needs a recent
+   kernel, sendfile() works on most, and the rest gets plain reads. */
+static gboolean
+copy_file_to_memfd (int fd, int memfd, gsize size)
+{
+  gboolean use_copy_file_range = TRUE;
+  gboolean use_sendfile = TRUE;
+  gsize done = 0;
+
+  while (done < size)
+    {
+      ssize_t n;
+
+      if (use_copy_file_range)
+        {
+          loff_t in_offset = done, out_offset = done;
+
+          n = copy_file_range (fd, &in_offset, memfd, &out_offset, size - done, 0);
+          if (n < 0 && errno != EINTR)
+            {
+              use_copy_file_range = FALSE;
+              continue;
+            }
+        }
+      else if (use_sendfile)
+        {
+          off_t in_offset = done;
+
+          /* sendfile() writes at the file position of the output */
+          if (lseek (memfd, done, SEEK_SET) < 0)
+            return FALSE;
+
+          n = sendfile (memfd, fd, &in_offset, size - done);
+          if (n < 0 && errno != EINTR)
+            {
+              use_sendfile = FALSE;
+              continue;
+            }
+        }
+      else
+        return pcopy_all (fd, memfd, size - done, done);
+
+      if (n < 0)
+        continue; /* EINTR */
+      if (n == 0)
+        return FALSE; /* The file shrunk */
+
+      done += n;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+same_file_version (const struct stat *a, const struct stat *b)
+{
+  return
+    a->st_size == b->st_size &&
+    a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+    a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+    a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+    a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+static GBytes *
+ingest_file (int                fd,
+             const struct stat *statbuf,
+             const char        *path,
+             const char        *key)
+{
+  g_autofree char *basename = g_path_get_basename (path);
+  g_autofree char *name = NULL;
+  g_autoptr(GError) error = NULL;
+  struct stat new_statbuf;
+  GBytes *bytes;
+  int memfd;
+
+  /* memfd names are limited to 249 bytes */
+  name = g_strdup_printf ("unique-file-%.200s", basename);
+  memfd = memfd_create (name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd == -1)
+    return NULL;
+
+  if (ftruncate (memfd, statbuf->st_size) != 0 ||
+      !copy_file_to_memfd (fd, memfd, statbuf->st_size) ||
+      fstat (fd, &new_statbuf) != 0 ||
+      !same_file_version (statbuf, &new_statbuf) ||
+      fcntl (memfd, F_ADD_SEALS, (int) F_SEAL_SEAL|F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE) != 0)
+    {
+      g_debug ("Failed to copy %s to a memfd, or it changed while copying", path);
+      close (memfd);
+      return NULL;
+    }
+
+  bytes = g_bytes_unique_cache_put_memfd (key, memfd, &error);
+  if (bytes == NULL)
+    g_debug ("Failed to share %s: %s", path, error->message);
+
+  close (memfd);
+  return bytes;
+}
+
+GBytes *
+g_file_try_load_bytes_unique (const char  *path,
+                              gchar      **etag_out)
+{
+  g_autofree char *key = NULL;
+  struct stat statbuf;
+  GBytes *bytes;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd == -1)
+    return NULL;
+
+  if (fstat (fd, &statbuf) != 0 ||
+      !S_ISREG (statbuf.st_mode) ||
+      statbuf.st_size < MIN_SHARED_FILE_SIZE)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  /* A new version of the file gets a new mtime (or size), so it never
+     matches an old entry. The ctime is in there too, as the mtime can be
+     set back with utimensat() but the ctime can't. The key is scoped to
+     the caller like any other cache key unless the "file" class is made
+     global in uniqued. */
+  key = g_strdup_printf ("file:%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ".%09ld:%" G_GINT64_FORMAT ".%09ld:%" G_GINT64_FORMAT,
+                         (guint64) statbuf.st_dev, (guint64) statbuf.st_ino,
+                         (gint64) statbuf.st_mtim.tv_sec, (long) statbuf.st_mtim.tv_nsec,
+                         (gint64) statbuf.st_ctim.tv_sec, (long) statbuf.st_ctim.tv_nsec,
+                         (gint64) statbuf.st_size);
+
+  bytes = g_bytes_unique_cache_get (key);
+  if (bytes != NULL && g_bytes_get_size (bytes) != (gsize) statbuf.st_size)
+    g_clear_pointer (&bytes, g_bytes_unref);
+
+  if (bytes == NULL)
+    bytes = ingest_file (fd, &statbuf, path, key);
+  else
+    g_debug ("Loaded %s from the cache", path);
+
+  close (fd);
+
+  /* Etags are opaque, this is the mtime like GLocalFile uses */
+  if (bytes != NULL && etag_out)
+    *etag_out = g_strdup_printf ("%lu:%lu",
+                                 (gulong) statbuf.st_mtim.tv_sec,
+                                 (gulong) statbuf.st_mtim.tv_nsec / 1000);
+
+  return bytes;
+}
+
+GBytes *
+g_file_load_bytes_unique (GFile         *file,
+                          GCancellable  *cancellable,
+                          gchar        **etag_out,
+                          GError       **error)
+{
+  g_autofree char *path = NULL;
+  GBytes *bytes = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return NULL;
+
+  path = g_file_get_path (file);
+  if (path != NULL)
+    bytes = g_file_try_load_bytes_unique (path, etag_out);
+
+  if (bytes == NULL)
+    bytes = g_file_load_bytes (file, cancellable, etag_out, error);
+
+  return bytes;
+}
@@ -0,0 +1,19 @@
+#include <gio/gio.h>
+
+/* Drop-in replacement for g_file_load_bytes() that shares large local
+ * files through uniqued. The contents are keyed in the cache by the
+ * device, inode, mtime, ctime and size of the file, so once one process
+ * has loaded a file, other loads of the same version of it map the
+ * existing blob without any reads or hashing. The first load copies the file into
+ * a memfd inside the kernel (copy_file_range() or sendfile()), so the
+ * data never passes through a heap buffer.
+ *
+ * g_file_try_load_bytes_unique() returns NULL without an error when the
+ * file is not worth sharing (not a regular file, too small, changed while
+ * loading, ...), and the caller should then load it as usual. */
+GBytes * g_file_load_bytes_unique     (GFile         *file,
+                                       GCancellable  *cancellable,
+                                       gchar        **etag_out,
+                                       GError       **error);
+GBytes * g_file_try_load_bytes_unique (const char    *path,
+                                       gchar        **etag_out);
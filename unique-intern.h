@@ -0,0 +1,94 @@
+/* Layout of the shared string interning table.
+ *
+ * uniqued is the only writer of the table, clients map it read-only and
+ * look strings up without any locking. The segment starts with a
+ * UniqueInternHeader, followed by n_buckets guint32 buckets (open
+ * addressing with linear probing), followed by the string area. A bucket
+ * holds the offset of a UniqueInternEntry from the start of the segment,
+ * or 0 if it is empty.
+ *
+ * Entries are never removed or changed. uniqued writes an entry in full
+ * before publishing its offset in a bucket with a release store, so a
+ * reader that sees the offset with an acquire load also sees the entry.
+ * Since entries never move, the offset is a stable identity for the
+ * string across all processes.
+ */
+
+#include <glib.h>
+
+#define UNIQUE_INTERN_MAGIC 0x4e544e49 /* "INTN" */
+#define UNIQUE_INTERN_TABLE_SIZE (16 * 1024 * 1024)
+#define UNIQUE_INTERN_N_BUCKETS (256 * 1024)
+#define UNIQUE_INTERN_MAX_STRING_LEN 1024
+
+typedef struct {
+  guint32 magic;
+  guint32 size;           /* Of the whole segment */
+  guint32 n_buckets;      /* A power of two */
+  guint32 strings_offset; /* Start of the string area */
+  guint32 strings_end;    /* End of the used part of the string area */
+  guint32 n_entries;
+} UniqueInternHeader;
+
+typedef struct {
+  guint32 hash;
+  guint32 len;
+  char str[]; /* nul terminated */
+} UniqueInternEntry;
+
+#define UNIQUE_INTERN_ENTRY_ALIGN 4
+
+static inline guint32 *
+unique_intern_buckets (const UniqueInternHeader *header)
+{
+  return (guint32 *)(header + 1);
+}
+
+/* FNV-1a, which unlike g_str_hash() is fixed by the table format */
+static inline guint32
+unique_intern_hash (const char *str, gsize len)
+{
+  guint32 hash = 2166136261u;
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    {
+      hash ^= (guchar)str[i];
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+/* Returns the offset of the entry for str, or 0 if it is not in the table */
+static inline guint32
+unique_intern_lookup (const UniqueInternHeader *header,
+                      const char               *str,
+                      gsize                     len,
+                      guint32                   hash)
+{
+  const guint32 *buckets = unique_intern_buckets (header);
+  guint32 mask = header->n_buckets - 1;
+  guint32 i, probes;
+
+  for (i = hash & mask, probes = 0; probes < header->n_buckets; i = (i + 1) & mask, probes++)
+    {
+      guint32 offset = __atomic_load_n (&buckets[i], __ATOMIC_ACQUIRE);
+      const UniqueInternEntry *entry;
+
+      if (offset == 0)
+        return 0;
+
+      if (offset < header->strings_offset ||
+          offset > header->size - sizeof (UniqueInternEntry) - len - 1)
+        continue; /* Corrupt, or can't match anyway */
+
+      entry = (const UniqueInternEntry *)((const char *)header + offset);
+      if (entry->hash == hash &&
+          entry->len == len &&
+          memcmp (entry->str, str, len) == 0)
+        return offset;
+    }
+
+  return 0;
+}
@@ -0,0 +1,39 @@
+/* Page-granularity content hashing, used by uniquectl scan and the
+ * overlap analyzer in uniqued to count duplicated pages. The hash is a
+ * fast non-cryptographic one: it is only used for statistics, never to
+ * decide that two pages can be shared.
+ */
+
+#include <glib.h>
+
+#define UNIQUE_PAGE_SIZE 4096
+
+static inline guint64
+unique_page_hash (const guchar *data)
+{
+  const guint64 *words = (const guint64 *)data;
+  guint64 h = 0x9e3779b97f4a7c15ULL;
+  gsize i;
+
+  for (i = 0; i < UNIQUE_PAGE_SIZE / sizeof (guint64); i++)
+    {
+      h ^= words[i];
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 32;
+    }
+
+  return h;
+}
+
+static inline gboolean
+unique_page_is_zero (const guchar *data)
+{
+  const guint64 *words = (const guint64 *)data;
+  gsize i;
+
+  for (i = 0; i < UNIQUE_PAGE_SIZE / sizeof (guint64); i++)
+    if (words[i] != 0)
+      return FALSE;
+
+  return TRUE;
+}
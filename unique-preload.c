@@ -0,0 +1,40 @@
+/* LD_PRELOAD this into an unmodified application to have its
+ * g_file_load_bytes() calls share large local files through uniqued,
+ * see g_file_try_load_bytes_unique(). Anything that is not worth
+ * sharing goes to the real g_file_load_bytes(). */
+
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+
+#include "unique-file.h"
+
+#include <dlfcn.h>
+
+typedef GBytes * (*LoadBytesFunc) (GFile         *file,
+                                   GCancellable  *cancellable,
+                                   gchar        **etag_out,
+                                   GError       **error);
+
+GBytes *
+g_file_load_bytes (GFile         *file,
+                   GCancellable  *cancellable,
+                   gchar        **etag_out,
+                   GError       **error)
+{
+  static gsize real_load_bytes = 0;
+  g_autofree char *path = NULL;
+  GBytes *bytes = NULL;
+
+  if (g_once_init_enter (&real_load_bytes))
+    g_once_init_leave (&real_load_bytes, (gsize) dlsym (RTLD_NEXT, "g_file_load_bytes"));
+
+  if (!g_cancellable_is_cancelled (cancellable))
+    {
+      path = g_file_get_path (file);
+      if (path != NULL)
+        bytes = g_file_try_load_bytes_unique (path, etag_out);
+      if (bytes != NULL)
+        return bytes;
+    }
+
+  return ((LoadBytesFunc) real_load_bytes) (file, cancellable, etag_out, error);
+}
@@ -0,0 +1,86 @@
+#include "unique-resource.h"
+#include "unique-bytes.h"
+
+/* Smaller entries are not worth a memfd and a round trip */
+#define MIN_SHARED_RESOURCE_SIZE (16 * 1024)
+
+typedef struct {
+  GResource *resource;
+  const char *path;
+  GResourceLookupFlags lookup_flags;
+} ResourceLookup;
+
+static GBytes *
+decompress_resource_data (gpointer user_data,
+                          GError **error)
+{
+  ResourceLookup *lookup = user_data;
+
+  g_debug ("Decompressing resource %s", lookup->path);
+
+  if (lookup->resource)
+    return g_resource_lookup_data (lookup->resource, lookup->path, lookup->lookup_flags, error);
+  else
+    return g_resources_lookup_data (lookup->path, lookup->lookup_flags, error);
+}
+
+static GBytes *
+lookup_data_unique (GResource            *resource,
+                    const char           *resource_digest,
+                    const char           *path,
+                    GResourceLookupFlags  lookup_flags,
+                    GError              **error)
+{
+  ResourceLookup lookup = { resource, path, lookup_flags };
+  g_autofree char *key = NULL;
+  guint32 flags;
+  gsize size;
+  gboolean found;
+
+  if (resource)
+    found = g_resource_get_info (resource, path, lookup_flags, &size, &flags, error);
+  else
+    found = g_resources_get_info (path, lookup_flags, &size, &flags, error);
+  if (!found)
+    return NULL;
+
+  /* Uncompressed entries point straight into the resource mapping, so
+     they are already shared (or at least not copied) */
+  if ((flags & G_RESOURCE_FLAGS_COMPRESSED) == 0 ||
+      size < MIN_SHARED_RESOURCE_SIZE)
+    return decompress_resource_data (&lookup, error);
+
+  key = g_strdup_printf ("gresource:%s:%s", resource_digest, path);
+
+  return g_bytes_unique_cache_get_or_compute (key, decompress_resource_data, &lookup, error);
+}
+
+GBytes *
+g_resource_lookup_data_unique (GResource            *resource,
+                               const char           *resource_digest,
+                               const char           *path,
+                               GResourceLookupFlags  lookup_flags,
+                               GError              **error)
+{
+  g_return_val_if_fail (resource != NULL, NULL);
+
+  return lookup_data_unique (resource, resource_digest, path, lookup_flags, error);
+}
+
+GBytes *
+g_resources_lookup_data_unique (const char           *resource_digest,
+                                const char           *path,
+                                GResourceLookupFlags  lookup_flags,
+                                GError              **error)
+{
+  return lookup_data_unique (NULL, resource_digest, path, lookup_flags, error);
+}
+
+/* Returns a digest of a compiled resource bundle, suitable for passing
+   as resource_digest. Apps that link their resources in can use any other
+   string identifying the build instead, such as the build id. */
+char *
+g_resource_unique_digest_for_data (GBytes *resource_data)
+{
+  return g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, resource_data);
+}
@@ -0,0 +1,19 @@
+#include <gio/gio.h>
+
+/* Drop-in replacements for g_resource_lookup_data() and
+ * g_resources_lookup_data() that share the decompressed data of
+ * compressed entries through uniqued. resource_digest identifies the
+ * compiled resource bundle (see g_resource_unique_digest_for_data()), so
+ * together with the path it names the decompressed payload across
+ * processes. */
+GBytes * g_resource_lookup_data_unique  (GResource            *resource,
+                                         const char           *resource_digest,
+                                         const char           *path,
+                                         GResourceLookupFlags  lookup_flags,
+                                         GError              **error);
+GBytes * g_resources_lookup_data_unique (const char           *resource_digest,
+                                         const char           *path,
+                                         GResourceLookupFlags  lookup_flags,
+                                         GError              **error);
+
+char *   g_resource_unique_digest_for_data (GBytes *resource_data);
@@ -0,0 +1,179 @@
+/* Multi-buffer SHA1, used by uniqued to hash batches of small blobs.
+ *
+ * A single SHA1 stream is strictly serial, so wide vector units can't
+ * speed it up. Independent streams can however run in lockstep, one per
+ * vector lane. The kernel is written with GCC vector extensions and
+ * cloned for AVX-512 and AVX2 where available; elsewhere the compiler
+ * picks whatever vector width the target has (or plain scalar code),
+ * so it is always correct, just not always faster than GChecksum.
+ *
+ * Lanes cost the same whether they have data or not, so callers should
+ * sort buffers by size and only use this for several buffers at once.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#define UNIQUE_SHA1_LANES 16
+#define UNIQUE_SHA1_DIGEST_LEN 20
+
+typedef guint32 UniqueSha1Vec __attribute__ ((vector_size (UNIQUE_SHA1_LANES * sizeof (guint32))));
+
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define UNIQUE_SHA1_CLONES __attribute__ ((target_clones ("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef UNIQUE_SHA1_CLONES
+#define UNIQUE_SHA1_CLONES
+#endif
+
+#define UNIQUE_SHA1_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+typedef struct {
+  const guint8 *data;
+  gsize n_full_blocks;
+  gsize n_blocks;
+  guint8 tail[128]; /* Last partial block, padding and length */
+} UniqueSha1Lane;
+
+static inline void
+unique_sha1_lane_init (UniqueSha1Lane *lane,
+                       const guint8   *data,
+                       gsize           len)
+{
+  gsize tail_len = len % 64;
+  gsize n_tail_blocks = tail_len + 9 <= 64 ? 1 : 2;
+  guint64 bits = (guint64) len * 8;
+  int i;
+
+  lane->data = data;
+  lane->n_full_blocks = len / 64;
+  lane->n_blocks = lane->n_full_blocks + n_tail_blocks;
+
+  memset (lane->tail, 0, sizeof (lane->tail));
+  memcpy (lane->tail, data + lane->n_full_blocks * 64, tail_len);
+  lane->tail[tail_len] = 0x80;
+  for (i = 0; i < 8; i++)
+    lane->tail[n_tail_blocks * 64 - 1 - i] = bits >> (i * 8);
+}
+
+static inline const guint8 *
+unique_sha1_lane_block (const UniqueSha1Lane *lane,
+                        gsize                 block)
+{
+  if (block < lane->n_full_blocks)
+    return lane->data + block * 64;
+  return lane->tail + (block - lane->n_full_blocks) * 64;
+}
+
+/* Computes the SHA1 digests of n_buffers (at most UNIQUE_SHA1_LANES)
+   buffers at once */
+UNIQUE_SHA1_CLONES static void
+unique_sha1_multi (const guint8 * const *data,
+                   const gsize          *len,
+                   guint                 n_buffers,
+                   guint8              (*digests)[UNIQUE_SHA1_DIGEST_LEN])
+{
+  UniqueSha1Lane lanes[UNIQUE_SHA1_LANES];
+  UniqueSha1Vec h[5], w[16];
+  gsize max_blocks = 0;
+  gsize block;
+  guint l;
+  int t, i;
+
+  g_assert (n_buffers <= UNIQUE_SHA1_LANES);
+
+  for (l = 0; l < n_buffers; l++)
+    {
+      unique_sha1_lane_init (&lanes[l], data[l], len[l]);
+      max_blocks = MAX (max_blocks, lanes[l].n_blocks);
+    }
+
+  for (i = 0; i < 5; i++)
+    {
+      static const guint32 iv[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+      h[i] = (UniqueSha1Vec) {} + iv[i];
+    }
+
+  for (block = 0; block < max_blocks; block++)
+    {
+      UniqueSha1Vec a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+      /* Lanes that are already done just hash zeros, their digests were
+         taken after their last block */
+      memset (w, 0, sizeof (w));
+      for (l = 0; l < n_buffers; l++)
+        {
+          const guint8 *p;
+
+          if (block >= lanes[l].n_blocks)
+            continue;
+
+          p = unique_sha1_lane_block (&lanes[l], block);
+          for (t = 0; t < 16; t++)
+            w[t][l] = (guint32) p[t * 4] << 24 | (guint32) p[t * 4 + 1] << 16 |
+                      (guint32) p[t * 4 + 2] << 8 | (guint32) p[t * 4 + 3];
+        }
+
+      for (t = 0; t < 80; t++)
+        {
+          UniqueSha1Vec f, tmp;
+          guint32 k;
+
+          if (t >= 16)
+            {
+              tmp = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15];
+              w[t & 15] = UNIQUE_SHA1_ROTL (tmp, 1);
+            }
+
+          if (t < 20)
+            {
+              f = (b & c) | (~b & d);
+              k = 0x5a827999;
+            }
+          else if (t < 40)
+            {
+              f = b ^ c ^ d;
+              k = 0x6ed9eba1;
+            }
+          else if (t < 60)
+            {
+              f = (b & c) | (b & d) | (c & d);
+              k = 0x8f1bbcdc;
+            }
+          else
+            {
+              f = b ^ c ^ d;
+              k = 0xca62c1d6;
+            }
+
+          tmp = UNIQUE_SHA1_ROTL (a, 5) + f + e + k + w[t & 15];
+          e = d;
+          d = c;
+          c = UNIQUE_SHA1_ROTL (b, 30);
+          b = a;
+          a = tmp;
+        }
+
+      h[0] += a;
+      h[1] += b;
+      h[2] += c;
+      h[3] += d;
+      h[4] += e;
+
+      for (l = 0; l < n_buffers; l++)
+        {
+          if (block + 1 != lanes[l].n_blocks)
+            continue;
+
+          for (i = 0; i < 5; i++)
+            {
+              digests[l][i * 4] = h[i][l] >> 24;
+              digests[l][i * 4 + 1] = h[i][l] >> 16;
+              digests[l][i * 4 + 2] = h[i][l] >> 8;
+              digests[l][i * 4 + 3] = h[i][l];
+            }
+        }
+    }
+}
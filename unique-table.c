@@ -0,0 +1,572 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "unique-table.h"
+#include "unique-bytes.h"
+
+/* Image layout, all offsets relative to the start of the image and all
+ * integers in host byte order (images are only shared on one machine):
+ *
+ *   TableHeader
+ *   gint32     displacements[n_buckets]
+ *   guint32    slots[n_entries]          hash slot -> entry index
+ *   TableEntry entries[n_entries]        sorted by key
+ *   key and value data, each 8-byte aligned, keys nul terminated
+ *
+ * The hash is "hash, displace and compress": a key goes to bucket
+ * hash(seed) % n_buckets, and the bucket's displacement d picks its
+ * slot as hash(d) % n_entries, or directly as -d - 1 for buckets with a
+ * single key. Keys not in the table land on some arbitrary slot, so
+ * lookups always compare the key stored there. */
+
+#define TABLE_MAGIC 0x4c425455 /* "UTBL" */
+#define TABLE_VERSION 1
+#define TABLE_ALIGN 8
+
+/* Average number of keys per bucket. Higher values make the displacement
+   array smaller but the build slower */
+#define KEYS_PER_BUCKET 2
+
+/* Give up on a seed if some bucket can't be placed within this many
+   displacements, and retry with the next one */
+#define MAX_DISPLACEMENT (1 << 20)
+
+typedef struct {
+  guint32 magic;
+  guint32 version;
+  guint32 n_entries;
+  guint32 n_buckets;
+  guint32 seed;
+  guint32 displacements_offset;
+  guint32 slots_offset;
+  guint32 entries_offset;
+  guint64 size;
+} TableHeader;
+
+typedef struct {
+  guint32 key_offset;
+  guint32 key_len;
+  guint32 value_offset;
+  guint32 value_len;
+} TableEntry;
+
+struct _GUniqueTableBuilder {
+  GHashTable *entries; /* key -> GBytes */
+};
+
+struct _GUniqueTable {
+  int ref_count;
+  GBytes *bytes;
+  const guint8 *data;
+  gsize size;
+  const TableHeader *header;
+  const gint32 *displacements;
+  const guint32 *slots;
+  const TableEntry *entries;
+};
+
+static guint32
+table_hash (guint32     d,
+            const char *key,
+            gsize       len)
+{
+  guint32 h = 0x811c9dc5 ^ (d * 0x9e3779b9);
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    h = (h ^ (guint8) key[i]) * 0x01000193;
+
+  /* FNV mixes the low bits poorly, and we reduce modulo small numbers */
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
+}
+
+static gsize
+align_offset (gsize offset)
+{
+  return (offset + TABLE_ALIGN - 1) & ~(gsize) (TABLE_ALIGN - 1);
+}
+
+GUniqueTableBuilder *
+g_unique_table_builder_new (void)
+{
+  GUniqueTableBuilder *builder = g_new0 (GUniqueTableBuilder, 1);
+
+  builder->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify) g_bytes_unref);
+
+  return builder;
+}
+
+void
+g_unique_table_builder_free (GUniqueTableBuilder *builder)
+{
+  g_hash_table_unref (builder->entries);
+  g_free (builder);
+}
+
+/* Adding an existing key replaces its value */
+void
+g_unique_table_builder_add (GUniqueTableBuilder *builder,
+                            const char          *key,
+                            gconstpointer        value,
+                            gsize                value_len)
+{
+  g_return_if_fail (key != NULL);
+  g_return_if_fail (value != NULL || value_len == 0);
+
+  g_hash_table_replace (builder->entries, g_strdup (key), g_bytes_new (value, value_len));
+}
+
+static int
+compare_keys (const void *a,
+              const void *b)
+{
+  return strcmp (*(const char **) a, *(const char **) b);
+}
+
+static gboolean
+try_build_hash (const char   **keys,
+                const gsize   *key_lens,
+                guint          n_entries,
+                guint          n_buckets,
+                guint32        seed,
+                gint32        *displacements,
+                guint32       *slots)
+{
+  g_autofree guint32 *bucket_sizes = g_new0 (guint32, n_buckets);
+  g_autofree guint32 *bucket_start = g_new0 (guint32, n_buckets + 1);
+  g_autofree guint32 *bucket_keys = g_new (guint32, n_entries);
+  g_autofree guint32 *bucket_fill = g_new0 (guint32, n_buckets);
+  g_autofree guint32 *key_bucket = g_new (guint32, n_entries);
+  g_autofree guint8 *taken = g_new0 (guint8, n_entries);
+  g_autofree guint32 *pending = NULL;
+  guint32 max_size = 0;
+  guint32 size, free_slot;
+  guint i, b, j;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      key_bucket[i] = table_hash (seed, keys[i], key_lens[i]) % n_buckets;
+      bucket_sizes[key_bucket[i]]++;
+    }
+
+  for (b = 0; b < n_buckets; b++)
+    {
+      bucket_start[b + 1] = bucket_start[b] + bucket_sizes[b];
+      max_size = MAX (max_size, bucket_sizes[b]);
+    }
+
+  for (i = 0; i < n_entries; i++)
+    {
+      b = key_bucket[i];
+      bucket_keys[bucket_start[b] + bucket_fill[b]++] = i;
+    }
+
+  pending = g_new (guint32, max_size);
+  memset (displacements, 0, n_buckets * sizeof (gint32));
+
+  /* Place the largest buckets first while most slots are still free.
+     Bucket sizes are small, so just sweep the buckets once per size */
+  for (size = max_size; size >= 2; size--)
+    {
+      for (b = 0; b < n_buckets; b++)
+        {
+          guint32 d;
+
+          if (bucket_sizes[b] != size)
+            continue;
+
+          for (d = 1; ; d++)
+            {
+              if (d > MAX_DISPLACEMENT)
+                return FALSE;
+
+              for (j = 0; j < size; j++)
+                {
+                  guint32 key = bucket_keys[bucket_start[b] + j];
+                  guint32 slot = table_hash (d, keys[key], key_lens[key]) % n_entries;
+
+                  if (taken[slot])
+                    break;
+
+                  /* Mark it right away so keys in the same bucket can't
+                     collide with each other either */
+                  taken[slot] = 1;
+                  pending[j] = slot;
+                }
+
+              if (j == size)
+                break;
+
+              while (j > 0)
+                taken[pending[--j]] = 0;
+            }
+
+          displacements[b] = d;
+          for (j = 0; j < size; j++)
+            slots[pending[j]] = bucket_keys[bucket_start[b] + j];
+        }
+    }
+
+  /* Singletons need no hashing at all, they just take any free slot */
+  free_slot = 0;
+  for (b = 0; b < n_buckets; b++)
+    {
+      if (bucket_sizes[b] != 1)
+        continue;
+
+      while (taken[free_slot])
+        free_slot++;
+
+      taken[free_slot] = 1;
+      slots[free_slot] = bucket_keys[bucket_start[b]];
+      displacements[b] = -(gint32) free_slot - 1;
+    }
+
+  return TRUE;
+}
+
+/* Serializes the table. The builder can be freed afterwards, or kept
+   adding to and serialized again. */
+GBytes *
+g_unique_table_builder_end (GUniqueTableBuilder *builder)
+{
+  g_autofree const char **keys = NULL;
+  g_autofree gsize *key_lens = NULL;
+  guint n_entries, n_buckets, i;
+  guint32 seed;
+  TableHeader *header;
+  gint32 *displacements;
+  guint32 *slots;
+  TableEntry *entries;
+  guint8 *data;
+  gsize displacements_offset, slots_offset, entries_offset, offset;
+
+  keys = (const char **) g_hash_table_get_keys_as_array (builder->entries, &n_entries);
+  if (n_entries > 0)
+    qsort (keys, n_entries, sizeof (char *), compare_keys);
+
+  n_buckets = (n_entries + KEYS_PER_BUCKET - 1) / KEYS_PER_BUCKET;
+
+  key_lens = g_new (gsize, n_entries);
+  offset = 0;
+  for (i = 0; i < n_entries; i++)
+    {
+      GBytes *value = g_hash_table_lookup (builder->entries, keys[i]);
+
+      key_lens[i] = strlen (keys[i]);
+      offset = align_offset (offset + key_lens[i] + 1);
+      offset = align_offset (offset + g_bytes_get_size (value));
+    }
+
+  displacements_offset = sizeof (TableHeader);
+  slots_offset = align_offset (displacements_offset + n_buckets * sizeof (gint32));
+  entries_offset = align_offset (slots_offset + n_entries * sizeof (guint32));
+  offset += entries_offset + n_entries * sizeof (TableEntry);
+
+  g_return_val_if_fail (offset <= G_MAXUINT32, NULL);
+
+  data = g_malloc0 (offset);
+  header = (TableHeader *) data;
+  displacements = (gint32 *) (data + displacements_offset);
+  slots = (guint32 *) (data + slots_offset);
+  entries = (TableEntry *) (data + entries_offset);
+
+  seed = 0;
+  if (n_entries > 0)
+    {
+      while (!try_build_hash (keys, key_lens, n_entries, n_buckets, seed,
+                              displacements, slots))
+        seed++;
+    }
+
+  header->magic = TABLE_MAGIC;
+  header->version = TABLE_VERSION;
+  header->n_entries = n_entries;
+  header->n_buckets = n_buckets;
+  header->seed = seed;
+  header->displacements_offset = displacements_offset;
+  header->slots_offset = slots_offset;
+  header->entries_offset = entries_offset;
+  header->size = offset;
+
+  offset = entries_offset + n_entries * sizeof (TableEntry);
+  for (i = 0; i < n_entries; i++)
+    {
+      GBytes *value = g_hash_table_lookup (builder->entries, keys[i]);
+      gsize value_len;
+      gconstpointer value_data = g_bytes_get_data (value, &value_len);
+
+      entries[i].key_offset = offset;
+      entries[i].key_len = key_lens[i];
+      memcpy (data + offset, keys[i], key_lens[i]);
+      offset = align_offset (offset + key_lens[i] + 1);
+
+      entries[i].value_offset = offset;
+      entries[i].value_len = value_len;
+      if (value_len > 0)
+        memcpy (data + offset, value_data, value_len);
+      offset = align_offset (offset + value_len);
+    }
+
+  g_debug ("Built table with %u entries, %u buckets (seed %u), %" G_GSIZE_FORMAT " bytes",
+           n_entries, n_buckets, seed, offset);
+
+  return g_bytes_new_take (data, offset);
+}
+
+static gboolean
+range_is_valid (GUniqueTable *table,
+                guint64       offset,
+                guint64       len)
+{
+  return offset <= table->size && len <= table->size - offset;
+}
+
+/* Only the header is checked up front, so opening a table costs the same
+   regardless of its size; entries are bounds checked as they are used */
+GUniqueTable *
+g_unique_table_new (GBytes  *data,
+                    GError **error)
+{
+  g_autoptr(GBytes) bytes = g_bytes_ref (data);
+  g_autofree GUniqueTable *table = g_new0 (GUniqueTable, 1);
+  const TableHeader *header;
+  gsize size;
+  const guint8 *image;
+
+  image = g_bytes_get_data (bytes, &size);
+
+  /* Unique blobs are page aligned, but arbitrary GBytes might not be */
+  if (((guintptr) image % TABLE_ALIGN) != 0)
+    {
+      g_bytes_unref (bytes);
+      bytes = g_bytes_new (image, size);
+      image = g_bytes_get_data (bytes, &size);
+    }
+
+  table->data = image;
+  table->size = size;
+
+  header = (const TableHeader *) image;
+  if (size < sizeof (TableHeader) ||
+      header->magic != TABLE_MAGIC ||
+      header->version != TABLE_VERSION ||
+      header->size != size ||
+      (header->n_entries > 0 && header->n_buckets == 0) ||
+      header->displacements_offset % sizeof (gint32) != 0 ||
+      header->slots_offset % sizeof (guint32) != 0 ||
+      header->entries_offset % sizeof (guint32) != 0 ||
+      !range_is_valid (table, header->displacements_offset, (guint64) header->n_buckets * sizeof (gint32)) ||
+      !range_is_valid (table, header->slots_offset, (guint64) header->n_entries * sizeof (guint32)) ||
+      !range_is_valid (table, header->entries_offset, (guint64) header->n_entries * sizeof (TableEntry)))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid unique table");
+      return NULL;
+    }
+
+  table->ref_count = 1;
+  table->header = header;
+  table->displacements = (const gint32 *) (image + header->displacements_offset);
+  table->slots = (const guint32 *) (image + header->slots_offset);
+  table->entries = (const TableEntry *) (image + header->entries_offset);
+  table->bytes = g_steal_pointer (&bytes);
+
+  return g_steal_pointer (&table);
+}
+
+typedef struct {
+  GUniqueTableBuildFunc build;
+  gpointer user_data;
+} TableBuild;
+
+static GBytes *
+build_table (gpointer user_data,
+             GError **error)
+{
+  TableBuild *build = user_data;
+  g_autoptr(GUniqueTableBuilder) builder = g_unique_table_builder_new ();
+
+  build->build (builder, build->user_data);
+
+  return g_unique_table_builder_end (builder);
+}
+
+/* Returns the table stored under cache_key, calling build to fill in a
+   builder only if no other process has published it yet. cache_key must
+   change whenever the table content would, e.g. by including the mtime
+   of the source files. */
+GUniqueTable *
+g_unique_table_get_or_build (const char            *cache_key,
+                             GUniqueTableBuildFunc  build,
+                             gpointer               user_data,
+                             GError               **error)
+{
+  TableBuild table_build = { build, user_data };
+  g_autofree char *key = g_strconcat ("unique-table:", cache_key, NULL);
+  g_autoptr(GBytes) bytes = NULL;
+
+  bytes = g_bytes_unique_cache_get_or_compute (key, build_table, &table_build, error);
+  if (bytes == NULL)
+    return NULL;
+
+  return g_unique_table_new (bytes, error);
+}
+
+GUniqueTable *
+g_unique_table_ref (GUniqueTable *table)
+{
+  g_atomic_int_inc (&table->ref_count);
+  return table;
+}
+
+void
+g_unique_table_unref (GUniqueTable *table)
+{
+  if (g_atomic_int_dec_and_test (&table->ref_count))
+    {
+      g_bytes_unref (table->bytes);
+      g_free (table);
+    }
+}
+
+GBytes *
+g_unique_table_get_bytes (GUniqueTable *table)
+{
+  return table->bytes;
+}
+
+guint
+g_unique_table_get_n_entries (GUniqueTable *table)
+{
+  return table->header->n_entries;
+}
+
+static const char *
+get_entry_key (GUniqueTable *table,
+               guint         index,
+               gsize        *key_len)
+{
+  const TableEntry *entry = &table->entries[index];
+
+  if (!range_is_valid (table, entry->key_offset, (guint64) entry->key_len + 1) ||
+      table->data[entry->key_offset + entry->key_len] != 0)
+    return NULL;
+
+  *key_len = entry->key_len;
+  return (const char *) table->data + entry->key_offset;
+}
+
+static gconstpointer
+get_entry_value (GUniqueTable *table,
+                 guint         index,
+                 gsize        *value_len)
+{
+  const TableEntry *entry = &table->entries[index];
+
+  if (!range_is_valid (table, entry->value_offset, entry->value_len))
+    return NULL;
+
+  if (value_len)
+    *value_len = entry->value_len;
+  return table->data + entry->value_offset;
+}
+
+gconstpointer
+g_unique_table_lookup (GUniqueTable *table,
+                       const char   *key,
+                       gsize        *value_len)
+{
+  const TableHeader *header = table->header;
+  gsize len = strlen (key);
+  const char *entry_key;
+  gsize entry_key_len;
+  guint32 bucket, slot, index;
+  gint32 d;
+
+  if (header->n_entries == 0)
+    return NULL;
+
+  bucket = table_hash (header->seed, key, len) % header->n_buckets;
+  d = table->displacements[bucket];
+  if (d < 0)
+    slot = (guint32) (-(d + 1));
+  else
+    slot = table_hash (d, key, len) % header->n_entries;
+
+  if (slot >= header->n_entries)
+    return NULL;
+
+  index = table->slots[slot];
+  if (index >= header->n_entries)
+    return NULL;
+
+  entry_key = get_entry_key (table, index, &entry_key_len);
+  if (entry_key == NULL ||
+      entry_key_len != len ||
+      memcmp (entry_key, key, len) != 0)
+    return NULL;
+
+  return get_entry_value (table, index, value_len);
+}
+
+gboolean
+g_unique_table_get_entry (GUniqueTable   *table,
+                          guint           index,
+                          const char    **key,
+                          gconstpointer  *value,
+                          gsize          *value_len)
+{
+  const char *entry_key;
+  gconstpointer entry_value;
+  gsize key_len, len;
+
+  if (index >= table->header->n_entries)
+    return FALSE;
+
+  entry_key = get_entry_key (table, index, &key_len);
+  entry_value = get_entry_value (table, index, &len);
+  if (entry_key == NULL || entry_value == NULL)
+    return FALSE;
+
+  if (key)
+    *key = entry_key;
+  if (value)
+    *value = entry_value;
+  if (value_len)
+    *value_len = len;
+
+  return TRUE;
+}
+
+/* Returns the index of the first entry whose key is not less than key,
+   or the number of entries if there is none. For a prefix query, iterate
+   from g_unique_table_lower_bound (table, prefix) while keys still start
+   with prefix. */
+guint
+g_unique_table_lower_bound (GUniqueTable *table,
+                            const char   *key)
+{
+  guint lo = 0, hi = table->header->n_entries;
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      const char *entry_key;
+      gsize key_len;
+
+      entry_key = get_entry_key (table, mid, &key_len);
+      if (entry_key != NULL && strcmp (entry_key, key) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
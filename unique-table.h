@@ -0,0 +1,54 @@
+#include <gio/gio.h>
+
+/* Frozen string-keyed tables that live entirely inside a (unique) blob.
+ *
+ * A table is built once with a GUniqueTableBuilder and serialized into a
+ * compact, position independent image: a minimal perfect hash over the
+ * keys, an entry array sorted by key, and 8-byte aligned key and value
+ * data. Opening an image does no parsing or allocation beyond the
+ * GUniqueTable itself, so once it is published as a unique blob every
+ * process queries the same pages.
+ *
+ * g_unique_table_get_or_build() keys the image in the uniqued cache, so
+ * only the first process to need a given table pays for building it. */
+
+typedef struct _GUniqueTable GUniqueTable;
+typedef struct _GUniqueTableBuilder GUniqueTableBuilder;
+
+typedef void (*GUniqueTableBuildFunc) (GUniqueTableBuilder *builder,
+                                       gpointer             user_data);
+
+GUniqueTableBuilder *g_unique_table_builder_new  (void);
+void                 g_unique_table_builder_free (GUniqueTableBuilder *builder);
+void                 g_unique_table_builder_add  (GUniqueTableBuilder *builder,
+                                                  const char          *key,
+                                                  gconstpointer        value,
+                                                  gsize                value_len);
+GBytes *             g_unique_table_builder_end  (GUniqueTableBuilder *builder);
+
+GUniqueTable *       g_unique_table_new           (GBytes                *data,
+                                                   GError               **error);
+GUniqueTable *       g_unique_table_get_or_build  (const char            *cache_key,
+                                                   GUniqueTableBuildFunc  build,
+                                                   gpointer               user_data,
+                                                   GError               **error);
+GUniqueTable *       g_unique_table_ref           (GUniqueTable          *table);
+void                 g_unique_table_unref         (GUniqueTable          *table);
+GBytes *             g_unique_table_get_bytes     (GUniqueTable          *table);
+
+guint                g_unique_table_get_n_entries (GUniqueTable          *table);
+gconstpointer        g_unique_table_lookup        (GUniqueTable          *table,
+                                                   const char            *key,
+                                                   gsize                 *value_len);
+/* Entries are sorted by key (strcmp order), so these allow ordered
+   iteration and prefix/range queries */
+gboolean             g_unique_table_get_entry     (GUniqueTable          *table,
+                                                   guint                  index,
+                                                   const char           **key,
+                                                   gconstpointer         *value,
+                                                   gsize                 *value_len);
+guint                g_unique_table_lower_bound   (GUniqueTable          *table,
+                                                   const char            *key);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GUniqueTable, g_unique_table_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GUniqueTableBuilder, g_unique_table_builder_free)
@@ -0,0 +1,1058 @@
+#define _GNU_SOURCE         /* See feature_test_macros(7) */
+#define GETTEXT_PACKAGE "uniqued"
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "unique-page.h"
+
+#define PAGE_SIZE UNIQUE_PAGE_SIZE
+#define READ_CHUNK_PAGES 256
+
+/* Bits of /proc/<pid>/pagemap entries */
+#define PAGEMAP_PRESENT (1ULL << 63)
+
+/* One sampled page of one process */
+typedef struct {
+  guint64 hash;
+  guint32 pid;
+  guint32 region; /* Index in regions */
+} PageSample;
+
+typedef struct {
+  char *label; /* "executable [kind size]" */
+  guint exe;   /* Index in executables */
+  guint32 pid;
+  gsize n_sampled;
+  gsize n_duplicate;
+  guint64 hash; /* Of all sampled page hashes, for whole-region matches */
+} Region;
+
+typedef struct {
+  char *name;
+  gsize n_sampled;
+  gsize n_duplicate;
+  guint n_processes;
+} Executable;
+
+/* How many copies of a page or region hash exist, in how many processes */
+typedef struct {
+  guint n_copies;
+  guint n_processes;
+  guint32 last_pid;
+} HashCount;
+
+typedef struct {
+  guint sample_every;
+  GArray *samples;      /* PageSample */
+  GPtrArray *regions;   /* Region */
+  GPtrArray *exes;      /* Executable */
+  GHashTable *exe_ids;  /* name -> index + 1 */
+  gsize n_zero_pages;
+  guint n_processes;
+  guint n_skipped;
+} Scan;
+
+static void
+region_free (Region *region)
+{
+  g_free (region->label);
+  g_free (region);
+}
+
+static void
+executable_free (Executable *exe)
+{
+  g_free (exe->name);
+  g_free (exe);
+}
+
+static guint
+get_executable (Scan *scan, guint32 pid)
+{
+  g_autofree char *exe_path = g_strdup_printf ("/proc/%u/exe", pid);
+  g_autofree char *comm_path = g_strdup_printf ("/proc/%u/comm", pid);
+  g_autofree char *target = g_file_read_link (exe_path, NULL);
+  g_autofree char *name = NULL;
+  Executable *exe;
+  gpointer id;
+
+  if (target != NULL)
+    name = g_path_get_basename (target);
+  else if (g_file_get_contents (comm_path, &name, NULL, NULL))
+    g_strchomp (name);
+  else
+    name = g_strdup ("unknown");
+
+  id = g_hash_table_lookup (scan->exe_ids, name);
+  if (id != NULL)
+    return GPOINTER_TO_UINT (id) - 1;
+
+  exe = g_new0 (Executable, 1);
+  exe->name = g_steal_pointer (&name);
+  g_ptr_array_add (scan->exes, exe);
+  g_hash_table_insert (scan->exe_ids, exe->name, GUINT_TO_POINTER (scan->exes->len));
+
+  return scan->exes->len - 1;
+}
+
+/* Samples the resident pages of one region, reading only the pages
+   we sample that pagemap reports present, so that we don't fault
+   anything in or copy pages we don't look at. Returns FALSE if we are
+   not allowed to read the memory of pid. */
+static gboolean
+scan_region (Scan       *scan,
+             guint32     pid,
+             int         pagemap_fd,
+             guint64     start,
+             guint64     end,
+             Region     *region,
+             guint32     region_index)
+{
+  g_autofree guchar *buffer = g_malloc (READ_CHUNK_PAGES * PAGE_SIZE);
+  guint64 pagemap[READ_CHUNK_PAGES];
+  /* Runs of pages to read, at most every other page of a chunk */
+  struct iovec local[READ_CHUNK_PAGES / 2 + 1], remote[READ_CHUNK_PAGES / 2 + 1];
+  guint64 addr;
+
+  for (addr = start; addr < end; addr += READ_CHUNK_PAGES * PAGE_SIZE)
+    {
+      gsize n_pages = MIN (READ_CHUNK_PAGES, (end - addr) / PAGE_SIZE);
+      gsize n_runs = 0;
+      ssize_t n_read;
+      gsize i, j;
+
+      if (pread (pagemap_fd, pagemap, n_pages * sizeof (guint64),
+                 (addr / PAGE_SIZE) * sizeof (guint64)) != n_pages * sizeof (guint64))
+        return TRUE;
+
+      for (i = 0; i < n_pages; i++)
+        {
+          guint64 page_index = (addr - start) / PAGE_SIZE + i;
+
+          if ((pagemap[i] & PAGEMAP_PRESENT) == 0 ||
+              page_index % scan->sample_every != 0)
+            continue;
+
+          if (n_runs > 0 &&
+              (guchar *)local[n_runs - 1].iov_base + local[n_runs - 1].iov_len == buffer + i * PAGE_SIZE)
+            {
+              local[n_runs - 1].iov_len += PAGE_SIZE;
+              remote[n_runs - 1].iov_len += PAGE_SIZE;
+              continue;
+            }
+
+          local[n_runs].iov_base = buffer + i * PAGE_SIZE;
+          local[n_runs].iov_len = PAGE_SIZE;
+          remote[n_runs].iov_base = (void *)(gsize)(addr + i * PAGE_SIZE);
+          remote[n_runs].iov_len = PAGE_SIZE;
+          n_runs++;
+        }
+
+      if (n_runs == 0)
+        continue;
+
+      /* Short reads happen if part of the range was unmapped meanwhile,
+         they end at the first run that couldn't be read */
+      n_read = process_vm_readv (pid, local, n_runs, remote, n_runs, 0);
+      if (n_read < 0 && errno == EPERM)
+        return FALSE;
+      if (n_read <= 0)
+        return TRUE;
+
+      for (j = 0; j < n_runs && n_read >= PAGE_SIZE; j++)
+        {
+          const guchar *run = local[j].iov_base;
+          gsize run_len = MIN (local[j].iov_len, (gsize)n_read);
+
+          n_read -= run_len;
+          for (i = 0; i + PAGE_SIZE <= run_len; i += PAGE_SIZE)
+            {
+              PageSample sample;
+
+              if (unique_page_is_zero (run + i))
+                {
+                  scan->n_zero_pages++;
+                  continue;
+                }
+
+              sample.hash = unique_page_hash (run + i);
+              sample.pid = pid;
+              sample.region = region_index;
+              g_array_append_val (scan->samples, sample);
+
+              region->n_sampled++;
+              region->hash = (region->hash ^ sample.hash) * 0x100000001b3ULL;
+            }
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+scan_process (Scan *scan, guint32 pid)
+{
+  g_autofree char *maps_path = g_strdup_printf ("/proc/%u/maps", pid);
+  g_autofree char *pagemap_path = g_strdup_printf ("/proc/%u/pagemap", pid);
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  Executable *exe;
+  guint exe_index;
+  int pagemap_fd;
+  guint i;
+
+  if (pid == getpid () ||
+      !g_file_get_contents (maps_path, &contents, NULL, NULL))
+    return;
+
+  pagemap_fd = open (pagemap_path, O_RDONLY | O_CLOEXEC);
+  if (pagemap_fd == -1)
+    {
+      scan->n_skipped++;
+      return;
+    }
+
+  exe_index = get_executable (scan, pid);
+  exe = g_ptr_array_index (scan->exes, exe_index);
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      unsigned long long start, end, inode;
+      char perms[5];
+      int path_offset = 0;
+      const char *path;
+      const char *kind;
+      g_autofree char *size = NULL;
+      Region *region;
+
+      if (sscanf (lines[i], "%llx-%llx %4s %*x %*x:%*x %llu %n",
+                  &start, &end, perms, &inode, &path_offset) < 4)
+        continue;
+
+      path = lines[i] + path_offset;
+
+      /* Only private anonymous memory and the heap, that is what could
+         be converted to g_bytes_new_unique_*() */
+      if (perms[0] != 'r' || perms[3] != 'p' || inode != 0)
+        continue;
+      if (*path == 0)
+        kind = "anon";
+      else if (strcmp (path, "[heap]") == 0)
+        kind = "heap";
+      else
+        continue;
+
+      size = g_format_size (end - start);
+      region = g_new0 (Region, 1);
+      region->label = g_strdup_printf ("%s [%s %s]", exe->name, kind, size);
+      region->exe = exe_index;
+      region->pid = pid;
+      g_ptr_array_add (scan->regions, region);
+
+      if (!scan_region (scan, pid, pagemap_fd, start, end, region, scan->regions->len - 1))
+        {
+          /* Nothing was sampled before, as that would have failed too */
+          scan->n_skipped++;
+          close (pagemap_fd);
+          return;
+        }
+
+      exe->n_sampled += region->n_sampled;
+    }
+
+  close (pagemap_fd);
+
+  scan->n_processes++;
+  exe->n_processes++;
+}
+
+static void
+count_hash (GHashTable *counts, guint64 hash, guint32 pid)
+{
+  HashCount *count = g_hash_table_lookup (counts, &hash);
+
+  if (count == NULL)
+    {
+      guint64 *key = g_new (guint64, 1);
+      *key = hash;
+      count = g_new0 (HashCount, 1);
+      g_hash_table_insert (counts, key, count);
+    }
+
+  count->n_copies++;
+  if (count->n_processes == 0 || count->last_pid != pid)
+    count->n_processes++;
+  count->last_pid = pid;
+}
+
+static gint
+compare_region_duplicates (gconstpointer a,
+                           gconstpointer b)
+{
+  const Region *region_a = *(const Region **)a;
+  const Region *region_b = *(const Region **)b;
+
+  return (region_a->n_duplicate < region_b->n_duplicate) - (region_a->n_duplicate > region_b->n_duplicate);
+}
+
+static gint
+compare_exe_duplicates (gconstpointer a,
+                        gconstpointer b)
+{
+  const Executable *exe_a = *(const Executable **)a;
+  const Executable *exe_b = *(const Executable **)b;
+
+  return (exe_a->n_duplicate < exe_b->n_duplicate) - (exe_a->n_duplicate > exe_b->n_duplicate);
+}
+
+static char *
+format_pages (Scan *scan, gsize n_pages)
+{
+  /* Scale samples up to an estimate of the real size */
+  return g_format_size ((guint64)n_pages * PAGE_SIZE * scan->sample_every);
+}
+
+static void
+report_scan (Scan *scan, guint n_top)
+{
+  g_autoptr(GHashTable) page_counts = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+  g_autoptr(GHashTable) region_counts = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+  g_autoptr(GPtrArray) sorted_regions = g_ptr_array_new ();
+  g_autoptr(GPtrArray) sorted_exes = g_ptr_array_new ();
+  g_autofree char *sampled_size = NULL;
+  g_autofree char *duplicate_size = NULL;
+  g_autofree char *savings_size = NULL;
+  g_autofree char *zero_size = NULL;
+  g_autofree char *region_size = NULL;
+  gsize n_duplicate = 0, n_savings = 0, n_region_pages = 0;
+  guint n_identical_regions = 0;
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  /* Samples are in pid order, so HashCount can count distinct pids */
+  for (i = 0; i < scan->samples->len; i++)
+    {
+      PageSample *sample = &g_array_index (scan->samples, PageSample, i);
+      count_hash (page_counts, sample->hash, sample->pid);
+    }
+
+  for (i = 0; i < scan->regions->len; i++)
+    {
+      Region *region = g_ptr_array_index (scan->regions, i);
+      if (region->n_sampled > 0)
+        count_hash (region_counts, region->hash, region->pid);
+    }
+
+  /* A page is a duplicate if some other process has the same content */
+  for (i = 0; i < scan->samples->len; i++)
+    {
+      PageSample *sample = &g_array_index (scan->samples, PageSample, i);
+      HashCount *count = g_hash_table_lookup (page_counts, &sample->hash);
+      Region *region;
+
+      if (count->n_processes < 2)
+        continue;
+
+      region = g_ptr_array_index (scan->regions, sample->region);
+      region->n_duplicate++;
+      ((Executable *)g_ptr_array_index (scan->exes, region->exe))->n_duplicate++;
+      n_duplicate++;
+    }
+
+  /* Sharing would leave one copy of each */
+  g_hash_table_iter_init (&iter, page_counts);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      HashCount *count = value;
+      if (count->n_processes >= 2)
+        n_savings += count->n_copies - 1;
+    }
+
+  for (i = 0; i < scan->regions->len; i++)
+    {
+      Region *region = g_ptr_array_index (scan->regions, i);
+      HashCount *count;
+
+      if (region->n_sampled == 0)
+        continue;
+
+      count = g_hash_table_lookup (region_counts, &region->hash);
+      if (count->n_processes >= 2)
+        {
+          n_identical_regions++;
+          n_region_pages += region->n_sampled;
+        }
+
+      if (region->n_duplicate > 0)
+        g_ptr_array_add (sorted_regions, region);
+    }
+
+  for (i = 0; i < scan->exes->len; i++)
+    {
+      Executable *exe = g_ptr_array_index (scan->exes, i);
+      if (exe->n_duplicate > 0)
+        g_ptr_array_add (sorted_exes, exe);
+    }
+
+  g_ptr_array_sort (sorted_regions, compare_region_duplicates);
+  g_ptr_array_sort (sorted_exes, compare_exe_duplicates);
+
+  sampled_size = format_pages (scan, scan->samples->len);
+  duplicate_size = format_pages (scan, n_duplicate);
+  savings_size = format_pages (scan, n_savings);
+  zero_size = format_pages (scan, scan->n_zero_pages);
+  region_size = format_pages (scan, n_region_pages);
+
+  g_print ("Scanned %u processes (%u skipped), sampling 1 in %u pages\n",
+           scan->n_processes, scan->n_skipped, scan->sample_every);
+  g_print ("Resident private anonymous memory: %s, plus %s in zero pages\n", sampled_size, zero_size);
+  g_print ("In pages also found in another process: %s, sharing would save %s\n", duplicate_size, savings_size);
+  g_print ("In regions identical to one in another process: %s (%u regions)\n", region_size, n_identical_regions);
+
+  g_print ("\nDuplicate memory by executable:\n");
+  for (i = 0; i < sorted_exes->len && i < n_top; i++)
+    {
+      Executable *exe = g_ptr_array_index (sorted_exes, i);
+      g_autofree char *dup = format_pages (scan, exe->n_duplicate);
+      g_autofree char *total = format_pages (scan, exe->n_sampled);
+
+      g_print ("  %10s of %10s  %s (%u processes)\n", dup, total, exe->name, exe->n_processes);
+    }
+
+  g_print ("\nDuplicate memory by region:\n");
+  for (i = 0; i < sorted_regions->len && i < n_top; i++)
+    {
+      Region *region = g_ptr_array_index (sorted_regions, i);
+      g_autofree char *dup = format_pages (scan, region->n_duplicate);
+      g_autofree char *total = format_pages (scan, region->n_sampled);
+
+      g_print ("  %10s of %10s  %s pid %u\n", dup, total, region->label, region->pid);
+    }
+}
+
+static int
+do_scan (int argc, char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GStrv) pids = NULL;
+  gint sample_every = 1;
+  gint n_top = 20;
+  Scan scan = { 0 };
+  const GOptionEntry options[] = {
+    { "pid", 'p', 0, G_OPTION_ARG_STRING_ARRAY, &pids,  "Only scan PID (default all processes we can read).", "PID" },
+    { "sample", 's', 0, G_OPTION_ARG_INT, &sample_every,  "Only hash one in N pages (default 1).", "N" },
+    { "top", 't', 0, G_OPTION_ARG_INT, &n_top,  "Number of executables and regions to list (default 20).", "N" },
+    { NULL }
+  };
+  guint i;
+
+  context = g_option_context_new ("- find duplicated memory across processes");
+  g_option_context_add_main_entries (context, options, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  scan.sample_every = MAX (sample_every, 1);
+  scan.samples = g_array_new (FALSE, FALSE, sizeof (PageSample));
+  scan.regions = g_ptr_array_new_with_free_func ((GDestroyNotify)region_free);
+  scan.exes = g_ptr_array_new_with_free_func ((GDestroyNotify)executable_free);
+  scan.exe_ids = g_hash_table_new (g_str_hash, g_str_equal);
+
+  if (pids != NULL)
+    {
+      for (i = 0; pids[i] != NULL; i++)
+        scan_process (&scan, (guint32)g_ascii_strtoull (pids[i], NULL, 10));
+    }
+  else
+    {
+      g_autoptr(GDir) proc = g_dir_open ("/proc", 0, &error);
+      const char *name;
+
+      if (proc == NULL)
+        {
+          g_printerr ("%s\n", error->message);
+          return 1;
+        }
+
+      while ((name = g_dir_read_name (proc)) != NULL)
+        {
+          if (g_ascii_isdigit (name[0]))
+            scan_process (&scan, (guint32)g_ascii_strtoull (name, NULL, 10));
+        }
+    }
+
+  report_scan (&scan, MAX (n_top, 0));
+
+  g_array_unref (scan.samples);
+  g_ptr_array_unref (scan.regions);
+  g_hash_table_unref (scan.exe_ids);
+  g_ptr_array_unref (scan.exes);
+
+  return 0;
+}
+
+/* Connects to the bus uniqued is on, like the client library does */
+static GDBusConnection *
+get_uniqued_bus (GError **error)
+{
+  const char *bus_env = g_getenv ("UNIQUED_BUS");
+
+  if (bus_env == NULL || *bus_env == 0 || g_str_equal (bus_env, "session"))
+    return g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, error);
+  else if (g_str_equal (bus_env, "system"))
+    return g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, error);
+  else
+    return g_dbus_connection_new_for_address_sync (bus_env,
+                                                   G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                   G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                   NULL, NULL, error);
+}
+
+static int
+do_overlap (int argc, char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GDBusConnection) bus = NULL;
+  g_autoptr(GVariant) response = NULL;
+  g_autoptr(GVariantIter) pairs = NULL;
+  g_autofree char *analyzed_size = NULL;
+  g_autofree char *duplicate_size = NULL;
+  gint budget_msec = 1000;
+  gint n_top = 20;
+  const GOptionEntry options[] = {
+    { "budget", 'b', 0, G_OPTION_ARG_INT, &budget_msec,  "CPU time uniqued may spend in milliseconds (default 1000).", "MS" },
+    { "top", 't', 0, G_OPTION_ARG_INT, &n_top,  "Number of blob pairs to list (default 20).", "N" },
+    { NULL }
+  };
+  guint64 analyzed_bytes, duplicate_bytes, pair_bytes;
+  const char *checksum_a, *checksum_b;
+  gboolean complete;
+
+  context = g_option_context_new ("- find pages shared between different blobs in uniqued");
+  g_option_context_add_main_entries (context, options, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  bus = get_uniqued_bus (&error);
+  if (bus == NULL)
+    {
+      g_printerr ("Can't find bus: %s\n", error->message);
+      return 1;
+    }
+
+  response = g_dbus_connection_call_sync (bus,
+                                          "org.freedesktop.portal.Unique",
+                                          "/org/freedesktop/portal/unique",
+                                          "org.freedesktop.portal.Unique",
+                                          "AnalyzeOverlap",
+                                          g_variant_new ("(uu)", (guint32)MAX (budget_msec, 1), (guint32)MAX (n_top, 0)),
+                                          G_VARIANT_TYPE ("(tta(sst)b)"),
+                                          G_DBUS_CALL_FLAGS_NONE,
+                                          G_MAXINT, /* No timeout, the budget limits it */
+                                          NULL, &error);
+  if (response == NULL)
+    {
+      g_printerr ("AnalyzeOverlap failed: %s\n", error->message);
+      return 1;
+    }
+
+  g_variant_get (response, "(tta(sst)b)", &analyzed_bytes, &duplicate_bytes, &pairs, &complete);
+
+  analyzed_size = g_format_size (analyzed_bytes);
+  duplicate_size = g_format_size (duplicate_bytes);
+  g_print ("Blobs have %s in non-zero pages, of which %s (%.1f%%) duplicate pages of other blobs\n",
+           analyzed_size, duplicate_size,
+           analyzed_bytes ? 100.0 * duplicate_bytes / analyzed_bytes : 0.0);
+  if (!complete)
+    g_print ("Not all blobs were analyzed, use a larger --budget\n");
+
+  g_print ("\nMost overlapping blob pairs:\n");
+  while (g_variant_iter_next (pairs, "(&s&st)", &checksum_a, &checksum_b, &pair_bytes))
+    {
+      g_autofree char *size = g_format_size (pair_bytes);
+      g_print ("  %10s  %s %s\n", size, checksum_a, checksum_b);
+    }
+
+  return 0;
+}
+
+/* A unique blob mapped by some processes, as reported by uniqued or,
+   for blobs it doesn't show us, recognized by the name of the memfd.
+   Small blobs uniqued packed into the same segment are counted as one. */
+typedef struct {
+  char *name;
+  guint n_packed;
+  guint64 size;
+  guint n_handles;
+  GArray *holders;  /* pids with handles, from uniqued */
+  GArray *mappers;  /* pids mapping it */
+  guint64 rss;
+  guint64 pss;
+} MemBlob;
+
+typedef struct {
+  guint32 pid;
+  char *comm;
+  guint n_mappings;
+  guint64 rss;
+  guint64 pss;
+} MemProcess;
+
+typedef struct {
+  GHashTable *blobs;      /* "major:minor:inode" -> MemBlob */
+  GPtrArray *processes;   /* MemProcess */
+  GHashTable *comms;      /* pid -> comm, owned by processes */
+  GVariant *totals;       /* a{st} from uniqued, or NULL */
+  guint n_skipped;
+} MemScan;
+
+static void
+mem_blob_free (MemBlob *blob)
+{
+  g_free (blob->name);
+  g_array_unref (blob->holders);
+  g_array_unref (blob->mappers);
+  g_free (blob);
+}
+
+static void
+mem_process_free (MemProcess *process)
+{
+  g_free (process->comm);
+  g_free (process);
+}
+
+static MemBlob *
+mem_blob_new (const char *name,
+              guint64     size)
+{
+  MemBlob *blob = g_new0 (MemBlob, 1);
+
+  blob->name = g_strdup (name);
+  blob->size = size;
+  blob->holders = g_array_new (FALSE, FALSE, sizeof (guint32));
+  blob->mappers = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  return blob;
+}
+
+static char *
+inode_key (guint major_dev, guint minor_dev, guint64 inode)
+{
+  return g_strdup_printf ("%x:%x:%" G_GUINT64_FORMAT, major_dev, minor_dev, inode);
+}
+
+/* Asks uniqued which blobs it has. Fails quietly, as we can still go
+   by memfd names without it. */
+static void
+get_uniqued_stats (MemScan *scan)
+{
+  g_autoptr(GDBusConnection) bus = NULL;
+  g_autoptr(GVariant) response = NULL;
+  g_autoptr(GVariantIter) blobs = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) pids = NULL;
+  const char *checksum;
+  guint64 size, dev, inode;
+  guint32 n_handles;
+  gsize i;
+
+  bus = get_uniqued_bus (&error);
+  if (bus != NULL)
+    response = g_dbus_connection_call_sync (bus,
+                                            "org.freedesktop.portal.Unique",
+                                            "/org/freedesktop/portal/unique",
+                                            "org.freedesktop.portal.Unique",
+                                            "GetStats",
+                                            NULL,
+                                            G_VARIANT_TYPE ("(a{st}a(stttuau))"),
+                                            G_DBUS_CALL_FLAGS_NONE,
+                                            -1, NULL, &error);
+  if (response == NULL)
+    {
+      g_printerr ("Can't get uniqued statistics: %s\n", error->message);
+      return;
+    }
+
+  g_variant_get (response, "(@a{st}a(stttuau))", &scan->totals, &blobs);
+  while (g_variant_iter_next (blobs, "(&stttu@au)", &checksum, &size, &dev, &inode, &n_handles, &pids))
+    {
+      g_autofree char *key = inode_key (major (dev), minor (dev), inode);
+      MemBlob *blob = g_hash_table_lookup (scan->blobs, key);
+      gconstpointer pid_data;
+      gsize n_pids;
+
+      if (blob == NULL)
+        {
+          blob = mem_blob_new (checksum, 0);
+          g_hash_table_insert (scan->blobs, g_steal_pointer (&key), blob);
+        }
+      else
+        {
+          g_free (blob->name);
+          blob->name = g_strdup_printf ("%u packed", blob->n_packed + 1);
+        }
+
+      blob->n_packed++;
+      blob->size += size;
+      blob->n_handles += n_handles;
+      pid_data = g_variant_get_fixed_array (pids, &n_pids, sizeof (guint32));
+      for (i = 0; i < n_pids; i++)
+        {
+          guint32 pid = ((const guint32 *)pid_data)[i];
+          guint j;
+
+          for (j = 0; j < blob->holders->len; j++)
+            if (g_array_index (blob->holders, guint32, j) == pid)
+              break;
+          if (j == blob->holders->len)
+            g_array_append_val (blob->holders, pid);
+        }
+      g_clear_pointer (&pids, g_variant_unref);
+    }
+}
+
+static gboolean
+is_unique_mapping_path (const char *path)
+{
+  /* Client memfds, memfds uniqued made itself, and store entries */
+  return g_str_has_prefix (path, "/memfd:unique-") ||
+         g_str_has_prefix (path, "/memfd:uniqued-") ||
+         strstr (path, "/unique-bytes-") != NULL;
+}
+
+static void
+mem_scan_process (MemScan *scan, guint32 pid)
+{
+  g_autofree char *smaps_path = g_strdup_printf ("/proc/%u/smaps", pid);
+  g_autofree char *comm_path = g_strdup_printf ("/proc/%u/comm", pid);
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  MemProcess *process = NULL;
+  MemBlob *blob = NULL;
+  guint i;
+
+  if (!g_file_get_contents (smaps_path, &contents, NULL, NULL))
+    {
+      scan->n_skipped++;
+      return;
+    }
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      unsigned long long inode, kb;
+      unsigned int major_dev, minor_dev;
+      int path_offset = 0;
+      const char *path;
+      g_autofree char *key = NULL;
+
+      if (sscanf (lines[i], "%*x-%*x %*s %*x %x:%x %llu %n",
+                  &major_dev, &minor_dev, &inode, &path_offset) >= 3 &&
+          path_offset > 0)
+        {
+          /* A new mapping */
+          blob = NULL;
+          if (inode == 0)
+            continue;
+
+          path = lines[i] + path_offset;
+          key = inode_key (major_dev, minor_dev, inode);
+          blob = g_hash_table_lookup (scan->blobs, key);
+          if (blob == NULL && is_unique_mapping_path (path))
+            {
+              g_autofree char *name = NULL;
+
+              if (g_str_has_prefix (path, "/memfd:"))
+                name = g_strndup (path + strlen ("/memfd:"), strcspn (path + strlen ("/memfd:"), " "));
+              else
+                name = g_path_get_basename (path);
+
+              blob = mem_blob_new (name, 0);
+              g_hash_table_insert (scan->blobs, g_steal_pointer (&key), blob);
+            }
+          if (blob == NULL)
+            continue;
+
+          if (process == NULL)
+            {
+              process = g_new0 (MemProcess, 1);
+              process->pid = pid;
+              if (g_file_get_contents (comm_path, &process->comm, NULL, NULL))
+                g_strchomp (process->comm);
+              else
+                process->comm = g_strdup ("unknown");
+              g_ptr_array_add (scan->processes, process);
+            }
+
+          process->n_mappings++;
+          if (blob->mappers->len == 0 ||
+              g_array_index (blob->mappers, guint32, blob->mappers->len - 1) != pid)
+            g_array_append_val (blob->mappers, pid);
+        }
+      else if (blob != NULL && sscanf (lines[i], "Rss: %llu kB", &kb) == 1)
+        {
+          blob->rss += kb * 1024;
+          process->rss += kb * 1024;
+        }
+      else if (blob != NULL && sscanf (lines[i], "Pss: %llu kB", &kb) == 1)
+        {
+          blob->pss += kb * 1024;
+          process->pss += kb * 1024;
+        }
+    }
+}
+
+static gint
+compare_process_saved (gconstpointer a,
+                       gconstpointer b)
+{
+  const MemProcess *process_a = *(const MemProcess **)a;
+  const MemProcess *process_b = *(const MemProcess **)b;
+  guint64 saved_a = process_a->rss - process_a->pss;
+  guint64 saved_b = process_b->rss - process_b->pss;
+
+  return (saved_a < saved_b) - (saved_a > saved_b);
+}
+
+static gint
+compare_blob_saved (gconstpointer a,
+                    gconstpointer b)
+{
+  const MemBlob *blob_a = *(const MemBlob **)a;
+  const MemBlob *blob_b = *(const MemBlob **)b;
+  guint64 saved_a = blob_a->rss - blob_a->pss;
+  guint64 saved_b = blob_b->rss - blob_b->pss;
+
+  return (saved_a < saved_b) - (saved_a > saved_b);
+}
+
+static char *
+format_pids (MemScan *scan, GArray *pids, guint max_pids)
+{
+  GString *s = g_string_new ("");
+  guint i;
+
+  for (i = 0; i < pids->len && i < max_pids; i++)
+    {
+      guint32 pid = g_array_index (pids, guint32, i);
+      const char *comm = g_hash_table_lookup (scan->comms, GUINT_TO_POINTER (pid));
+
+      g_string_append_printf (s, "%s%u(%s)", i ? " " : "", pid, comm ? comm : "?");
+    }
+  if (pids->len > max_pids)
+    g_string_append_printf (s, " +%u", pids->len - max_pids);
+
+  return g_string_free (s, FALSE);
+}
+
+static void
+report_mem (MemScan *scan, guint n_top)
+{
+  g_autoptr(GPtrArray) mapped_blobs = g_ptr_array_new ();
+  g_autofree char *rss_size = NULL;
+  g_autofree char *pss_size = NULL;
+  g_autofree char *saved_size = NULL;
+  guint64 rss = 0, pss = 0;
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  for (i = 0; i < scan->processes->len; i++)
+    {
+      MemProcess *process = g_ptr_array_index (scan->processes, i);
+      g_hash_table_insert (scan->comms, GUINT_TO_POINTER (process->pid), process->comm);
+    }
+
+  g_hash_table_iter_init (&iter, scan->blobs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      MemBlob *blob = value;
+
+      if (blob->mappers->len == 0)
+        continue;
+
+      g_ptr_array_add (mapped_blobs, blob);
+      rss += blob->rss;
+      pss += blob->pss;
+    }
+
+  if (scan->totals != NULL)
+    {
+      guint64 apparent = 0, real = 0, cached = 0, n_blobs = 0, n_peers = 0;
+      g_autofree char *apparent_size = NULL;
+      g_autofree char *real_size = NULL;
+      g_autofree char *cached_size = NULL;
+
+      g_variant_lookup (scan->totals, "apparent", "t", &apparent);
+      g_variant_lookup (scan->totals, "real", "t", &real);
+      g_variant_lookup (scan->totals, "cached", "t", &cached);
+      g_variant_lookup (scan->totals, "blobs", "t", &n_blobs);
+      g_variant_lookup (scan->totals, "peers", "t", &n_peers);
+
+      apparent_size = g_format_size (apparent);
+      real_size = g_format_size (real);
+      cached_size = g_format_size (cached);
+      g_print ("uniqued: %" G_GUINT64_FORMAT " blobs for %" G_GUINT64_FORMAT " peers, %s handed out, %s unique, %s cached\n",
+               n_blobs, n_peers, apparent_size, real_size, cached_size);
+    }
+
+  rss_size = g_format_size (rss);
+  pss_size = g_format_size (pss);
+  saved_size = g_format_size (rss - pss);
+  g_print ("%u unique blobs mapped by %u processes: %s resident, %s proportional, %s saved by sharing\n",
+           mapped_blobs->len, scan->processes->len, rss_size, pss_size, saved_size);
+  if (scan->n_skipped > 0)
+    g_print ("Skipped %u processes we are not allowed to inspect\n", scan->n_skipped);
+
+  g_ptr_array_sort (scan->processes, compare_process_saved);
+  g_print ("\nProcesses:\n");
+  g_print ("  %8s %-16s %8s %10s %10s %10s\n", "PID", "COMMAND", "MAPPINGS", "RSS", "PSS", "SAVED");
+  for (i = 0; i < scan->processes->len && i < n_top; i++)
+    {
+      MemProcess *process = g_ptr_array_index (scan->processes, i);
+      g_autofree char *process_rss = g_format_size (process->rss);
+      g_autofree char *process_pss = g_format_size (process->pss);
+      g_autofree char *process_saved = g_format_size (process->rss - process->pss);
+
+      g_print ("  %8u %-16s %8u %10s %10s %10s\n", process->pid, process->comm,
+               process->n_mappings, process_rss, process_pss, process_saved);
+    }
+
+  g_ptr_array_sort (mapped_blobs, compare_blob_saved);
+  g_print ("\nBiggest shared blobs:\n");
+  g_print ("  %-20s %10s %10s %10s %7s  %s\n", "BLOB", "SIZE", "RSS", "SAVED", "HANDLES", "MAPPED BY");
+  for (i = 0; i < mapped_blobs->len && i < n_top; i++)
+    {
+      MemBlob *blob = g_ptr_array_index (mapped_blobs, i);
+      g_autofree char *blob_size = blob->size ? g_format_size (blob->size) : g_strdup ("?");
+      g_autofree char *blob_rss = g_format_size (blob->rss);
+      g_autofree char *blob_saved = g_format_size (blob->rss - blob->pss);
+      g_autofree char *handles = blob->holders->len ? g_strdup_printf ("%u", blob->n_handles) : g_strdup ("?");
+      g_autofree char *mappers = format_pids (scan, blob->mappers, 6);
+
+      g_print ("  %-20.20s %10s %10s %10s %7s  %s\n", blob->name, blob_size,
+               blob_rss, blob_saved, handles, mappers);
+
+      /* Handles nobody maps are what the reaper is for */
+      if (blob->holders->len > blob->mappers->len)
+        {
+          g_autofree char *holders = format_pids (scan, blob->holders, 6);
+          g_print ("  %-20s %10s %10s %10s %7s  held by %s\n", "", "", "", "", "", holders);
+        }
+    }
+}
+
+static int
+do_mem (int argc, char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GStrv) pids = NULL;
+  gint n_top = 20;
+  MemScan scan = { 0 };
+  const GOptionEntry options[] = {
+    { "pid", 'p', 0, G_OPTION_ARG_STRING_ARRAY, &pids,  "Only look at PID (default all processes we can read).", "PID" },
+    { "top", 't', 0, G_OPTION_ARG_INT, &n_top,  "Number of processes and blobs to list (default 20).", "N" },
+    { NULL }
+  };
+  guint i;
+
+  context = g_option_context_new ("- show which processes map which unique blobs");
+  g_option_context_add_main_entries (context, options, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  scan.blobs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)mem_blob_free);
+  scan.processes = g_ptr_array_new_with_free_func ((GDestroyNotify)mem_process_free);
+  scan.comms = g_hash_table_new (NULL, NULL);
+
+  get_uniqued_stats (&scan);
+
+  if (pids != NULL)
+    {
+      for (i = 0; pids[i] != NULL; i++)
+        mem_scan_process (&scan, (guint32)g_ascii_strtoull (pids[i], NULL, 10));
+    }
+  else
+    {
+      g_autoptr(GDir) proc = g_dir_open ("/proc", 0, &error);
+      const char *name;
+
+      if (proc == NULL)
+        {
+          g_printerr ("%s\n", error->message);
+          return 1;
+        }
+
+      while ((name = g_dir_read_name (proc)) != NULL)
+        {
+          if (g_ascii_isdigit (name[0]))
+            mem_scan_process (&scan, (guint32)g_ascii_strtoull (name, NULL, 10));
+        }
+    }
+
+  report_mem (&scan, MAX (n_top, 0));
+
+  g_clear_pointer (&scan.totals, g_variant_unref);
+  g_hash_table_unref (scan.comms);
+  g_ptr_array_unref (scan.processes);
+  g_hash_table_unref (scan.blobs);
+
+  return 0;
+}
+
+static void
+usage (void)
+{
+  g_printerr ("Usage: %s COMMAND [OPTIONS...]\n"
+              "\n"
+              "Commands:\n"
+              "  scan      Find duplicated memory across running processes\n"
+              "  overlap   Find pages shared between different blobs in uniqued\n"
+              "  mem       Show which processes map which unique blobs\n",
+              g_get_prgname ());
+}
+
+int
+main (int argc, char **argv)
+{
+  g_set_prgname ("uniquectl");
+
+  if (argc < 2)
+    {
+      usage ();
+      return 1;
+    }
+
+  /* Let the command parse its own options, with its name as argv[0] */
+  if (strcmp (argv[1], "scan") == 0)
+    return do_scan (argc - 1, argv + 1);
+  if (strcmp (argv[1], "overlap") == 0)
+    return do_overlap (argc - 1, argv + 1);
+  if (strcmp (argv[1], "mem") == 0)
+    return do_mem (argc - 1, argv + 1);
+
+  usage ();
+  return 1;
+}
@@ -2,32 +2,177 @@
 #define GETTEXT_PACKAGE "uniqued"
 
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <pwd.h>
+#include <time.h>
 #include <glib.h>
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
 
+#include "unique-intern.h"
+#include "unique-page.h"
+#include "unique-sha1.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
 static gsize real_blob_size;
 static gsize apparent_blob_size;
+static gsize elided_blob_size;
+static gsize ghost_blob_size;
+static gsize reaped_blob_size;
+static gsize migrated_blob_size;
+static gsize packed_blob_size;
+static gsize unhashed_blob_size;
+static double admission_threshold;
+static gboolean rematerialize;
+static gint reap_interval;
+static gint reap_budget_ms;
+static gint compact_interval;
+static GDBusConnection *bus;
+
+/* Blobs and cache entries are only shared between peers in the same
+   sharing domain, which is derived from the peer credentials. Cache
+   keys of the allowlisted global classes (the part before the first
+   ':') are shared by everyone, but only our own user and the trusted
+   uids get to write them. Anyone else's writes of such keys stay in
+   their own domain, so they can't poison what other users read. */
+typedef enum {
+  SHARING_DOMAIN_UID,
+  SHARING_DOMAIN_GROUP,
+  SHARING_DOMAIN_GLOBAL,
+} SharingDomainKind;
+
+static SharingDomainKind sharing_domain_kind;
+static char **global_classes;
+static GArray *trusted_uids;
+
+#define GLOBAL_DOMAIN "global"
+
+#define DIGEST_LEN 20 /* SHA1 */
+
+/* A sealed memfd holding several small blobs, see compact_timeout() */
+typedef struct {
+  int ref_count;
+  gsize size;
+  gsize live_size; /* Of the blobs still in it */
+  dev_t arena_dev; /* For adopted arenas, see arena_segments */
+  ino_t arena_ino;
+} Segment;
 
 typedef struct {
+  char *key; /* domain/checksum */
   char *checksum;
+  guint8 digest[DIGEST_LEN];
   gsize len;
+  gsize hole_len; /* Zero pages never written by the client */
   int fd;
   int ref_count;
+  /* Ghosts are blobs that were judged unlikely to be shared. We only
+     remember their checksum, and leave the data with the (only) peer
+     that has it, until a duplicate arrives and promotes them. */
+  char *ghost_owner;
+  guint32 ghost_owner_id;
+  gint64 fd_time; /* When fd was set, for the reaper */
+  char *creator; /* Peer that wrote fd, NULL once it died or if we did */
+  guint32 parent_id; /* Our handle for it in the parent uniqued, or 0 */
+  gsize offset; /* Of the data in fd, which is shared if segment is set */
+  Segment *segment;
+  char *fingerprint_key; /* Only for large blobs, see fingerprint_key() */
+  int unhashed_fd; /* The data of unhashed ghosts, -1 otherwise */
 } Blob;
 
+/* Used to estimate how likely a new blob is to be shared later */
+typedef struct {
+  guint64 submissions;
+  guint64 hits;
+} ShareStats;
+
 typedef struct {
   char *name;
   guint32 next_blob_id;
-  GHashTable *blobs;
+  GHashTable *blobs; /* Handle id -> PeerBlob */
+  ShareStats share_stats;
+  guint32 pid; /* 0 if not known */
+  guint32 uid; /* G_MAXUINT32 if not known */
+  char *domain; /* NULL until we have the credentials */
+  GQueue pending_calls; /* Invocations waiting for the credentials */
+  gint64 last_reap_time;
 } Peer;
 
+typedef struct {
+  Blob *blob;
+  gint64 added_time;
+} PeerBlob;
+
+/* The memo cache maps caller-defined keys (say "path+mtime+decoder-version")
+   to blobs holding data derived from them, so that only the first process
+   has to do the work. Entries keep their blob alive, and the least recently
+   used ones are evicted when the total size goes over cache_budget. */
+typedef struct {
+  char *key;
+  Blob *blob;
+  GList *lru_link;
+} CacheEntry;
+
+/* Channels are named, versioned blobs, say a routing table that is
+   republished now and then. The channel keeps its latest version alive,
+   and each Publish of new content bumps the version and sends the new
+   blob (with a handle) to every subscriber in a ChannelUpdated signal.
+   Older versions go away with the last handle for them. A channel is
+   dropped once none of its publishers or subscribers are left, so a
+   channel lives no longer than the peers using it. */
+typedef struct {
+  char *key; /* Domain and name, like cache keys */
+  char *name;
+  Blob *blob; /* Latest version, NULL until published */
+  guint64 version;
+  GHashTable *subscribers; /* Peer names */
+  GHashTable *publishers; /* Peer names */
+} Channel;
+
 static GHashTable *peers;
 static GHashTable *blobs;
+static GHashTable *fingerprints; /* Fingerprint key -> number of blobs */
+static GHashTable *unhashed_ghosts; /* Fingerprint key -> Blob */
+static ShareStats size_class_share_stats[64]; /* Indexed by log2 of size */
+static GHashTable *cache;
+static GQueue cache_lru = G_QUEUE_INIT; /* Most recently used first */
+static gsize cache_size;
+static gsize cache_budget;
+static GHashTable *channels;
+static GHashTable *arena_segments; /* Adopted arenas by inode */
+
+/* With --parent, uniqued forwards new blobs and memo cache traffic to
+   another uniqued (typically the host's, with its bus socket mounted
+   into the container), and adopts the parent's fd for content the parent
+   already has, so pages are shared across all its children. Requests are
+   always served locally first, and while the parent is unreachable we
+   just carry on without it.
+
+   The parent keeps everything we send in our one sharing domain there,
+   so only global blobs are forwarded and adopted that way. Cache entries
+   of other domains still go to the parent under domain-qualified keys,
+   but what we get back for them is copied rather than shared, so no two
+   of our domains ever end up on the same pages. */
+#define PARENT_RECONNECT_INTERVAL 10 /* seconds */
+#define PARENT_HANDOVER_BATCH 32 /* blobs */
+#define PARENT_HANDOVER_INTERVAL 100 /* msec */
+
+static char *parent_address;
+static GDBusConnection *parent_bus; /* NULL while not connected */
+static guint parent_watch_id;
+static GHashTable *parent_blobs; /* Handle in parent -> Blob */
+G_LOCK_DEFINE_STATIC (parent_owner);
+static char *parent_owner; /* Unique name of the parent uniqued */
+static GQueue parent_handover = G_QUEUE_INIT; /* Blobs yet to forward */
+static guint parent_handover_id;
 
 static inline int
 steal_fd (int *fdp)
@@ -52,321 +197,4105 @@ print_stats (void)
 {
   g_autofree gchar *real_size = g_format_size (real_blob_size);
   g_autofree gchar *apparent_size = g_format_size (apparent_blob_size);
-  g_debug ("Total apparent memory size: %s, actual size: %s", apparent_size, real_size);
+  g_autofree gchar *cached_size = g_format_size (cache_size);
+  g_autofree gchar *elided_size = g_format_size (elided_blob_size);
+  g_autofree gchar *ghost_size = g_format_size (ghost_blob_size);
+  g_autofree gchar *reaped_size = g_format_size (reaped_blob_size);
+  g_autofree gchar *migrated_size = g_format_size (migrated_blob_size);
+  g_autofree gchar *packed_size = g_format_size (packed_blob_size);
+  g_autofree gchar *unhashed_size = g_format_size (unhashed_blob_size);
+  g_debug ("Total apparent memory size: %s, actual size: %s, cached: %s, zero pages elided: %s, ghosts: %s, reaped: %s, migrated: %s, packed: %s, unhashed: %s",
+           apparent_size, real_size, cached_size, elided_size, ghost_size, reaped_size, migrated_size, packed_size, unhashed_size);
 }
 
 static Blob *
 blob_ref (Blob *blob)
 {
-  blob->ref_count++;
-  return blob;
-}
+  blob->ref_count++;
+  return blob;
+}
+
+static void
+parent_forget (guint32 parent_id)
+{
+  if (parent_bus == NULL)
+    return;
+
+  g_dbus_connection_call (parent_bus,
+                          "org.freedesktop.portal.Unique",
+                          "/org/freedesktop/portal/unique",
+                          "org.freedesktop.portal.Unique",
+                          "Forget",
+                          g_variant_new ("(u)", parent_id),
+                          NULL, G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
+                          NULL, NULL, NULL);
+}
+
+static void
+segment_free (Segment *segment)
+{
+  if (g_hash_table_lookup (arena_segments, segment) == segment)
+    g_hash_table_remove (arena_segments, segment);
+  g_free (segment);
+}
+
+/* Takes blob out of its segment, if any. The caller replaces fd. */
+static void
+blob_unpack (Blob *blob)
+{
+  Segment *segment = blob->segment;
+
+  if (segment == NULL)
+    return;
+
+  segment->live_size -= blob->len;
+  packed_blob_size -= blob->len;
+  if (--segment->ref_count == 0)
+    segment_free (segment);
+
+  blob->segment = NULL;
+  blob->offset = 0;
+}
+
+static void
+blob_set_fingerprint (Blob *blob,
+                      char *fingerprint_key)
+{
+  guint n = GPOINTER_TO_UINT (g_hash_table_lookup (fingerprints, fingerprint_key));
+
+  blob->fingerprint_key = fingerprint_key;
+  g_hash_table_insert (fingerprints, g_strdup (fingerprint_key), GUINT_TO_POINTER (n + 1));
+}
+
+static void
+blob_unref (Blob *blob)
+{
+  blob->ref_count--;
+  if (blob->ref_count == 0)
+    {
+      g_debug ("Blob for %s destroyed", blob->checksum ? blob->checksum : blob->fingerprint_key);
+
+      blob_unpack (blob);
+      if (blob->fd >= 0)
+        {
+          real_blob_size -= blob->len;
+          elided_blob_size -= blob->hole_len;
+          close (blob->fd);
+        }
+      else
+        ghost_blob_size -= blob->len;
+
+      if (blob->unhashed_fd >= 0)
+        {
+          unhashed_blob_size -= blob->len;
+          close (blob->unhashed_fd);
+          g_hash_table_remove (unhashed_ghosts, blob->fingerprint_key);
+        }
+
+      if (blob->fingerprint_key != NULL)
+        {
+          guint n = GPOINTER_TO_UINT (g_hash_table_lookup (fingerprints, blob->fingerprint_key));
+          if (n > 1)
+            g_hash_table_insert (fingerprints, g_strdup (blob->fingerprint_key), GUINT_TO_POINTER (n - 1));
+          else
+            g_hash_table_remove (fingerprints, blob->fingerprint_key);
+        }
+
+      if (blob->key != NULL)
+        g_hash_table_remove (blobs, blob->key);
+
+      if (blob->parent_id != 0)
+        {
+          g_hash_table_remove (parent_blobs, GUINT_TO_POINTER (blob->parent_id));
+          parent_forget (blob->parent_id);
+        }
+
+      g_free (blob->ghost_owner);
+      g_free (blob->creator);
+      g_free (blob->fingerprint_key);
+      g_free (blob->checksum);
+      g_free (blob->key);
+      g_free (blob);
+    }
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Blob, blob_unref)
+
+/* Pass fd -1 to create a ghost */
+static Blob *
+blob_new (const char *domain,
+          int fd,
+          const char *checksum,
+          const guint8 *digest,
+          gsize size,
+          gsize hole_size)
+{
+  Blob *blob = g_new0 (Blob, 1);
+
+  blob->key = g_strconcat (domain, "/", checksum, NULL);
+  blob->checksum = g_strdup (checksum);
+  memcpy (blob->digest, digest, DIGEST_LEN);
+  blob->fd = fd;
+  blob->unhashed_fd = -1;
+  blob->len = size;
+  blob->hole_len = hole_size;
+  blob->ref_count = 1;
+  blob->fd_time = g_get_monotonic_time ();
+
+  if (blob->fd >= 0)
+    {
+      real_blob_size += blob->len;
+      elided_blob_size += blob->hole_len;
+    }
+  else
+    ghost_blob_size += blob->len;
+
+  g_hash_table_insert (blobs, blob->key, blob);
+
+  return blob;
+}
+
+/* Tells peer_name to switch its mapping of handle blob_id over to fd,
+   which has the same content as what it has mapped now. */
+static void
+send_remap (const char *peer_name,
+            guint32     blob_id,
+            int         fd)
+{
+  g_autoptr(GDBusMessage) message = NULL;
+  g_autoptr(GUnixFDList) fd_list = g_unix_fd_list_new ();
+  g_autoptr(GError) error = NULL;
+  gint fd_handle;
+
+  fd_handle = g_unix_fd_list_append (fd_list, fd, &error);
+  if (fd_handle < 0)
+    {
+      g_warning ("Failed to dup fd: %s", error->message);
+      return;
+    }
+
+  message = g_dbus_message_new_signal ("/org/freedesktop/portal/unique",
+                                       "org.freedesktop.portal.Unique",
+                                       "Remap");
+  g_dbus_message_set_destination (message, peer_name);
+  g_dbus_message_set_body (message, g_variant_new ("(uh)", blob_id, fd_handle));
+  g_dbus_message_set_unix_fd_list (message, fd_list);
+
+  if (!g_dbus_connection_send_message (bus, message, G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, &error))
+    g_warning ("Failed to send Remap to %s: %s", peer_name, error->message);
+}
+
+/* A duplicate of a ghost arrived, so make fd the canonical copy and have
+   the owner switch over to it. */
+static void blob_ensure_fingerprint (Blob *blob);
+
+static void
+blob_promote (Blob       *blob,
+              int         fd,
+              gsize       hole_size,
+              const char *creator)
+{
+  g_debug ("Promoting ghost %s", blob->checksum);
+
+  blob->fd = fd;
+  blob->creator = g_strdup (creator);
+  blob->hole_len = hole_size;
+  blob->fd_time = g_get_monotonic_time ();
+
+  ghost_blob_size -= blob->len;
+  real_blob_size += blob->len;
+  elided_blob_size += blob->hole_len;
+
+  blob_ensure_fingerprint (blob);
+
+  if (blob->ghost_owner)
+    {
+      send_remap (blob->ghost_owner, blob->ghost_owner_id, blob->fd);
+      g_clear_pointer (&blob->ghost_owner, g_free);
+    }
+}
+
+/* Switches blob over to fd, which has the same content, and has everyone
+   holding it remap. */
+static void
+blob_replace_fd (Blob *blob,
+                 int   fd)
+{
+  GHashTableIter peer_iter, blob_iter;
+  gpointer key, value;
+
+  blob_unpack (blob);
+  close (blob->fd);
+  blob->fd = fd;
+  blob->fd_time = g_get_monotonic_time ();
+
+  g_hash_table_iter_init (&peer_iter, peers);
+  while (g_hash_table_iter_next (&peer_iter, NULL, &value))
+    {
+      Peer *peer = value;
+
+      g_hash_table_iter_init (&blob_iter, peer->blobs);
+      while (g_hash_table_iter_next (&blob_iter, &key, &value))
+        {
+          PeerBlob *peer_blob = value;
+          if (peer_blob->blob == blob)
+            send_remap (peer->name, GPOINTER_TO_UINT (key), blob->fd);
+        }
+    }
+}
+
+static guint
+size_class (gsize size)
+{
+  return MIN (g_bit_storage (size), G_N_ELEMENTS (size_class_share_stats) - 1);
+}
+
+static double
+share_probability (ShareStats *stats)
+{
+  /* Laplace smoothing, so that classes we know nothing about start at 1/2 */
+  return (stats->hits + 1.0) / (stats->submissions + 2.0);
+}
+
+static void
+record_submission (Peer    *peer,
+                   gsize    size,
+                   gboolean hit)
+{
+  ShareStats *class_stats = &size_class_share_stats[size_class (size)];
+
+  class_stats->submissions++;
+  peer->share_stats.submissions++;
+  if (hit)
+    {
+      class_stats->hits++;
+      peer->share_stats.hits++;
+    }
+}
+
+/* Decides whether a new blob gets a full entry, or just a ghost */
+static gboolean
+should_admit (Peer *peer,
+              gsize size)
+{
+  double p;
+
+  if (admission_threshold <= 0)
+    return TRUE;
+
+  p = (share_probability (&size_class_share_stats[size_class (size)]) +
+       share_probability (&peer->share_stats)) / 2;
+
+  return p >= admission_threshold;
+}
+
+static char *
+digest_to_checksum (const guint8 *digest)
+{
+  char *checksum = g_malloc (DIGEST_LEN * 2 + 1);
+  int i;
+
+  for (i = 0; i < DIGEST_LEN; i++)
+    g_snprintf (checksum + i * 2, 3, "%02x", digest[i]);
+
+  return checksum;
+}
+
+static Blob *
+lookup_blob (const char *domain,
+             const char *checksum)
+{
+  g_autofree char *key = g_strconcat (domain, "/", checksum, NULL);
+  Blob *blob = g_hash_table_lookup (blobs, key);
+
+  if (blob)
+    return blob_ref (blob);
+
+  return NULL;
+}
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_debug ("Dropping cache entry %s", entry->key);
+
+  cache_size -= entry->blob->len;
+  g_queue_delete_link (&cache_lru, entry->lru_link);
+
+  blob_unref (entry->blob);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+static void
+cache_evict (void)
+{
+  while (cache_size > cache_budget && cache_lru.tail != NULL)
+    {
+      CacheEntry *entry = cache_lru.tail->data;
+      g_hash_table_remove (cache, entry->key);
+    }
+}
+
+static void
+cache_put (const char *key, Blob *blob)
+{
+  CacheEntry *entry;
+
+  g_hash_table_remove (cache, key);
+
+  if (blob->len > cache_budget)
+    return;
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->blob = blob_ref (blob);
+  g_queue_push_head (&cache_lru, entry);
+  entry->lru_link = cache_lru.head;
+  cache_size += blob->len;
+
+  g_hash_table_insert (cache, entry->key, entry);
+
+  cache_evict ();
+}
+
+static Blob *
+cache_get (const char *key)
+{
+  CacheEntry *entry = g_hash_table_lookup (cache, key);
+
+  if (entry == NULL)
+    return NULL;
+
+  g_queue_unlink (&cache_lru, entry->lru_link);
+  g_queue_push_head_link (&cache_lru, entry->lru_link);
+
+  return blob_ref (entry->blob);
+}
+
+static void
+removed_blob_from_peer_cb (PeerBlob *peer_blob)
+{
+  apparent_blob_size -= peer_blob->blob->len;
+  blob_unref (peer_blob->blob);
+  g_free (peer_blob);
+}
+
+/* What GetConnectionCredentials told us about a peer, looked up in a
+   worker thread as the bus and the user database may be slow */
+typedef struct {
+  char *name;
+  guint32 pid; /* 0 if not known */
+  guint32 uid; /* G_MAXUINT32 if not known */
+  char *domain;
+} PeerCredentials;
+
+static void
+peer_credentials_free (PeerCredentials *credentials)
+{
+  g_free (credentials->name);
+  g_free (credentials->domain);
+  g_free (credentials);
+}
+
+static char *
+domain_for_uid (guint32 uid)
+{
+  struct passwd pwbuf, *pw = NULL;
+  char buffer[16 * 1024];
+
+  switch (sharing_domain_kind)
+    {
+    case SHARING_DOMAIN_GLOBAL:
+      return g_strdup (GLOBAL_DOMAIN);
+
+    case SHARING_DOMAIN_GROUP:
+      if (getpwuid_r (uid, &pwbuf, buffer, sizeof (buffer), &pw) == 0 && pw != NULL)
+        return g_strdup_printf ("gid:%u", (guint)pw->pw_gid);
+      return g_strdup_printf ("uid:%u", uid);
+
+    case SHARING_DOMAIN_UID:
+    default:
+      return g_strdup_printf ("uid:%u", uid);
+    }
+}
+
+static void
+peer_credentials_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  PeerCredentials *peer_credentials = task_data;
+  g_autoptr(GVariant) response = NULL;
+  g_autoptr(GVariant) credentials = NULL;
+  g_autoptr(GError) error = NULL;
+  guint32 uid;
+
+  response = g_dbus_connection_call_sync (bus,
+                                          "org.freedesktop.DBus",
+                                          "/org/freedesktop/DBus",
+                                          "org.freedesktop.DBus",
+                                          "GetConnectionCredentials",
+                                          g_variant_new ("(s)", peer_credentials->name),
+                                          G_VARIANT_TYPE ("(a{sv})"),
+                                          G_DBUS_CALL_FLAGS_NONE,
+                                          -1, NULL, &error);
+  if (response == NULL)
+    g_debug ("Can't get credentials of %s: %s", peer_credentials->name, error->message);
+  else
+    {
+      credentials = g_variant_get_child_value (response, 0);
+      g_variant_lookup (credentials, "ProcessID", "u", &peer_credentials->pid);
+
+      if (g_variant_lookup (credentials, "UnixUserID", "u", &uid))
+        {
+          peer_credentials->uid = uid;
+          peer_credentials->domain = domain_for_uid (uid);
+        }
+    }
+
+  /* If we don't know who it is, don't share with anyone */
+  if (peer_credentials->domain == NULL)
+    peer_credentials->domain = g_strdup_printf ("peer:%s", peer_credentials->name);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void dispatch_method_call (GDBusMethodInvocation *invocation);
+
+static void
+peer_credentials_done (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+  PeerCredentials *credentials = g_task_get_task_data (G_TASK (res));
+  GDBusMethodInvocation *invocation;
+  Peer *peer;
+
+  /* The peer died meanwhile, and its calls went with it */
+  peer = g_hash_table_lookup (peers, credentials->name);
+  if (peer == NULL)
+    return;
+
+  peer->pid = credentials->pid;
+  peer->uid = credentials->uid;
+  peer->domain = g_steal_pointer (&credentials->domain);
+  g_debug ("New peer %s (pid %u) in sharing domain %s", peer->name, peer->pid, peer->domain);
+
+  while ((invocation = g_queue_pop_head (&peer->pending_calls)) != NULL)
+    dispatch_method_call (invocation);
+}
+
+/* Looks up the pid (for the reaper) and sharing domain of peer. Calls
+   from peer are queued until we know its domain. */
+static void
+get_peer_credentials (Peer *peer)
+{
+  g_autoptr(GTask) task = NULL;
+  PeerCredentials *credentials;
+
+  credentials = g_new0 (PeerCredentials, 1);
+  credentials->name = g_strdup (peer->name);
+  credentials->uid = G_MAXUINT32;
+
+  task = g_task_new (NULL, NULL, peer_credentials_done, NULL);
+  g_task_set_task_data (task, credentials, (GDestroyNotify)peer_credentials_free);
+  g_task_run_in_thread (task, peer_credentials_thread);
+}
+
+static gboolean
+peer_may_write_global (Peer *peer)
+{
+  guint i;
+
+  if (peer->uid == G_MAXUINT32)
+    return FALSE;
+
+  if (peer->uid == getuid ())
+    return TRUE;
+
+  for (i = 0; trusted_uids != NULL && i < trusted_uids->len; i++)
+    {
+      if (g_array_index (trusted_uids, guint32, i) == peer->uid)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Returns the domain that cache key is shared in for peer, when reading
+   it or (if write is set) when writing it */
+static const char *
+domain_for_cache_key (Peer       *peer,
+                      const char *key,
+                      gboolean    write)
+{
+  const char *colon = strchr (key, ':');
+  int i;
+
+  if (colon != NULL && global_classes != NULL)
+    {
+      for (i = 0; global_classes[i] != NULL; i++)
+        {
+          if (strlen (global_classes[i]) == colon - key &&
+              strncmp (global_classes[i], key, colon - key) == 0)
+            return (!write || peer_may_write_global (peer)) ? GLOBAL_DOMAIN : peer->domain;
+        }
+    }
+
+  return peer->domain;
+}
+
+/* Creates the peer for the sender of a call, whose credentials then
+   arrive later. Return value owned by peers table, only destroyed when
+   peer dies. */
+static Peer *
+add_peer (const char *name)
+{
+  Peer *peer;
+
+  peer = g_new0 (Peer, 1);
+  peer->name = g_strdup (name);
+  peer->next_blob_id = 1;
+  peer->uid = G_MAXUINT32;
+  peer->blobs = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)removed_blob_from_peer_cb);
+  g_queue_init (&peer->pending_calls);
+  g_hash_table_insert (peers, peer->name, peer);
+
+  get_peer_credentials (peer);
+
+  return peer;
+}
+
+/* Only for peers whose calls we're handling, which method_call() made
+   sure exist and have credentials */
+static Peer *
+lookup_peer (const char *name)
+{
+  return g_hash_table_lookup (peers, name);
+}
+
+static void
+peer_free (Peer *peer)
+{
+  GDBusMethodInvocation *invocation;
+
+  while ((invocation = g_queue_pop_head (&peer->pending_calls)) != NULL)
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                           G_DBUS_ERROR_FAILED, "Peer went away");
+
+  g_hash_table_destroy (peer->blobs);
+  g_free (peer->domain);
+  g_free (peer->name);
+  g_free (peer);
+}
+
+static guint32
+add_blob_to_peer (const char *peer_name, Blob *blob)
+{
+  Peer *peer = lookup_peer (peer_name);
+  guint32 blob_id = peer->next_blob_id++;
+  PeerBlob *peer_blob = g_new0 (PeerBlob, 1);
+
+  peer_blob->blob = blob_ref (blob);
+  peer_blob->added_time = g_get_monotonic_time ();
+
+  apparent_blob_size += blob->len;
+  g_hash_table_insert (peer->blobs, GUINT_TO_POINTER(blob_id), peer_blob);
+
+  g_debug ("Added blob %d (with checksum %s) for peer %s", blob_id, blob->checksum, peer_name);
+
+  return blob_id;
+}
+
+static void
+remove_blob_from_peer (const char *peer_name, guint32 blob_id)
+{
+  Peer *peer = g_hash_table_lookup (peers, peer_name);
+
+  /* Never called us, so it has no handles */
+  if (peer == NULL)
+    return;
+
+  g_debug ("Removing blob %d for peer %s", blob_id, peer_name);
+
+  g_hash_table_remove (peer->blobs, GUINT_TO_POINTER(blob_id));
+}
+
+/* The reaper releases handles that a peer provably doesn't map anymore,
+   say because it leaked the Forget call. The main thread takes a
+   snapshot of the handles, a worker thread matches them against
+   /proc/<pid>/maps within a CPU time budget, and the main thread then
+   drops the handles that are still the same ones it looked at. */
+
+typedef struct {
+  guint32 blob_id;
+  Blob *blob; /* Only compared, never dereferenced by the worker */
+  gint64 added_time;
+  dev_t dev;
+  ino_t ino;
+  gboolean eligible; /* Old enough that the peer must have mapped it */
+  gboolean packed; /* In a segment or arena, which clients map once for all its blobs */
+  gboolean unmapped; /* Result */
+} ReapHandle;
+
+typedef struct {
+  char *peer_name;
+  guint32 pid;
+  GArray *handles;
+  gboolean scanned; /* Result */
+} ReapPeer;
+
+typedef struct {
+  GPtrArray *peers; /* Least recently scanned first */
+  gint64 budget_usec;
+} ReapScan;
+
+static gboolean reap_in_progress;
+
+static void
+reap_peer_free (ReapPeer *reap_peer)
+{
+  g_free (reap_peer->peer_name);
+  g_array_unref (reap_peer->handles);
+  g_free (reap_peer);
+}
+
+static void
+reap_scan_free (ReapScan *scan)
+{
+  g_ptr_array_unref (scan->peers);
+  g_free (scan);
+}
+
+static gint
+compare_reap_time (gconstpointer a,
+                   gconstpointer b)
+{
+  const Peer *peer_a = *(const Peer **)a;
+  const Peer *peer_b = *(const Peer **)b;
+
+  return (peer_a->last_reap_time > peer_b->last_reap_time) - (peer_a->last_reap_time < peer_b->last_reap_time);
+}
+
+static ReapScan *
+reap_scan_new (void)
+{
+  g_autoptr(GPtrArray) sorted_peers = g_ptr_array_new ();
+  gint64 now = g_get_monotonic_time ();
+  gint64 grace = (gint64)reap_interval * G_USEC_PER_SEC;
+  ReapScan *scan = g_new0 (ReapScan, 1);
+  GHashTableIter iter;
+  gpointer key, value;
+  guint i;
+
+  scan->peers = g_ptr_array_new_with_free_func ((GDestroyNotify)reap_peer_free);
+  scan->budget_usec = (gint64)reap_budget_ms * 1000;
+
+  g_hash_table_iter_init (&iter, peers);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Peer *peer = value;
+      if (peer->pid != 0 && g_hash_table_size (peer->blobs) > 0)
+        g_ptr_array_add (sorted_peers, peer);
+    }
+  g_ptr_array_sort (sorted_peers, compare_reap_time);
+
+  for (i = 0; i < sorted_peers->len; i++)
+    {
+      Peer *peer = g_ptr_array_index (sorted_peers, i);
+      ReapPeer *reap_peer = g_new0 (ReapPeer, 1);
+
+      reap_peer->peer_name = g_strdup (peer->name);
+      reap_peer->pid = peer->pid;
+      reap_peer->handles = g_array_new (FALSE, TRUE, sizeof (ReapHandle));
+
+      g_hash_table_iter_init (&iter, peer->blobs);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          PeerBlob *peer_blob = value;
+          ReapHandle handle = { 0 };
+          struct stat statbuf;
+
+          /* The data of ghosts is in the peers own memfd, which we can't check */
+          if (peer_blob->blob->fd < 0 || fstat (peer_blob->blob->fd, &statbuf) != 0)
+            continue;
+
+          handle.blob_id = GPOINTER_TO_UINT (key);
+          handle.blob = peer_blob->blob;
+          handle.added_time = peer_blob->added_time;
+          handle.dev = statbuf.st_dev;
+          handle.ino = statbuf.st_ino;
+          handle.packed = peer_blob->blob->segment != NULL;
+          /* Give the peer time to map the fd we sent, or to handle a Remap */
+          handle.eligible = now - MAX (peer_blob->added_time, peer_blob->blob->fd_time) > grace;
+          g_array_append_val (reap_peer->handles, handle);
+        }
+
+      g_ptr_array_add (scan->peers, reap_peer);
+    }
+
+  return scan;
+}
+
+static gint64
+get_thread_cpu_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  guint n_mapped; /* Whole file mappings and open fds */
+  guint n_any; /* Mappings at any offset and open fds */
+} InodeMappings;
+
+static guint
+inode_mappings_hash (gconstpointer key)
+{
+  const InodeMappings *m = key;
+
+  return g_int64_hash (&(gint64){ m->ino }) ^ g_int64_hash (&(gint64){ m->dev });
+}
+
+static gboolean
+inode_mappings_equal (gconstpointer a,
+                      gconstpointer b)
+{
+  const InodeMappings *m_a = a;
+  const InodeMappings *m_b = b;
+
+  return m_a->dev == m_b->dev && m_a->ino == m_b->ino;
+}
+
+/* Takes one mapping of the inode of handle, returns FALSE if there are
+   none left. Any mapping of a segment or arena covers all the handles
+   for blobs in it, so those don't use it up. */
+static gboolean
+use_inode_mapping (GHashTable *mapped,
+                   ReapHandle *handle)
+{
+  InodeMappings lookup = { handle->dev, handle->ino };
+  InodeMappings *m = g_hash_table_lookup (mapped, &lookup);
+
+  if (m == NULL)
+    return FALSE;
+
+  if (handle->packed)
+    return m->n_any > 0;
+
+  if (m->n_mapped == 0)
+    return FALSE;
+
+  m->n_mapped--;
+  return TRUE;
+}
+
+static void
+add_inode_mapping (GHashTable *mapped,
+                   dev_t       dev,
+                   ino_t       ino,
+                   gboolean    whole)
+{
+  InodeMappings lookup = { dev, ino };
+  InodeMappings *m = g_hash_table_lookup (mapped, &lookup);
+
+  if (m == NULL)
+    {
+      m = g_memdup2 (&lookup, sizeof (lookup));
+      m->n_mapped = 0;
+      m->n_any = 0;
+      g_hash_table_add (mapped, m);
+    }
+  if (whole)
+    m->n_mapped++;
+  m->n_any++;
+}
+
+/* Marks the eligible handles of reap_peer that have more handles than
+   the peer has mappings of their inode. Each mapping of a blob by the
+   client library is a separate mmap of the whole file, so we count
+   mappings starting at offset 0 for those. Segments and arenas are
+   mapped once (or in parts) for all their blobs, so any mapping counts
+   for them. Open fds count as well, as some peers (like a uniqued using
+   us as --parent) keep blobs without mapping them. Returns FALSE if the
+   maps couldn't be read. */
+static gboolean
+reap_scan_peer (ReapPeer *reap_peer)
+{
+  g_autofree char *path = g_strdup_printf ("/proc/%u/maps", reap_peer->pid);
+  g_autofree char *fd_path = g_strdup_printf ("/proc/%u/fd", reap_peer->pid);
+  g_autoptr(GHashTable) mapped = g_hash_table_new_full (inode_mappings_hash, inode_mappings_equal, g_free, NULL);
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  GDir *dir;
+  guint i;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return FALSE;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      unsigned long long offset, inode;
+      unsigned int dev_major, dev_minor;
+
+      if (sscanf (lines[i], "%*x-%*x %*s %llx %x:%x %llu",
+                  &offset, &dev_major, &dev_minor, &inode) != 4 ||
+          inode == 0)
+        continue;
+
+      add_inode_mapping (mapped, makedev (dev_major, dev_minor), inode, offset == 0);
+    }
+
+  dir = g_dir_open (fd_path, 0, NULL);
+  if (dir != NULL)
+    {
+      const char *name;
+
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          g_autofree char *link = g_build_filename (fd_path, name, NULL);
+          char target[64];
+          ssize_t len;
+          struct stat statbuf;
+
+          /* Blobs are all sealed memfds, and stat() on other files could
+             hang on a dead NFS or FUSE mount, so only those are looked at */
+          len = readlink (link, target, sizeof (target) - 1);
+          if (len < 0)
+            continue;
+          target[len] = 0;
+          if (!g_str_has_prefix (target, "/memfd:"))
+            continue;
+
+          if (stat (link, &statbuf) == 0 && S_ISREG (statbuf.st_mode))
+            add_inode_mapping (mapped, statbuf.st_dev, statbuf.st_ino, TRUE);
+        }
+      g_dir_close (dir);
+    }
+
+  /* Handles that are too young to reap use up mappings first, as they
+     are the most likely to still be in use */
+  for (i = 0; i < reap_peer->handles->len; i++)
+    {
+      ReapHandle *handle = &g_array_index (reap_peer->handles, ReapHandle, i);
+
+      if (!handle->eligible)
+        use_inode_mapping (mapped, handle);
+    }
+
+  for (i = 0; i < reap_peer->handles->len; i++)
+    {
+      ReapHandle *handle = &g_array_index (reap_peer->handles, ReapHandle, i);
+
+      if (handle->eligible && !use_inode_mapping (mapped, handle))
+        handle->unmapped = TRUE;
+    }
+
+  return TRUE;
+}
+
+static void
+reap_scan_thread (GTask        *task,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
+{
+  ReapScan *scan = task_data;
+  gint64 start = get_thread_cpu_time ();
+  guint i;
+
+  for (i = 0; i < scan->peers->len; i++)
+    {
+      ReapPeer *reap_peer = g_ptr_array_index (scan->peers, i);
+
+      if (get_thread_cpu_time () - start > scan->budget_usec)
+        break;
+
+      reap_peer->scanned = reap_scan_peer (reap_peer);
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+reap_scan_done (GObject      *source_object,
+                GAsyncResult *res,
+                gpointer      user_data)
+{
+  ReapScan *scan = g_task_get_task_data (G_TASK (res));
+  gint64 now = g_get_monotonic_time ();
+  gsize reclaimed = 0;
+  guint n_reaped = 0;
+  guint n_scanned = 0;
+  guint i, j;
+
+  reap_in_progress = FALSE;
+
+  for (i = 0; i < scan->peers->len; i++)
+    {
+      ReapPeer *reap_peer = g_ptr_array_index (scan->peers, i);
+      Peer *peer = g_hash_table_lookup (peers, reap_peer->peer_name);
+
+      if (peer == NULL || !reap_peer->scanned)
+        continue;
+
+      n_scanned++;
+      peer->last_reap_time = now;
+
+      for (j = 0; j < reap_peer->handles->len; j++)
+        {
+          ReapHandle *handle = &g_array_index (reap_peer->handles, ReapHandle, j);
+          PeerBlob *peer_blob;
+
+          if (!handle->unmapped)
+            continue;
+
+          /* The handle may have been forgotten, and the id reused, meanwhile */
+          peer_blob = g_hash_table_lookup (peer->blobs, GUINT_TO_POINTER (handle->blob_id));
+          if (peer_blob == NULL ||
+              peer_blob->blob != handle->blob ||
+              peer_blob->added_time != handle->added_time)
+            continue;
+
+          g_debug ("Reaping unmapped blob %d (with checksum %s) of peer %s",
+                   handle->blob_id, peer_blob->blob->checksum, peer->name);
+
+          if (peer_blob->blob->ref_count == 1)
+            reclaimed += peer_blob->blob->len;
+          n_reaped++;
+
+          g_hash_table_remove (peer->blobs, GUINT_TO_POINTER (handle->blob_id));
+        }
+    }
+
+  if (n_reaped > 0)
+    {
+      g_autofree gchar *reclaimed_size = g_format_size (reclaimed);
+
+      reaped_blob_size += reclaimed;
+      g_debug ("Reaper scanned %u of %u peers, released %u handles, reclaimed %s",
+               n_scanned, scan->peers->len, n_reaped, reclaimed_size);
+      print_stats ();
+    }
+}
+
+static gboolean
+reap_timeout (gpointer user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  if (reap_in_progress)
+    return G_SOURCE_CONTINUE;
+
+  reap_in_progress = TRUE;
+
+  task = g_task_new (NULL, NULL, reap_scan_done, NULL);
+  g_task_set_task_data (task, reap_scan_new (), (GDestroyNotify)reap_scan_free);
+  g_task_run_in_thread (task, reap_scan_thread);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GDBusInterfaceInfo *
+get_interface (void)
+{
+  static GDBusInterfaceInfo *interface_info;
+
+  if (interface_info == NULL)
+    {
+      GError *error = NULL;
+      GDBusNodeInfo *info;
+
+      info = g_dbus_node_info_new_for_xml ("<node>"
+                                           "  <interface name='org.freedesktop.portal.Unique'>"
+                                           "    <method name='MakeUnique'>"
+                                           "      <arg type='h' name='memfd' direction='in'/>"
+                                           "      <arg type='ah' name='content' direction='out'/>"
+                                           "      <arg type='u' name='handle' direction='out'/>"
+                                           "      <arg type='ay' name='digest' direction='out'/>"
+                                           "      <arg type='t' name='offset' direction='out'/>"
+                                           "      <arg type='t' name='size' direction='out'/>"
+                                           "    </method>"
+                                           "    <method name='MakeUniqueRanges'>"
+                                           "      <arg type='h' name='arena' direction='in'/>"
+                                           "      <arg type='a(tt)' name='ranges' direction='in'/>"
+                                           "      <arg type='a(ahuaytt)' name='results' direction='out'/>"
+                                           "    </method>"
+                                           "    <method name='Forget'>"
+                                           "      <arg type='u' name='handle' direction='in'/>"
+                                           "    </method>"
+                                           "    <method name='Put'>"
+                                           "      <arg type='s' name='key' direction='in'/>"
+                                           "      <arg type='h' name='memfd' direction='in'/>"
+                                           "      <arg type='ah' name='content' direction='out'/>"
+                                           "      <arg type='u' name='handle' direction='out'/>"
+                                           "      <arg type='ay' name='digest' direction='out'/>"
+                                           "      <arg type='t' name='offset' direction='out'/>"
+                                           "      <arg type='t' name='size' direction='out'/>"
+                                           "    </method>"
+                                           "    <method name='Get'>"
+                                           "      <arg type='s' name='key' direction='in'/>"
+                                           "      <arg type='ah' name='content' direction='out'/>"
+                                           "      <arg type='u' name='handle' direction='out'/>"
+                                           "      <arg type='ay' name='digest' direction='out'/>"
+                                           "      <arg type='t' name='offset' direction='out'/>"
+                                           "      <arg type='t' name='size' direction='out'/>"
+                                           "    </method>"
+                                           "    <method name='Prefetch'>"
+                                           "      <arg type='a(ayt)' name='digests_and_sizes' direction='in'/>"
+                                           "      <arg type='a(ayhutt)' name='found' direction='out'/>"
+                                           "    </method>"
+                                           "    <method name='Publish'>"
+                                           "      <arg type='s' name='name' direction='in'/>"
+                                           "      <arg type='h' name='memfd' direction='in'/>"
+                                           "      <arg type='ah' name='content' direction='out'/>"
+                                           "      <arg type='u' name='handle' direction='out'/>"
+                                           "      <arg type='ay' name='digest' direction='out'/>"
+                                           "      <arg type='t' name='offset' direction='out'/>"
+                                           "      <arg type='t' name='size' direction='out'/>"
+                                           "      <arg type='t' name='version' direction='out'/>"
+                                           "    </method>"
+                                           "    <method name='Subscribe'>"
+                                           "      <arg type='s' name='name' direction='in'/>"
+                                           "      <arg type='ah' name='content' direction='out'/>"
+                                           "      <arg type='u' name='handle' direction='out'/>"
+                                           "      <arg type='ay' name='digest' direction='out'/>"
+                                           "      <arg type='t' name='offset' direction='out'/>"
+                                           "      <arg type='t' name='size' direction='out'/>"
+                                           "      <arg type='t' name='version' direction='out'/>"
+                                           "    </method>"
+                                           "    <method name='Unsubscribe'>"
+                                           "      <arg type='s' name='name' direction='in'/>"
+                                           "    </method>"
+                                           "    <method name='GetInternTable'>"
+                                           "      <arg type='h' name='table' direction='out'/>"
+                                           "    </method>"
+                                           "    <method name='Intern'>"
+                                           "      <arg type='as' name='strings' direction='in'/>"
+                                           "      <arg type='au' name='offsets' direction='out'/>"
+                                           "    </method>"
+                                           "    <method name='AnalyzeOverlap'>"
+                                           "      <arg type='u' name='budget_msec' direction='in'/>"
+                                           "      <arg type='u' name='max_pairs' direction='in'/>"
+                                           "      <arg type='t' name='analyzed_bytes' direction='out'/>"
+                                           "      <arg type='t' name='duplicate_bytes' direction='out'/>"
+                                           "      <arg type='a(sst)' name='top_pairs' direction='out'/>"
+                                           "      <arg type='b' name='complete' direction='out'/>"
+                                           "    </method>"
+                                           "    <method name='GetStats'>"
+                                           "      <arg type='a{st}' name='totals' direction='out'/>"
+                                           "      <arg type='a(stttuau)' name='blobs' direction='out'/>"
+                                           "    </method>"
+                                           "    <signal name='Remap'>"
+                                           "      <arg type='u' name='handle'/>"
+                                           "      <arg type='h' name='memfd'/>"
+                                           "    </signal>"
+                                           "    <signal name='ChannelUpdated'>"
+                                           "      <arg type='s' name='name'/>"
+                                           "      <arg type='t' name='version'/>"
+                                           "      <arg type='ah' name='content'/>"
+                                           "      <arg type='u' name='handle'/>"
+                                           "      <arg type='ay' name='digest'/>"
+                                           "      <arg type='t' name='offset'/>"
+                                           "      <arg type='t' name='size'/>"
+                                           "    </signal>"
+                                           "  </interface>"
+                                           "</node>", &error);
+      if (info == NULL)
+        g_error ("%s", error->message);
+      interface_info = g_dbus_node_info_lookup_interface (info, "org.freedesktop.portal.Unique");
+      g_assert (interface_info != NULL);
+      g_dbus_interface_info_ref (interface_info);
+      g_dbus_node_info_unref (info);
+    }
+
+  return interface_info;
+}
+
+#define ALL_SEALS (F_SEAL_SEAL | \
+                   F_SEAL_SHRINK | \
+                   F_SEAL_GROW |   \
+                   F_SEAL_WRITE)
+
+static int
+steal_one_fd_from_list (GUnixFDList *fd_list,
+                        gint32 handle)
+{
+  int n_fds, i, fd, *fds;
+
+  if (fd_list == NULL ||
+      handle >= g_unix_fd_list_get_length (fd_list))
+    return -1;
+
+  fds = g_unix_fd_list_steal_fds (fd_list, &n_fds);
+  for (i = 0; i < n_fds; i++)
+    {
+      if (i != handle)
+        close (fds[i]);
+    }
+
+  fd = fds[handle];
+  g_free (fds);
+  return fd;
+}
+
+static const guchar zero_page[4096];
+
+/* Checksums size bytes of data mapped from fd. Holes in the fd (pages the
+   client never wrote because they were all zeros) are folded into the
+   digest from a static zero page, so we don't fault them in. Returns the
+   number of bytes in holes. */
+static gsize
+checksum_sparse_data (GChecksum    *checksummer,
+                      int           fd,
+                      const guchar *data,
+                      gsize         size)
+{
+  gsize offset = 0;
+  gsize holes = 0;
+
+  while (offset < size)
+    {
+      off_t data_start, data_end;
+
+      data_start = lseek (fd, offset, SEEK_DATA);
+      if (data_start < 0)
+        {
+          if (errno != ENXIO)
+            {
+              /* No hole support, treat the rest as data */
+              g_checksum_update (checksummer, data + offset, size - offset);
+              break;
+            }
+          data_start = size; /* Only a hole left */
+        }
+      data_start = MIN (data_start, size);
+
+      holes += data_start - offset;
+      while (offset < data_start)
+        {
+          gsize n = MIN (sizeof (zero_page), data_start - offset);
+          g_checksum_update (checksummer, zero_page, n);
+          offset += n;
+        }
+
+      if (offset >= size)
+        break;
+
+      data_end = lseek (fd, data_start, SEEK_HOLE);
+      if (data_end < 0 || data_end > size)
+        data_end = size;
+
+      g_checksum_update (checksummer, data + data_start, data_end - data_start);
+      offset = data_end;
+    }
+
+  return holes;
+}
+
+/* Checks that fd is a sealed memfd we can take the content of */
+static gboolean
+check_blob_fd (int fd,
+               struct stat *statbuf,
+               GError **error)
+{
+  unsigned int seals;
+
+  if (fd == -1 ||
+      fstat (fd, statbuf) != 0)
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "Invalid fd passed");
+      return FALSE;
+    }
+
+  seals = fcntl (fd, F_GET_SEALS);
+  if (seals == -1 ||  (seals & ALL_SEALS) != ALL_SEALS)
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "Fd not sealed");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Returns the blob with digest in domain, creating it from *fdp (which
+   is stolen if used) if it is new. If peer is set, admission control may
+   decide to only create a ghost. */
+static Blob *
+blob_for_digest (int *fdp,
+                 const char *sender,
+                 const char *domain,
+                 Peer *peer,
+                 gsize size,
+                 const guint8 *digest,
+                 gsize hole_size,
+                 gboolean *reused)
+{
+  g_autofree char *checksum = digest_to_checksum (digest);
+  Blob *blob;
+
+  blob = lookup_blob (domain, checksum);
+  if (peer)
+    record_submission (peer, size, blob != NULL);
+
+  *reused = blob != NULL;
+  if (blob == NULL)
+    {
+      if (peer == NULL || should_admit (peer, size))
+        {
+          blob = blob_new (domain, steal_fd (fdp), checksum, digest, size, hole_size);
+          blob->creator = g_strdup (sender);
+          g_debug ("Created new blob for %s (size %ld, %ld in holes)", checksum, blob->len, blob->hole_len);
+        }
+      else
+        {
+          blob = blob_new (domain, -1, checksum, digest, size, 0);
+          g_debug ("Created ghost for %s (size %ld)", checksum, blob->len);
+        }
+    }
+  else if (blob->fd == -1)
+    {
+      /* The sender keeps its own fd, which is now the canonical one */
+      *reused = FALSE;
+      blob_promote (blob, steal_fd (fdp), hole_size, sender);
+    }
+  else
+    g_debug ("Reusing old blob for %s", checksum);
+
+  return blob;
+}
+
+static gboolean
+hash_fd (int       fd,
+         gsize     size,
+         guint8   *digest,
+         gsize    *hole_size,
+         GError  **error)
+{
+  g_autoptr(GChecksum) checksummer = g_checksum_new (G_CHECKSUM_SHA1);
+  gsize digest_len = DIGEST_LEN;
+  void *memfd_data;
+
+  memfd_data = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (memfd_data == MAP_FAILED)
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "Can't read data");
+      return FALSE;
+    }
+
+  *hole_size = checksum_sparse_data (checksummer, fd, memfd_data, size);
+  munmap (memfd_data, size);
+
+  g_checksum_get_digest (checksummer, digest, &digest_len);
+  return TRUE;
+}
+
+/* Hashing a large blob just to make a ghost of it is mostly wasted, as
+   ghosts are for blobs nobody else is likely to have. So large blobs
+   also get a fingerprint: a hash of the size and a few sampled pages
+   (the first, the last and evenly spaced ones in between). Blobs with
+   different fingerprints can't be the same, so if admission control
+   rejects a large blob whose fingerprint nobody has, it becomes an
+   unhashed ghost, indexed only by fingerprint. It keeps the submitted
+   fd, and is only hashed once a blob with the same fingerprint shows
+   up. Until then its handle comes without a digest. */
+#define MIN_FINGERPRINT_SIZE (1024 * 1024)
+#define FINGERPRINT_SAMPLES 8
+
+static char *
+fingerprint_key (const char *domain,
+                 int         fd,
+                 gsize       offset,
+                 gsize       size)
+{
+  g_autoptr(GChecksum) checksummer = g_checksum_new (G_CHECKSUM_SHA1);
+  gsize n_pages = (size + UNIQUE_PAGE_SIZE - 1) / UNIQUE_PAGE_SIZE;
+  guchar page[UNIQUE_PAGE_SIZE];
+  int i;
+
+  for (i = 0; i < FINGERPRINT_SAMPLES; i++)
+    {
+      gsize page_index = (n_pages - 1) * i / (FINGERPRINT_SAMPLES - 1);
+      gsize page_offset = page_index * UNIQUE_PAGE_SIZE;
+      ssize_t n = pread (fd, page, MIN (sizeof (page), size - page_offset), offset + page_offset);
+
+      if (n < 0)
+        return NULL;
+      g_checksum_update (checksummer, page, n);
+    }
+
+  return g_strdup_printf ("%s/%" G_GSIZE_FORMAT "-%.32s", domain, size,
+                          g_checksum_get_string (checksummer));
+}
+
+/* Blobs that get an fd other than through get_blob_for_fd() (from the
+   parent, an arena or promotion) need a fingerprint as well, or a later
+   submission of the same content could become an unhashed ghost
+   instead of finding them */
+static void
+blob_ensure_fingerprint (Blob *blob)
+{
+  g_autofree char *domain = NULL;
+  char *fp_key;
+
+  if (blob->fingerprint_key != NULL || blob->fd < 0 ||
+      blob->len < MIN_FINGERPRINT_SIZE || blob->key == NULL)
+    return;
+
+  domain = g_strndup (blob->key, strrchr (blob->key, '/') - blob->key);
+  fp_key = fingerprint_key (domain, blob->fd, blob->offset, blob->len);
+  if (fp_key != NULL)
+    blob_set_fingerprint (blob, fp_key);
+}
+
+static Blob *
+blob_new_unhashed (int   fd,
+                   gsize size,
+                   char *fingerprint_key)
+{
+  Blob *blob = g_new0 (Blob, 1);
+
+  blob->fd = -1;
+  blob->unhashed_fd = fd;
+  blob->len = size;
+  blob->ref_count = 1;
+  blob->fd_time = g_get_monotonic_time ();
+
+  ghost_blob_size += blob->len;
+  unhashed_blob_size += blob->len;
+
+  blob_set_fingerprint (blob, fingerprint_key);
+  g_hash_table_insert (unhashed_ghosts, blob->fingerprint_key, blob);
+
+  g_debug ("Created unhashed ghost for %s", blob->fingerprint_key);
+
+  return blob;
+}
+
+/* Someone submitted a blob with the same fingerprint as the unhashed
+   ghost blob, so turn it into a regular ghost that the newcomer can
+   find (and promote) by digest */
+static void
+hash_unhashed_ghost (Blob       *blob,
+                     const char *domain)
+{
+  auto_fd int fd = steal_fd (&blob->unhashed_fd);
+  g_autoptr(Blob) existing = NULL;
+  gsize hole_size;
+
+  g_hash_table_remove (unhashed_ghosts, blob->fingerprint_key);
+  unhashed_blob_size -= blob->len;
+
+  if (!hash_fd (fd, blob->len, blob->digest, &hole_size, NULL))
+    return;
+
+  blob->checksum = digest_to_checksum (blob->digest);
+  g_debug ("Hashed ghost %s as %s", blob->fingerprint_key, blob->checksum);
+
+  /* Only blobs we got without fingerprinting can be here already, in
+     which case this one stays out of the index */
+  existing = lookup_blob (domain, blob->checksum);
+  if (existing == NULL)
+    {
+      blob->key = g_strconcat (domain, "/", blob->checksum, NULL);
+      g_hash_table_insert (blobs, blob->key, blob);
+    }
+}
+
+/* Returns the blob for the content of passed_fd, sent by sender, in
+   domain. If this is a new blob and peer is set, admission control may
+   decide to only create a ghost. */
+static Blob *
+get_blob_for_fd (int passed_fd,
+                 const char *sender,
+                 const char *domain,
+                 Peer *peer,
+                 gboolean *reused,
+                 GError **error)
+{
+  auto_fd int fd = passed_fd;
+  g_autofree char *fp_key = NULL;
+  guint8 digest[DIGEST_LEN];
+  struct stat statbuf;
+  gsize hole_size;
+  Blob *blob;
+
+  if (!check_blob_fd (fd, &statbuf, error))
+    return NULL;
+
+  if (statbuf.st_size >= MIN_FINGERPRINT_SIZE)
+    fp_key = fingerprint_key (domain, fd, 0, statbuf.st_size);
+
+  if (fp_key != NULL)
+    {
+      Blob *unhashed = g_hash_table_lookup (unhashed_ghosts, fp_key);
+
+      if (unhashed != NULL)
+        hash_unhashed_ghost (unhashed, domain);
+      else if (peer != NULL &&
+               !g_hash_table_contains (fingerprints, fp_key) &&
+               !should_admit (peer, statbuf.st_size))
+        {
+          record_submission (peer, statbuf.st_size, FALSE);
+          *reused = FALSE;
+          return blob_new_unhashed (steal_fd (&fd), statbuf.st_size, g_steal_pointer (&fp_key));
+        }
+    }
+
+  if (!hash_fd (fd, statbuf.st_size, digest, &hole_size, error))
+    return NULL;
+
+  blob = blob_for_digest (&fd, sender, domain, peer, statbuf.st_size, digest, hole_size, reused);
+
+  if (fp_key != NULL && blob->fingerprint_key == NULL)
+    blob_set_fingerprint (blob, g_steal_pointer (&fp_key));
+
+  return blob;
+}
+
+/* Adds the (ahuaytt) reply fields handing out a new handle for blob to
+   peer_name to reply, a tuple builder, with the blob fd in ret_fds if
+   send_fd is set (i.e. the peer doesn't already have it). Packed blobs
+   are at offset in a larger fd. Returns the handle, or 0 on error. */
+static guint32
+add_blob_to_reply (GVariantBuilder *reply,
+                   GUnixFDList     *ret_fds,
+                   const gchar     *peer_name,
+                   Blob            *blob,
+                   gboolean         send_fd)
+{
+  g_autoptr(GVariantBuilder) array_builder = g_variant_builder_new (G_VARIANT_TYPE ("ah"));
+  guint32 blob_id;
+
+  if (send_fd)
+    {
+      gint fd_handle = g_unix_fd_list_append (ret_fds, blob->fd, NULL);
+      if (fd_handle < 0)
+        return 0;
+
+      g_variant_builder_add (array_builder, "h", fd_handle);
+    }
+
+  blob_id = add_blob_to_peer (peer_name, blob);
+
+  g_variant_builder_add (reply, "ah", array_builder);
+  g_variant_builder_add (reply, "u", blob_id);
+  g_variant_builder_add (reply, "@ay", g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                  blob->digest,
+                                                                  blob->checksum ? DIGEST_LEN : 0, 1));
+  g_variant_builder_add (reply, "t", (guint64)blob->offset);
+  g_variant_builder_add (reply, "t", (guint64)blob->len);
+  return blob_id;
+}
+
+/* Hands out a new handle for blob to the sender, see add_blob_to_reply().
+   Returns the handle, or 0 on error. */
+static guint32
+return_blob (GDBusMethodInvocation *invocation,
+             const gchar           *sender,
+             Blob                  *blob,
+             gboolean               send_fd)
+{
+  g_autoptr(GUnixFDList) ret_fds = g_unix_fd_list_new ();
+  g_autoptr(GVariantBuilder) reply = g_variant_builder_new (G_VARIANT_TYPE_TUPLE);
+  guint32 blob_id;
+
+  blob_id = add_blob_to_reply (reply, ret_fds, sender, blob, send_fd);
+  if (blob_id == 0)
+    {
+      g_dbus_method_invocation_return_error (invocation,  G_DBUS_ERROR,
+                                             G_DBUS_ERROR_FAILED, "Failed to dup fd");
+      return 0;
+    }
+
+  print_stats ();
+
+  g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+                                                           g_variant_builder_end (reply),
+                                                           ret_fds);
+  return blob_id;
+}
+
+static gboolean
+blob_is_global (Blob *blob)
+{
+  return g_str_has_prefix (blob->key, GLOBAL_DOMAIN "/");
+}
+
+/* Records that parent_id is our handle for blob in the parent. We only
+   need one, so extra ones (say from a Put of a blob we already forwarded)
+   are dropped right away. */
+static void
+parent_set_id (Blob    *blob,
+               guint32  parent_id)
+{
+  if (blob->parent_id != 0)
+    {
+      parent_forget (parent_id);
+      return;
+    }
+
+  blob->parent_id = parent_id;
+  g_hash_table_insert (parent_blobs, GUINT_TO_POINTER (parent_id), blob);
+}
+
+static int copy_data (int src_fd, gsize offset, gsize len, const char *checksum);
+
+/* Parses a (ahuaytt) reply from the parent, returning the fd if there
+   was one and it is a sealed memfd (with the expected digest, if set).
+   If the parent has the blob packed into a segment we get a copy of
+   just the blob if copy_packed is set, and nothing otherwise. */
+static int
+parse_parent_reply (GVariant     *reply,
+                    GUnixFDList  *fd_list,
+                    guint32      *parent_id,
+                    guint8       *digest,
+                    gboolean      copy_packed)
+{
+  g_autoptr(GVariant) handles = NULL;
+  g_autoptr(GVariant) digest_v = NULL;
+  g_autofree char *checksum = NULL;
+  auto_fd int fd = -1;
+  struct stat statbuf;
+  gconstpointer reply_digest;
+  gsize digest_len;
+  gint32 handle;
+  guint64 offset, size;
+
+  g_variant_get (reply, "(@ahu@aytt)", &handles, parent_id, &digest_v, &offset, &size);
+
+  if (g_variant_n_children (handles) == 0)
+    return -1;
+
+  g_variant_get_child (handles, 0, "h", &handle);
+  fd = steal_one_fd_from_list (fd_list, handle);
+  if (!check_blob_fd (fd, &statbuf, NULL))
+    return -1;
+
+  reply_digest = g_variant_get_fixed_array (digest_v, &digest_len, 1);
+  if (digest_len != DIGEST_LEN)
+    return -1;
+
+  if (digest != NULL && memcmp (digest, reply_digest, DIGEST_LEN) != 0)
+    {
+      g_warning ("Parent uniqued returned a different digest");
+      return -1;
+    }
+
+  if (offset == 0 && statbuf.st_size == size)
+    return steal_fd (&fd);
+
+  if (!copy_packed || offset + size > statbuf.st_size)
+    return -1;
+
+  checksum = digest_to_checksum (reply_digest);
+  return copy_data (fd, offset, size, checksum);
+}
+
+static void
+forward_to_parent_done (GObject      *source_object,
+                        GAsyncResult *res,
+                        gpointer      user_data)
+{
+  GDBusConnection *connection = G_DBUS_CONNECTION (source_object);
+  g_autoptr(Blob) blob = user_data;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+  guint32 parent_id;
+  int fd;
+
+  reply = g_dbus_connection_call_with_unix_fd_list_finish (connection, &fd_list, res, &error);
+  if (reply == NULL)
+    {
+      g_debug ("Parent uniqued didn't take blob %s: %s", blob->checksum, error->message);
+      return;
+    }
+
+  /* Handles from a connection we since lost are meaningless */
+  if (connection != parent_bus)
+    return;
+
+  /* Adopting a copy of a packed blob would share nothing */
+  fd = parse_parent_reply (reply, fd_list, &parent_id, blob->digest, FALSE);
+  parent_set_id (blob, parent_id);
+
+  if (fd == -1)
+    return;
+
+  /* Only global blobs may share pages with whatever the parent has */
+  if (blob->fd == -1 || !blob_is_global (blob))
+    {
+      close (fd);
+      return;
+    }
+
+  /* The parent already had this, so use its copy and let ours go */
+  g_debug ("Adopting parent copy of blob %s", blob->checksum);
+  blob_replace_fd (blob, fd);
+  g_clear_pointer (&blob->creator, g_free);
+}
+
+static int copy_blob_fd (Blob *blob);
+
+/* Returns the cache key that the parent knows key in domain by, or
+   NULL if the entry must not leave this uniqued. The parent puts all
+   our entries in our own sharing domain there, so anything but global
+   entries is qualified with the domain they belong to here. */
+static char *
+parent_cache_key (const char *domain,
+                  const char *key)
+{
+  if (g_str_equal (domain, GLOBAL_DOMAIN))
+    return g_strdup (key);
+
+  /* Peers we don't know the credentials of share with nobody */
+  if (g_str_has_prefix (domain, "peer:"))
+    return NULL;
+
+  return g_strconcat (domain, "/", key, NULL);
+}
+
+/* Sends blob to the parent, as a Put under key if it is set */
+static void
+forward_to_parent (Blob       *blob,
+                   const char *key)
+{
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  auto_fd int copy_fd = -1;
+  gint fd_handle;
+
+  if (parent_bus == NULL || blob->fd == -1 ||
+      (key == NULL && blob->parent_id != 0))
+    return;
+
+  /* Without a key, the parent would mix it with our other domains */
+  if (key == NULL && !blob_is_global (blob))
+    return;
+
+  /* The parent only takes whole memfds */
+  if (blob->segment != NULL)
+    {
+      copy_fd = copy_blob_fd (blob);
+      if (copy_fd < 0)
+        return;
+    }
+
+  fd_list = g_unix_fd_list_new ();
+  fd_handle = g_unix_fd_list_append (fd_list, copy_fd >= 0 ? copy_fd : blob->fd, NULL);
+  if (fd_handle < 0)
+    return;
+
+  g_dbus_connection_call_with_unix_fd_list (parent_bus,
+                                            "org.freedesktop.portal.Unique",
+                                            "/org/freedesktop/portal/unique",
+                                            "org.freedesktop.portal.Unique",
+                                            key ? "Put" : "MakeUnique",
+                                            key ? g_variant_new ("(sh)", key, fd_handle) : g_variant_new ("(h)", fd_handle),
+                                            G_VARIANT_TYPE ("(ahuaytt)"),
+                                            G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
+                                            fd_list, NULL,
+                                            forward_to_parent_done, blob_ref (blob));
+}
+
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  char *sender;
+  char *domain;
+  char *domain_key;
+} ParentGet;
+
+static void
+parent_get_free (ParentGet *get)
+{
+  g_object_unref (get->invocation);
+  g_free (get->sender);
+  g_free (get->domain);
+  g_free (get->domain_key);
+  g_free (get);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ParentGet, parent_get_free)
+
+static void
+parent_get_done (GObject      *source_object,
+                 GAsyncResult *res,
+                 gpointer      user_data)
+{
+  GDBusConnection *connection = G_DBUS_CONNECTION (source_object);
+  g_autoptr(ParentGet) get = user_data;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(Blob) blob = NULL;
+  auto_fd int fd = -1;
+  guint32 parent_id;
+
+  reply = g_dbus_connection_call_with_unix_fd_list_finish (connection, &fd_list, res, &error);
+  if (reply == NULL)
+    g_debug ("Parent uniqued failed Get: %s", error->message);
+  else if (connection == parent_bus)
+    {
+      fd = parse_parent_reply (reply, fd_list, &parent_id, NULL, TRUE);
+      if (fd != -1)
+        {
+          g_autoptr(GVariant) digest_v = g_variant_get_child_value (reply, 2);
+          const guint8 *digest = g_variant_get_data (digest_v);
+          struct stat statbuf;
+          gboolean reused;
+
+          /* The parent has this in the one domain it keeps for us,
+             so other domains get their own copy */
+          if (!g_str_equal (get->domain, GLOBAL_DOMAIN) && fstat (fd, &statbuf) == 0)
+            {
+              g_autofree char *checksum = digest_to_checksum (digest);
+              int copy_fd = copy_data (fd, 0, statbuf.st_size, checksum);
+
+              close (fd);
+              fd = copy_fd;
+            }
+
+          /* We trust the parent's digest, that's the whole point */
+          if (fd != -1 && fstat (fd, &statbuf) == 0)
+            {
+              blob = blob_for_digest (&fd, NULL, get->domain, NULL, statbuf.st_size, digest, 0, &reused);
+              blob_ensure_fingerprint (blob);
+              parent_set_id (blob, parent_id);
+              cache_put (get->domain_key, blob);
+            }
+        }
+      else if (parent_id != 0)
+        parent_forget (parent_id);
+    }
+
+  /* Nobody to reply to if the sender went away meanwhile */
+  if (g_hash_table_lookup (peers, get->sender) == NULL)
+    return;
+
+  if (blob == NULL)
+    g_dbus_method_invocation_return_value (get->invocation, g_variant_new ("(ahuaytt)", NULL, 0, NULL, (guint64)0, (guint64)0));
+  else
+    return_blob (get->invocation, get->sender, blob, TRUE);
+}
+
+/* Asks the parent about a memo cache miss, replying to invocation when
+   it answers. Returns FALSE if there is no parent to ask. */
+static gboolean
+forward_get_to_parent (GDBusMethodInvocation *invocation,
+                       const char            *sender,
+                       const char            *domain,
+                       const char            *key)
+{
+  g_autofree char *parent_key = NULL;
+  ParentGet *get;
+
+  if (parent_bus == NULL)
+    return FALSE;
+
+  parent_key = parent_cache_key (domain, key);
+  if (parent_key == NULL)
+    return FALSE;
+
+  get = g_new0 (ParentGet, 1);
+  get->invocation = g_object_ref (invocation);
+  get->sender = g_strdup (sender);
+  get->domain = g_strdup (domain);
+  get->domain_key = g_strconcat (domain, "/", key, NULL);
+
+  g_dbus_connection_call_with_unix_fd_list (parent_bus,
+                                            "org.freedesktop.portal.Unique",
+                                            "/org/freedesktop/portal/unique",
+                                            "org.freedesktop.portal.Unique",
+                                            "Get",
+                                            g_variant_new ("(s)", parent_key),
+                                            G_VARIANT_TYPE ("(ahuaytt)"),
+                                            G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
+                                            NULL, NULL,
+                                            parent_get_done, get);
+  return TRUE;
+}
+
+typedef struct {
+  GDBusConnection *connection;
+  guint32 parent_id;
+  int fd;
+} ParentRemap;
+
+static void
+parent_remap_free (ParentRemap *remap)
+{
+  g_object_unref (remap->connection);
+  close_fd (&remap->fd);
+  g_free (remap);
+}
+
+static gboolean
+parent_remap_idle (gpointer user_data)
+{
+  ParentRemap *remap = user_data;
+  struct stat statbuf;
+  Blob *blob;
+
+  if (remap->connection != parent_bus)
+    return G_SOURCE_REMOVE;
+
+  blob = g_hash_table_lookup (parent_blobs, GUINT_TO_POINTER (remap->parent_id));
+  if (blob == NULL || blob->fd == -1 ||
+      !check_blob_fd (remap->fd, &statbuf, NULL) ||
+      statbuf.st_size != blob->len)
+    return G_SOURCE_REMOVE;
+
+  g_debug ("Parent remapped blob %s", blob->checksum);
+  blob_replace_fd (blob, steal_fd (&remap->fd));
+  g_clear_pointer (&blob->creator, g_free);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The parent sends us Remap like to any other peer. Filters run in the
+   D-Bus worker thread, so hand it over to the main loop. */
+static GDBusMessage *
+parent_filter (GDBusConnection *connection,
+               GDBusMessage    *message,
+               gboolean         incoming,
+               gpointer         user_data)
+{
+  ParentRemap *remap;
+  GVariant *body;
+  gboolean from_parent;
+  guint32 id;
+  gint32 handle;
+
+  if (!incoming ||
+      g_dbus_message_get_message_type (message) != G_DBUS_MESSAGE_TYPE_SIGNAL ||
+      g_strcmp0 (g_dbus_message_get_interface (message), "org.freedesktop.portal.Unique") != 0 ||
+      g_strcmp0 (g_dbus_message_get_member (message), "Remap") != 0)
+    return message;
+
+  G_LOCK (parent_owner);
+  from_parent = g_strcmp0 (g_dbus_message_get_sender (message), parent_owner) == 0;
+  G_UNLOCK (parent_owner);
+
+  body = g_dbus_message_get_body (message);
+  if (from_parent && body != NULL && g_variant_is_of_type (body, G_VARIANT_TYPE ("(uh)")))
+    {
+      g_variant_get (body, "(uh)", &id, &handle);
+
+      remap = g_new0 (ParentRemap, 1);
+      remap->connection = g_object_ref (connection);
+      remap->parent_id = id;
+      remap->fd = steal_one_fd_from_list (g_dbus_message_get_unix_fd_list (message), handle);
+      g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT, parent_remap_idle, remap,
+                                  (GDestroyNotify)parent_remap_free);
+    }
+
+  g_object_unref (message);
+  return NULL;
+}
+
+/* The parent's handles die with it */
+static void
+parent_lost (void)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  G_LOCK (parent_owner);
+  g_clear_pointer (&parent_owner, g_free);
+  G_UNLOCK (parent_owner);
+
+  g_hash_table_iter_init (&iter, parent_blobs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    ((Blob *)value)->parent_id = 0;
+  g_hash_table_remove_all (parent_blobs);
+
+  g_queue_clear_full (&parent_handover, (GDestroyNotify)blob_unref);
+  if (parent_handover_id != 0)
+    {
+      g_source_remove (parent_handover_id);
+      parent_handover_id = 0;
+    }
+}
+
+/* Forwards the blobs collected before the parent appeared a batch at a
+   time, so we don't flood it (and our fd limit) with calls */
+static gboolean
+parent_handover_timeout (gpointer user_data)
+{
+  Blob *blob;
+  guint i;
+
+  for (i = 0; i < PARENT_HANDOVER_BATCH; i++)
+    {
+      blob = g_queue_pop_head (&parent_handover);
+      if (blob == NULL)
+        {
+          parent_handover_id = 0;
+          return G_SOURCE_REMOVE;
+        }
+
+      forward_to_parent (blob, NULL);
+      blob_unref (blob);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+parent_appeared (GDBusConnection *connection,
+                 const gchar     *name,
+                 const gchar     *name_owner,
+                 gpointer         user_data)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_debug ("Parent uniqued is %s", name_owner);
+
+  G_LOCK (parent_owner);
+  g_free (parent_owner);
+  parent_owner = g_strdup (name_owner);
+  G_UNLOCK (parent_owner);
+
+  /* Hand over what we have collected so far */
+  g_queue_clear_full (&parent_handover, (GDestroyNotify)blob_unref);
+  g_hash_table_iter_init (&iter, blobs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Blob *blob = value;
+
+      if (blob->fd != -1 && blob->parent_id == 0 && blob_is_global (blob))
+        g_queue_push_tail (&parent_handover, blob_ref (blob));
+    }
+
+  if (parent_handover_id == 0 && parent_handover.length > 0)
+    parent_handover_id = g_timeout_add (PARENT_HANDOVER_INTERVAL, parent_handover_timeout, NULL);
+}
+
+static void
+parent_vanished (GDBusConnection *connection,
+                 const gchar     *name,
+                 gpointer         user_data)
+{
+  if (parent_owner != NULL)
+    g_warning ("Parent uniqued went away, continuing on our own");
+
+  parent_lost ();
+}
+
+static void connect_to_parent (void);
+
+static gboolean
+reconnect_to_parent (gpointer user_data)
+{
+  connect_to_parent ();
+  return G_SOURCE_REMOVE;
+}
+
+static void
+parent_closed (GDBusConnection *connection,
+               gboolean         remote_peer_vanished,
+               GError          *error,
+               gpointer         user_data)
+{
+  g_warning ("Lost connection to parent bus, continuing on our own");
+
+  g_bus_unwatch_name (parent_watch_id);
+  parent_watch_id = 0;
+  parent_lost ();
+  g_clear_object (&parent_bus);
+
+  g_timeout_add_seconds (PARENT_RECONNECT_INTERVAL, reconnect_to_parent, NULL);
+}
+
+static void
+parent_connected (GObject      *source_object,
+                  GAsyncResult *res,
+                  gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  parent_bus = g_dbus_connection_new_for_address_finish (res, &error);
+  if (parent_bus == NULL)
+    {
+      g_warning ("Can't connect to parent bus %s: %s", parent_address, error->message);
+      g_timeout_add_seconds (PARENT_RECONNECT_INTERVAL, reconnect_to_parent, NULL);
+      return;
+    }
+
+  g_debug ("Connected to parent bus %s", parent_address);
+
+  g_dbus_connection_set_exit_on_close (parent_bus, FALSE);
+  g_signal_connect (parent_bus, "closed", G_CALLBACK (parent_closed), NULL);
+  g_dbus_connection_add_filter (parent_bus, parent_filter, NULL, NULL);
+  parent_watch_id = g_bus_watch_name_on_connection (parent_bus,
+                                                    "org.freedesktop.portal.Unique",
+                                                    G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                    parent_appeared,
+                                                    parent_vanished,
+                                                    NULL, NULL);
+}
+
+static void
+connect_to_parent (void)
+{
+  g_dbus_connection_new_for_address (parent_address,
+                                     G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                     G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                     NULL, NULL, parent_connected, NULL);
+}
+
+static void
+finish_make_unique (GDBusMethodInvocation *invocation,
+                    const gchar           *sender,
+                    Blob                  *blob,
+                    gboolean               reused)
+{
+  guint32 blob_id;
+
+  blob_id = return_blob (invocation, sender, blob, reused);
+  if (blob->fd == -1 && blob->ghost_owner == NULL)
+    {
+      blob->ghost_owner = g_strdup (sender);
+      blob->ghost_owner_id = blob_id;
+    }
+
+  forward_to_parent (blob, NULL);
+}
+
+/* Small blobs are typically submitted in bursts (e.g. all the icons of an
+   app at startup). Rather than hashing each as it arrives, MakeUnique
+   queues them, and once the requests that are already dispatched have
+   been handled they are hashed together, several per SHA1 pass */
+#define MAX_BATCH_HASH_SIZE (64 * 1024)
+
+/* With fewer blobs left than this the lanes are mostly wasted, so they
+   are hashed one by one instead */
+#define MIN_HASH_BATCH 4
+
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  char *sender;
+  int fd;
+  gsize size;
+  guchar *data;
+  guint8 digest[DIGEST_LEN];
+} HashJob;
+
+static GPtrArray *pending_hash_jobs;
+
+static void
+hash_job_free (HashJob *job)
+{
+  if (job->data)
+    munmap (job->data, job->size);
+  close_fd (&job->fd);
+  g_object_unref (job->invocation);
+  g_free (job->sender);
+  g_free (job);
+}
+
+static int
+compare_hash_job_size (gconstpointer a,
+                       gconstpointer b)
+{
+  const HashJob *job_a = *(const HashJob **)a;
+  const HashJob *job_b = *(const HashJob **)b;
+
+  if (job_a->size < job_b->size)
+    return -1;
+  return job_a->size > job_b->size;
+}
+
+/* Computes the digests of n_buffers (at most UNIQUE_SHA1_LANES) buffers,
+   which should be of similar size */
+static void
+hash_buffers (const guint8 **data,
+              const gsize   *len,
+              guint          n_buffers,
+              guint8       (*digests)[DIGEST_LEN])
+{
+  guint i;
+
+  if (n_buffers < MIN_HASH_BATCH)
+    {
+      for (i = 0; i < n_buffers; i++)
+        {
+          g_autoptr(GChecksum) checksummer = g_checksum_new (G_CHECKSUM_SHA1);
+          gsize digest_len = DIGEST_LEN;
+
+          g_checksum_update (checksummer, data[i], len[i]);
+          g_checksum_get_digest (checksummer, digests[i], &digest_len);
+        }
+      return;
+    }
+
+  unique_sha1_multi (data, len, n_buffers, digests);
+}
+
+static void
+hash_jobs (HashJob **jobs,
+           guint     n_jobs)
+{
+  const guint8 *data[UNIQUE_SHA1_LANES];
+  gsize len[UNIQUE_SHA1_LANES];
+  guint8 digests[UNIQUE_SHA1_LANES][UNIQUE_SHA1_DIGEST_LEN];
+  guint i;
+
+  for (i = 0; i < n_jobs; i++)
+    {
+      data[i] = jobs[i]->data;
+      len[i] = jobs[i]->size;
+    }
+
+  hash_buffers (data, len, n_jobs, digests);
+
+  for (i = 0; i < n_jobs; i++)
+    memcpy (jobs[i]->digest, digests[i], DIGEST_LEN);
+}
+
+static gboolean
+flush_hash_jobs (gpointer user_data)
+{
+  g_autoptr(GPtrArray) jobs = g_steal_pointer (&pending_hash_jobs);
+  guint i, n;
+
+  for (i = 0; i < jobs->len; )
+    {
+      HashJob *job = g_ptr_array_index (jobs, i);
+
+      job->data = mmap (NULL, job->size, PROT_READ, MAP_PRIVATE, job->fd, 0);
+      if (job->data == MAP_FAILED)
+        {
+          job->data = NULL;
+          g_dbus_method_invocation_return_error (job->invocation, G_DBUS_ERROR,
+                                                 G_DBUS_ERROR_INVALID_ARGS, "Can't read data");
+          g_ptr_array_remove_index_fast (jobs, i);
+        }
+      else
+        i++;
+    }
+
+  /* Lanes run until the longest blob in the batch is done */
+  g_ptr_array_sort (jobs, compare_hash_job_size);
+
+  for (i = 0; i < jobs->len; i += n)
+    {
+      n = MIN (UNIQUE_SHA1_LANES, jobs->len - i);
+      hash_jobs ((HashJob **)jobs->pdata + i, n);
+    }
+
+  g_debug ("Hashed a batch of %u small blobs", jobs->len);
+
+  for (i = 0; i < jobs->len; i++)
+    {
+      HashJob *job = g_ptr_array_index (jobs, i);
+      g_autoptr(Blob) blob = NULL;
+      gboolean reused;
+      Peer *peer;
+
+      /* The sender went away meanwhile, so don't create a handle for it */
+      peer = g_hash_table_lookup (peers, job->sender);
+      if (peer == NULL)
+        {
+          g_dbus_method_invocation_return_error (job->invocation, G_DBUS_ERROR,
+                                                 G_DBUS_ERROR_FAILED, "Peer went away");
+          continue;
+        }
+
+      blob = blob_for_digest (&job->fd, job->sender, peer->domain, peer,
+                              job->size, job->digest, 0, &reused);
+      finish_make_unique (job->invocation, job->sender, blob, reused);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Queues hashing of a small memfd without holes, taking over fd.
+   Returns FALSE if the blob doesn't qualify. */
+static gboolean
+queue_hash_job (GDBusMethodInvocation *invocation,
+                const gchar           *sender,
+                int                   *fdp,
+                gsize                  size)
+{
+  HashJob *job;
+  off_t hole;
+
+  if (size == 0 || size > MAX_BATCH_HASH_SIZE)
+    return FALSE;
+
+  /* Sparse blobs need checksum_sparse_data() to avoid faulting in holes */
+  hole = lseek (*fdp, 0, SEEK_HOLE);
+  if (hole < 0 || (gsize) hole < size)
+    return FALSE;
+
+  job = g_new0 (HashJob, 1);
+  job->invocation = g_object_ref (invocation);
+  job->sender = g_strdup (sender);
+  job->fd = steal_fd (fdp);
+  job->size = size;
+
+  if (pending_hash_jobs == NULL)
+    {
+      pending_hash_jobs = g_ptr_array_new_with_free_func ((GDestroyNotify)hash_job_free);
+      /* Method calls are dispatched at default priority, so this runs
+         right after the ones that are ready now, and a steady stream of
+         requests can't hold it off */
+      g_idle_add_full (G_PRIORITY_HIGH, flush_hash_jobs, NULL, NULL);
+    }
+
+  g_ptr_array_add (pending_hash_jobs, job);
+
+  return TRUE;
+}
+
+static void
+make_unique (GDBusConnection       *connection,
+             const gchar           *sender,
+             GVariant              *parameters,
+             GDBusMethodInvocation *invocation)
+{
+  GDBusMessage *message = g_dbus_method_invocation_get_message (invocation);
+  GUnixFDList *fd_list = g_dbus_message_get_unix_fd_list (message);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(Blob) blob = NULL;
+  Peer *peer = lookup_peer (sender);
+  auto_fd int fd = -1;
+  struct stat statbuf;
+  gboolean reused;
+  gint32 handle;
+
+  g_debug ("Got MakeUnique request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(h)")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  g_variant_get (parameters, "(h)", &handle);
+
+  fd = steal_one_fd_from_list (fd_list, handle);
+  if (!check_blob_fd (fd, &statbuf, &error))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+
+  if (queue_hash_job (invocation, sender, &fd, statbuf.st_size))
+    return;
+
+  blob = get_blob_for_fd (steal_fd (&fd), sender, peer->domain, peer, &reused, &error);
+  if (blob == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+
+  finish_make_unique (invocation, sender, blob, reused);
+}
+
+/* Keep well below the bus limit on fds per message, clients send larger
+   manifests and arenas in several batches */
+#define MAX_PREFETCH_FDS 16
+
+/* Arenas: instead of a memfd per blob, a client can write many blobs
+   into one sealed memfd and submit (offset, length) ranges of it with
+   MakeUniqueRanges. We hash the ranges in place. Hits get the existing
+   fd like MakeUnique. New content is adopted by reference, like blobs
+   packed into a segment, if at least half of the whole arena would stay
+   alive, counting what we adopted from it in earlier calls; otherwise it
+   is copied out, so that a few new blobs don't pin a mostly duplicate
+   arena. Replies carry at most MAX_PREFETCH_FDS fds, so they may cover
+   only a prefix of the ranges, and the client submits the rest again. */
+#define MAX_ARENA_RANGES 1024
+
+static guint
+arena_segment_hash (gconstpointer key)
+{
+  const Segment *segment = key;
+
+  return g_int64_hash (&(gint64){ segment->arena_ino }) ^ g_int64_hash (&(gint64){ segment->arena_dev });
+}
+
+static gboolean
+arena_segment_equal (gconstpointer a,
+                     gconstpointer b)
+{
+  const Segment *segment_a = a;
+  const Segment *segment_b = b;
+
+  return segment_a->arena_dev == segment_b->arena_dev && segment_a->arena_ino == segment_b->arena_ino;
+}
+
+typedef struct {
+  guint64 offset;
+  guint64 len;
+  guint8 digest[DIGEST_LEN];
+  Blob *blob; /* Existing blob with that content, if any */
+} ArenaRange;
+
+static void
+arena_range_clear (ArenaRange *range)
+{
+  g_clear_pointer (&range->blob, blob_unref);
+}
+
+/* Returns a new blob for range, at its offset in the arena fd */
+static Blob *
+blob_new_in_arena (const char *domain,
+                   const char *sender,
+                   int         arena_fd,
+                   Segment    *segment,
+                   ArenaRange *range)
+{
+  g_autofree char *checksum = digest_to_checksum (range->digest);
+  int fd = fcntl (arena_fd, F_DUPFD_CLOEXEC, 3);
+  Blob *blob;
+
+  if (fd < 0)
+    return NULL;
+
+  blob = blob_new (domain, fd, checksum, range->digest, range->len, 0);
+  blob->creator = g_strdup (sender);
+  blob->offset = range->offset;
+  blob->segment = segment;
+  segment->ref_count++;
+  segment->live_size += blob->len;
+  packed_blob_size += blob->len;
+  blob_ensure_fingerprint (blob);
+
+  return blob;
+}
+
+/* Returns a new blob for a copy of range in a memfd of its own */
+static Blob *
+blob_new_from_arena_copy (const char *domain,
+                          int         arena_fd,
+                          ArenaRange *range)
+{
+  g_autofree char *checksum = digest_to_checksum (range->digest);
+  int fd = copy_data (arena_fd, range->offset, range->len, checksum);
+  Blob *blob;
+
+  if (fd < 0)
+    return NULL;
+
+  blob = blob_new (domain, fd, checksum, range->digest, range->len, 0);
+  blob_ensure_fingerprint (blob);
+
+  return blob;
+}
+
+static void
+make_unique_ranges (GDBusConnection       *connection,
+                    const gchar           *sender,
+                    GVariant              *parameters,
+                    GDBusMethodInvocation *invocation)
+{
+  GDBusMessage *message = g_dbus_method_invocation_get_message (invocation);
+  GUnixFDList *fd_list = g_dbus_message_get_unix_fd_list (message);
+  g_autoptr(GUnixFDList) ret_fds = g_unix_fd_list_new ();
+  g_autoptr(GVariantBuilder) results = g_variant_builder_new (G_VARIANT_TYPE ("a(ahuaytt)"));
+  g_autoptr(GArray) ranges = NULL;
+  g_autoptr(GVariantIter) iter = NULL;
+  g_autoptr(GError) error = NULL;
+  Peer *peer = lookup_peer (sender);
+  Segment lookup_segment = { 0 };
+  Segment *segment = NULL;
+  auto_fd int fd = -1;
+  struct stat statbuf;
+  guchar *data = NULL;
+  guint64 offset, len;
+  gsize new_size = 0;
+  guint n_ranges, n_fds, n_adopted = 0, n_copied = 0, i, j, n;
+  gboolean adopt;
+  gint32 handle;
+
+  g_debug ("Got MakeUniqueRanges request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(ha(tt))")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  g_variant_get (parameters, "(ha(tt))", &handle, &iter);
+
+  fd = steal_one_fd_from_list (fd_list, handle);
+  if (!check_blob_fd (fd, &statbuf, &error))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+
+  ranges = g_array_new (FALSE, TRUE, sizeof (ArenaRange));
+  g_array_set_clear_func (ranges, (GDestroyNotify)arena_range_clear);
+  while (g_variant_iter_next (iter, "(tt)", &offset, &len))
+    {
+      ArenaRange range = { offset, len };
+
+      if (len == 0 || offset > (guint64)statbuf.st_size || len > (guint64)statbuf.st_size - offset ||
+          ranges->len == MAX_ARENA_RANGES)
+        {
+          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                                 G_DBUS_ERROR_INVALID_ARGS, "Invalid range");
+          return;
+        }
+      g_array_append_val (ranges, range);
+    }
+
+  if (ranges->len > 0)
+    {
+      data = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED)
+        {
+          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                                 G_DBUS_ERROR_INVALID_ARGS, "Can't read data");
+          return;
+        }
+    }
+
+  /* Hash and look up ranges until the existing blobs we have to send
+     use up the fds we can pass */
+  n_ranges = n_fds = 0;
+  for (i = 0; i < ranges->len && n_ranges == i; i += n)
+    {
+      const guint8 *lane_data[UNIQUE_SHA1_LANES];
+      gsize lane_len[UNIQUE_SHA1_LANES];
+      guint8 digests[UNIQUE_SHA1_LANES][DIGEST_LEN];
+
+      n = MIN (UNIQUE_SHA1_LANES, ranges->len - i);
+      for (j = 0; j < n; j++)
+        {
+          ArenaRange *range = &g_array_index (ranges, ArenaRange, i + j);
+
+          lane_data[j] = data + range->offset;
+          lane_len[j] = range->len;
+        }
+
+      hash_buffers (lane_data, lane_len, n, digests);
+
+      for (j = 0; j < n; j++)
+        {
+          ArenaRange *range = &g_array_index (ranges, ArenaRange, i + j);
+          g_autofree char *checksum = digest_to_checksum (digests[j]);
+
+          memcpy (range->digest, digests[j], DIGEST_LEN);
+          range->blob = lookup_blob (peer->domain, checksum);
+          if (range->blob != NULL && n_fds++ == MAX_PREFETCH_FDS)
+            break;
+
+          if (range->blob == NULL)
+            new_size += range->len;
+          n_ranges++;
+        }
+    }
+
+  if (data != NULL)
+    munmap (data, statbuf.st_size);
+
+  /* The inode stays the same while we hold fds of it in the segment */
+  lookup_segment.arena_dev = statbuf.st_dev;
+  lookup_segment.arena_ino = statbuf.st_ino;
+  segment = g_hash_table_lookup (arena_segments, &lookup_segment);
+
+  adopt = n_ranges > 0 && ((segment ? segment->live_size : 0) + new_size) * 2 >= (gsize)statbuf.st_size;
+  if (!adopt)
+    segment = NULL;
+  else if (segment == NULL)
+    {
+      segment = g_new0 (Segment, 1);
+      segment->size = statbuf.st_size;
+      segment->arena_dev = statbuf.st_dev;
+      segment->arena_ino = statbuf.st_ino;
+    }
+
+  n_fds = 0;
+  for (i = 0; i < n_ranges; i++)
+    {
+      ArenaRange *range = &g_array_index (ranges, ArenaRange, i);
+      g_autoptr(GVariantBuilder) entry = g_variant_builder_new (G_VARIANT_TYPE_TUPLE);
+      g_autoptr(Blob) blob = NULL;
+      gboolean hit = range->blob != NULL;
+      gboolean send_fd;
+
+      if (range->blob == NULL)
+        {
+          /* The same content may be in the arena twice */
+          g_autofree char *checksum = digest_to_checksum (range->digest);
+          range->blob = lookup_blob (peer->domain, checksum);
+        }
+
+      send_fd = range->blob != NULL || !adopt;
+      if (send_fd && n_fds == MAX_PREFETCH_FDS)
+        break;
+
+      if (range->blob != NULL)
+        {
+          blob = blob_ref (range->blob);
+          if (blob->fd == -1)
+            {
+              int copy_fd = copy_data (fd, range->offset, range->len, blob->checksum);
+              if (copy_fd < 0)
+                break;
+              blob_promote (blob, copy_fd, 0, NULL);
+            }
+        }
+      else if (adopt)
+        {
+          blob = blob_new_in_arena (peer->domain, sender, fd, segment, range);
+          n_adopted++;
+        }
+      else
+        {
+          blob = blob_new_from_arena_copy (peer->domain, fd, range);
+          n_copied++;
+        }
+
+      if (blob == NULL ||
+          add_blob_to_reply (entry, ret_fds, sender, blob, send_fd) == 0)
+        break;
+
+      g_variant_builder_add_value (results, g_variant_builder_end (entry));
+      if (send_fd)
+        n_fds++;
+
+      /* Ranges we don't get to are submitted again */
+      record_submission (peer, range->len, hit);
+    }
+
+  if (segment != NULL && segment->ref_count == 0)
+    segment_free (segment);
+  else if (segment != NULL && !g_hash_table_contains (arena_segments, segment))
+    g_hash_table_add (arena_segments, segment);
+
+  g_debug ("Handled %u of %u arena ranges for %s, %u adopted, %u copied",
+           i, ranges->len, sender, n_adopted, n_copied);
+  print_stats ();
+
+  g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+                                                           g_variant_new ("(a(ahuaytt))", results),
+                                                           ret_fds);
+}
+
+static void
+put (GDBusConnection       *connection,
+     const gchar           *sender,
+     GVariant              *parameters,
+     GDBusMethodInvocation *invocation)
+{
+  GDBusMessage *message = g_dbus_method_invocation_get_message (invocation);
+  GUnixFDList *fd_list = g_dbus_message_get_unix_fd_list (message);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(Blob) blob = NULL;
+  g_autofree char *domain_key = NULL;
+  g_autofree char *parent_key = NULL;
+  const char *key;
+  const char *domain;
+  gboolean reused;
+  gint32 handle;
+
+  g_debug ("Got Put request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sh)")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  g_variant_get (parameters, "(&sh)", &key, &handle);
+
+  domain = domain_for_cache_key (lookup_peer (sender), key, TRUE);
+  domain_key = g_strconcat (domain, "/", key, NULL);
+
+  /* Cache entries must have the data, so skip admission control */
+  blob = get_blob_for_fd (steal_one_fd_from_list (fd_list, handle), sender, domain, NULL, &reused, &error);
+  if (blob == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+
+  cache_put (domain_key, blob);
+
+  return_blob (invocation, sender, blob, reused);
+
+  parent_key = parent_cache_key (domain, key);
+  if (parent_key != NULL)
+    forward_to_parent (blob, parent_key);
+}
+
+static void
+get (GDBusConnection       *connection,
+     const gchar           *sender,
+     GVariant              *parameters,
+     GDBusMethodInvocation *invocation)
+{
+  g_autoptr(Blob) blob = NULL;
+  g_autofree char *domain_key = NULL;
+  Peer *peer;
+  const char *domain;
+  const char *key;
+
+  g_debug ("Got Get request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(s)")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  g_variant_get (parameters, "(&s)", &key);
+
+  peer = lookup_peer (sender);
+  domain = domain_for_cache_key (peer, key, FALSE);
+  domain_key = g_strconcat (domain, "/", key, NULL);
+  blob = cache_get (domain_key);
+
+  /* Untrusted peers put global class keys in their own domain */
+  if (blob == NULL && domain != peer->domain)
+    {
+      g_autofree char *own_key = g_strconcat (peer->domain, "/", key, NULL);
+
+      blob = cache_get (own_key);
+    }
+
+  if (blob == NULL)
+    {
+      if (forward_get_to_parent (invocation, sender, domain, key))
+        return;
+
+      /* A miss is signalled by an empty fd array */
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(ahuaytt)", NULL, 0, NULL, (guint64)0, (guint64)0));
+      return;
+    }
+
+  return_blob (invocation, sender, blob, TRUE);
+}
+
+static void
+channel_free (Channel *channel)
+{
+  g_debug ("Dropping channel %s", channel->key);
+
+  g_clear_pointer (&channel->blob, blob_unref);
+  g_hash_table_destroy (channel->subscribers);
+  g_hash_table_destroy (channel->publishers);
+  g_free (channel->name);
+  g_free (channel->key);
+  g_free (channel);
+}
+
+/* Returns the channel called name in the domain of peer (for
+   publishing if write is set), creating it if needed */
+static Channel *
+lookup_channel (Peer       *peer,
+                const char *name,
+                gboolean    write)
+{
+  const char *domain = domain_for_cache_key (peer, name, write);
+  g_autofree char *key = g_strconcat (domain, "/", name, NULL);
+  Channel *channel = g_hash_table_lookup (channels, key);
+
+  if (channel == NULL)
+    {
+      channel = g_new0 (Channel, 1);
+      channel->key = g_steal_pointer (&key);
+      channel->name = g_strdup (name);
+      channel->subscribers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      channel->publishers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_insert (channels, channel->key, channel);
+    }
+
+  return channel;
+}
+
+static gboolean
+channel_is_unused (Channel *channel)
+{
+  return
+    g_hash_table_size (channel->subscribers) == 0 &&
+    g_hash_table_size (channel->publishers) == 0;
+}
+
+/* Sends the latest version of channel to peer_name, with a new handle */
+static void
+send_channel_update (Channel    *channel,
+                     const char *peer_name)
+{
+  g_autoptr(GDBusMessage) message = NULL;
+  g_autoptr(GUnixFDList) fd_list = g_unix_fd_list_new ();
+  g_autoptr(GVariantBuilder) body = g_variant_builder_new (G_VARIANT_TYPE_TUPLE);
+  g_autoptr(GError) error = NULL;
+  guint32 blob_id;
+
+  g_variant_builder_add (body, "s", channel->name);
+  g_variant_builder_add (body, "t", channel->version);
+  blob_id = add_blob_to_reply (body, fd_list, peer_name, channel->blob, TRUE);
+  if (blob_id == 0)
+    {
+      g_warning ("Failed to dup fd for channel %s", channel->key);
+      return;
+    }
+
+  message = g_dbus_message_new_signal ("/org/freedesktop/portal/unique",
+                                       "org.freedesktop.portal.Unique",
+                                       "ChannelUpdated");
+  g_dbus_message_set_destination (message, peer_name);
+  g_dbus_message_set_body (message, g_variant_builder_end (body));
+  g_dbus_message_set_unix_fd_list (message, fd_list);
+
+  if (!g_dbus_connection_send_message (bus, message, G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, &error))
+    {
+      g_warning ("Failed to send ChannelUpdated to %s: %s", peer_name, error->message);
+      remove_blob_from_peer (peer_name, blob_id);
+    }
+}
+
+/* Returns the latest version of channel (if any) and its version number */
+static void
+return_channel (GDBusMethodInvocation *invocation,
+                const gchar           *sender,
+                Channel               *channel,
+                gboolean               send_fd)
+{
+  g_autoptr(GUnixFDList) ret_fds = g_unix_fd_list_new ();
+  g_autoptr(GVariantBuilder) reply = g_variant_builder_new (G_VARIANT_TYPE_TUPLE);
+
+  if (channel->blob == NULL)
+    {
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(ahuayttt)", NULL, 0, NULL,
+                                                                        (guint64)0, (guint64)0, (guint64)0));
+      return;
+    }
+
+  if (add_blob_to_reply (reply, ret_fds, sender, channel->blob, send_fd) == 0)
+    {
+      g_dbus_method_invocation_return_error (invocation,  G_DBUS_ERROR,
+                                             G_DBUS_ERROR_FAILED, "Failed to dup fd");
+      return;
+    }
+  g_variant_builder_add (reply, "t", channel->version);
+
+  print_stats ();
+
+  g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+                                                           g_variant_builder_end (reply),
+                                                           ret_fds);
+}
+
+static void
+publish (GDBusConnection       *connection,
+         const gchar           *sender,
+         GVariant              *parameters,
+         GDBusMethodInvocation *invocation)
+{
+  GDBusMessage *message = g_dbus_method_invocation_get_message (invocation);
+  GUnixFDList *fd_list = g_dbus_message_get_unix_fd_list (message);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(Blob) blob = NULL;
+  Peer *peer = lookup_peer (sender);
+  Channel *channel;
+  GHashTableIter iter;
+  gpointer key;
+  const char *name;
+  gboolean reused;
+  gint32 handle;
+
+  g_debug ("Got Publish request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sh)")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  g_variant_get (parameters, "(&sh)", &name, &handle);
+
+  /* Subscribers must get the data, so skip admission control */
+  blob = get_blob_for_fd (steal_one_fd_from_list (fd_list, handle), sender,
+                          domain_for_cache_key (peer, name, TRUE), NULL, &reused, &error);
+  if (blob == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+
+  channel = lookup_channel (peer, name, TRUE);
+  g_hash_table_add (channel->publishers, g_strdup (sender));
+
+  /* Republishing the same content is not a new version */
+  if (channel->blob != blob)
+    {
+      g_clear_pointer (&channel->blob, blob_unref);
+      channel->blob = blob_ref (blob);
+      channel->version++;
+
+      g_debug ("Channel %s is at version %" G_GUINT64_FORMAT " (checksum %s), notifying %u subscribers",
+               channel->key, channel->version, blob->checksum, g_hash_table_size (channel->subscribers));
+
+      g_hash_table_iter_init (&iter, channel->subscribers);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        send_channel_update (channel, key);
+    }
+
+  return_channel (invocation, sender, channel, reused);
+}
+
+static void
+subscribe (GDBusConnection       *connection,
+           const gchar           *sender,
+           GVariant              *parameters,
+           GDBusMethodInvocation *invocation)
+{
+  Channel *channel;
+  const char *name;
+
+  g_debug ("Got Subscribe request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(s)")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  g_variant_get (parameters, "(&s)", &name);
+
+  channel = lookup_channel (lookup_peer (sender), name, FALSE);
+  g_hash_table_add (channel->subscribers, g_strdup (sender));
+
+  return_channel (invocation, sender, channel, TRUE);
+}
+
+static void
+unsubscribe (GDBusConnection       *connection,
+             const gchar           *sender,
+             GVariant              *parameters,
+             GDBusMethodInvocation *invocation)
+{
+  Channel *channel;
+  const char *name;
+
+  g_debug ("Got Unsubscribe request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(s)")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  g_variant_get (parameters, "(&s)", &name);
+
+  channel = lookup_channel (lookup_peer (sender), name, FALSE);
+  g_hash_table_remove (channel->subscribers, sender);
+
+  if (channel_is_unused (channel))
+    g_hash_table_remove (channels, channel->key);
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+}
+
+/* Forgets peer_name, which died, as a publisher and subscriber */
+static void
+remove_channel_peer (const char *peer_name)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, channels);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Channel *channel = value;
+      gboolean removed;
+
+      removed = g_hash_table_remove (channel->subscribers, peer_name);
+      removed |= g_hash_table_remove (channel->publishers, peer_name);
+      if (removed && channel_is_unused (channel))
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
+static void
+prefetch (GDBusConnection       *connection,
+          const gchar           *sender,
+          GVariant              *parameters,
+          GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GUnixFDList) ret_fds = g_unix_fd_list_new ();
+  g_autoptr(GVariantBuilder) found_builder = NULL;
+  g_autoptr(GVariantIter) iter = NULL;
+  Peer *peer = lookup_peer (sender);
+  GVariant *next_digest_v;
+  guint64 size;
+  guint n_found = 0;
+
+  g_debug ("Got Prefetch request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(a(ayt))")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  found_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayhutt)"));
+
+  g_variant_get (parameters, "(a(ayt))", &iter);
+  while (n_found < MAX_PREFETCH_FDS &&
+         g_variant_iter_next (iter, "(@ayt)", &next_digest_v, &size))
+    {
+      g_autoptr(GVariant) digest_v = next_digest_v;
+      g_autofree char *checksum = NULL;
+      const guint8 *digest;
+      gsize digest_len;
+      Blob *blob;
+      gint fd_handle;
+
+      digest = g_variant_get_fixed_array (digest_v, &digest_len, 1);
+      if (digest_len != DIGEST_LEN)
+        continue;
+
+      checksum = digest_to_checksum (digest);
+      blob = lookup_blob (peer->domain, checksum);
+      if (blob == NULL)
+        blob = lookup_blob (GLOBAL_DOMAIN, checksum);
+      if (blob == NULL)
+        continue;
+
+      /* Existing references keep it alive */
+      blob_unref (blob);
+      if (blob->fd == -1 || blob->len != size)
+        continue;
+
+      fd_handle = g_unix_fd_list_append (ret_fds, blob->fd, NULL);
+      if (fd_handle < 0)
+        continue;
+
+      g_variant_builder_add (found_builder, "(@ayhutt)",
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, blob->digest, DIGEST_LEN, 1),
+                             fd_handle,
+                             add_blob_to_peer (sender, blob),
+                             (guint64)blob->offset, (guint64)blob->len);
+      n_found++;
+    }
+
+  g_debug ("Prefetched %u blobs for %s", n_found, sender);
+  print_stats ();
+
+  g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+                                                           g_variant_new ("(a(ayhutt))", found_builder),
+                                                           ret_fds);
+}
+
+/* The shared interning table, see unique-intern.h. Created on first use */
+static int intern_fd = -1;
+static UniqueInternHeader *intern_table;
+
+static gboolean
+ensure_intern_table (GError **error)
+{
+  auto_fd int fd = -1;
+  void *data;
+
+  if (intern_table != NULL)
+    return TRUE;
+
+  /* The table is readable by every peer */
+  if (sharing_domain_kind != SHARING_DOMAIN_GLOBAL)
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED, "Interning needs a global sharing domain");
+      return FALSE;
+    }
+
+  fd = memfd_create ("unique-intern", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0 ||
+      ftruncate (fd, UNIQUE_INTERN_TABLE_SIZE) != 0)
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "Can't create intern table");
+      return FALSE;
+    }
+
+  data = mmap (NULL, UNIQUE_INTERN_TABLE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "Can't map intern table");
+      return FALSE;
+    }
+
+  /* We keep our writable mapping, but nobody else can get one */
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE) != 0)
+    {
+      munmap (data, UNIQUE_INTERN_TABLE_SIZE);
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "Can't seal intern table");
+      return FALSE;
+    }
+
+  intern_table = data;
+  intern_table->magic = UNIQUE_INTERN_MAGIC;
+  intern_table->size = UNIQUE_INTERN_TABLE_SIZE;
+  intern_table->n_buckets = UNIQUE_INTERN_N_BUCKETS;
+  intern_table->strings_offset = sizeof (UniqueInternHeader) + UNIQUE_INTERN_N_BUCKETS * sizeof (guint32);
+  intern_table->strings_end = intern_table->strings_offset;
+
+  intern_fd = steal_fd (&fd);
+
+  return TRUE;
+}
+
+/* Returns the offset of the entry for str, adding it if needed, or 0 if
+   it can't be interned */
+static guint32
+intern_string (const char *str)
+{
+  gsize len = strlen (str);
+  UniqueInternEntry *entry;
+  guint32 *buckets;
+  guint32 hash, offset, mask, i;
+  gsize entry_size;
+
+  if (len > UNIQUE_INTERN_MAX_STRING_LEN)
+    return 0;
+
+  hash = unique_intern_hash (str, len);
+  offset = unique_intern_lookup (intern_table, str, len, hash);
+  if (offset != 0)
+    return offset;
+
+  entry_size = (sizeof (UniqueInternEntry) + len + 1 + UNIQUE_INTERN_ENTRY_ALIGN - 1) & ~(UNIQUE_INTERN_ENTRY_ALIGN - 1);
+
+  /* Keep the load factor below 3/4, so probe sequences stay short */
+  if (intern_table->n_entries >= intern_table->n_buckets / 4 * 3 ||
+      intern_table->strings_end + entry_size > intern_table->size)
+    {
+      g_debug ("Intern table full");
+      return 0;
+    }
+
+  offset = intern_table->strings_end;
+  entry = (UniqueInternEntry *)((char *)intern_table + offset);
+  entry->hash = hash;
+  entry->len = len;
+  memcpy (entry->str, str, len + 1);
+  intern_table->strings_end += entry_size;
+  intern_table->n_entries++;
+
+  buckets = unique_intern_buckets (intern_table);
+  mask = intern_table->n_buckets - 1;
+  for (i = hash & mask; buckets[i] != 0; i = (i + 1) & mask)
+    ;
+  /* Publish, see unique-intern.h */
+  __atomic_store_n (&buckets[i], offset, __ATOMIC_RELEASE);
+
+  return offset;
+}
+
+static void
+get_intern_table (GDBusConnection       *connection,
+                  const gchar           *sender,
+                  GVariant              *parameters,
+                  GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GUnixFDList) ret_fds = g_unix_fd_list_new ();
+  g_autoptr(GError) error = NULL;
+  gint fd_handle;
+
+  g_debug ("Got GetInternTable request from %s", sender);
+
+  if (!ensure_intern_table (&error))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+
+  fd_handle = g_unix_fd_list_append (ret_fds, intern_fd, NULL);
+  if (fd_handle < 0)
+    {
+      g_dbus_method_invocation_return_error (invocation,  G_DBUS_ERROR,
+                                             G_DBUS_ERROR_FAILED, "Failed to dup fd");
+      return;
+    }
+
+  g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+                                                           g_variant_new ("(h)", fd_handle),
+                                                           ret_fds);
+}
+
+static void
+intern (GDBusConnection       *connection,
+        const gchar           *sender,
+        GVariant              *parameters,
+        GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GVariantBuilder) offsets_builder = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree const char **strings = NULL;
+  gsize i;
+
+  g_debug ("Got Intern request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(as)")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  if (!ensure_intern_table (&error))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+
+  g_variant_get (parameters, "(^a&s)", &strings);
+
+  offsets_builder = g_variant_builder_new (G_VARIANT_TYPE ("au"));
+  for (i = 0; strings[i] != NULL; i++)
+    g_variant_builder_add (offsets_builder, "u", intern_string (strings[i]));
+
+  g_debug ("Intern table has %u strings, %u bytes used",
+           intern_table->n_entries, intern_table->strings_end - intern_table->strings_offset);
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(au)", offsets_builder));
+}
+
+/* The overlap analyzer hashes every live blob at page granularity to
+   find out how much finer grained dedup could save. As with the reaper,
+   the main thread takes a snapshot of the blobs, and a worker thread
+   does the hashing within a CPU time budget. The worker goes through
+   them in batches, for which the main thread dup:s the fds of the blobs
+   still alive, so we never hold on to more than a batch of them. Only
+   one analysis runs at a time. */
+
+#define DEFAULT_ANALYZE_BUDGET_MSEC 1000
+#define MAX_ANALYZE_BUDGET_MSEC 10000
+#define MAX_ANALYZE_PAIRS 1000
+#define ANALYZE_BATCH_SIZE 64
+
+typedef struct {
+  char *key;
+  char *checksum;
+  int fd; /* Only set while in the current batch */
+  gsize len;
+} AnalyzeBlob;
+
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  GArray *blobs; /* AnalyzeBlob */
+  guint batch_start;
+  guint batch_end;
+  gint64 budget_usec;
+  gint64 used_usec;
+  guint max_pairs;
+  GHashTable *pages; /* Page hash -> PageOwner */
+  GHashTable *pairs; /* Pair -> OverlapPair */
+  /* Results */
+  guint64 analyzed_bytes;
+  guint64 duplicate_bytes;
+  GVariant *top_pairs;
+  gboolean complete;
+  gboolean finished;
+} Analysis;
+
+static gboolean analysis_in_progress;
+
+typedef struct {
+  guint32 first_blob; /* Index of the first blob with this page */
+  guint32 last_blob;  /* To count each blob once */
+} PageOwner;
+
+typedef struct {
+  guint64 pair;     /* first_blob << 32 | other blob */
+  guint64 n_pages;
+} OverlapPair;
+
+static void
+analyze_blob_clear (AnalyzeBlob *blob)
+{
+  g_free (blob->key);
+  g_free (blob->checksum);
+  close_fd (&blob->fd);
+}
+
+static void
+analysis_free (Analysis *analysis)
+{
+  g_object_unref (analysis->invocation);
+  g_array_unref (analysis->blobs);
+  g_hash_table_destroy (analysis->pages);
+  g_hash_table_destroy (analysis->pairs);
+  if (analysis->top_pairs)
+    g_variant_unref (analysis->top_pairs);
+  g_free (analysis);
+}
+
+static gint
+compare_overlap_pairs (gconstpointer a,
+                       gconstpointer b)
+{
+  const OverlapPair *pair_a = a;
+  const OverlapPair *pair_b = b;
+
+  return (pair_a->n_pages < pair_b->n_pages) - (pair_a->n_pages > pair_b->n_pages);
+}
+
+/* Records the page at offset in blob i of the analysis */
+static void
+analyze_page (Analysis     *analysis,
+              GHashTable   *pages,
+              GHashTable   *pairs,
+              guint32       i,
+              const guchar *page)
+{
+  guint64 hash;
+  PageOwner *owner;
+  OverlapPair *pair;
+  guint64 pair_key;
+
+  /* Zero pages are already free */
+  if (unique_page_is_zero (page))
+    return;
+
+  analysis->analyzed_bytes += UNIQUE_PAGE_SIZE;
+  hash = unique_page_hash (page);
+
+  owner = g_hash_table_lookup (pages, &hash);
+  if (owner == NULL)
+    {
+      owner = g_new0 (PageOwner, 1);
+      owner->first_blob = owner->last_blob = i;
+      g_hash_table_insert (pages, g_memdup2 (&hash, sizeof (hash)), owner);
+      return;
+    }
+
+  /* Duplicates within a blob are not what we're after */
+  if (owner->last_blob == i)
+    return;
+  owner->last_blob = i;
+
+  analysis->duplicate_bytes += UNIQUE_PAGE_SIZE;
+
+  /* Credit the overlap to the first blob with the page, that keeps
+     this linear even for very common pages */
+  pair_key = ((guint64)owner->first_blob << 32) | i;
+  pair = g_hash_table_lookup (pairs, &pair_key);
+  if (pair == NULL)
+    {
+      pair = g_new0 (OverlapPair, 1);
+      pair->pair = pair_key;
+      g_hash_table_insert (pairs, &pair->pair, pair);
+    }
+  pair->n_pages++;
+}
+
+#define ANALYZE_CHUNK_SIZE (64 * UNIQUE_PAGE_SIZE)
+
+/* Reads the data extents of blob i, skipping holes so we don't fault
+   in pages that are free now. A partial last page can't be shared, so
+   that is skipped too. */
+static void
+analyze_blob (Analysis   *analysis,
+              GHashTable *pages,
+              GHashTable *pairs,
+              guint32     i,
+              guchar     *buffer)
+{
+  AnalyzeBlob *blob = &g_array_index (analysis->blobs, AnalyzeBlob, i);
+  gsize end = blob->len & ~(gsize)(UNIQUE_PAGE_SIZE - 1);
+  gsize offset = 0;
+
+  while (offset < end)
+    {
+      off_t data_start, data_end;
+
+      data_start = lseek (blob->fd, offset, SEEK_DATA);
+      if (data_start < 0)
+        {
+          if (errno != ENXIO)
+            data_start = offset; /* No hole support, treat the rest as data */
+          else
+            break; /* Only a hole left */
+        }
+      if (data_start >= end)
+        break;
+
+      data_end = lseek (blob->fd, data_start, SEEK_HOLE);
+      if (data_end < 0 || data_end > end)
+        data_end = end;
+      data_start &= ~(off_t)(UNIQUE_PAGE_SIZE - 1);
+
+      for (offset = data_start; offset < data_end; )
+        {
+          gsize n = MIN (ANALYZE_CHUNK_SIZE, data_end - offset) & ~(gsize)(UNIQUE_PAGE_SIZE - 1);
+          ssize_t res;
+          gsize j;
+
+          if (n == 0)
+            break;
+
+          res = pread (blob->fd, buffer, n, offset);
+          if (res < 0 && errno == EINTR)
+            continue;
+          if (res < (ssize_t)UNIQUE_PAGE_SIZE)
+            return;
+
+          for (j = 0; j + UNIQUE_PAGE_SIZE <= (gsize)res; j += UNIQUE_PAGE_SIZE)
+            analyze_page (analysis, pages, pairs, i, buffer + j);
+          offset += j;
+        }
+
+      offset = MAX (offset, (gsize)data_end);
+    }
+}
+
+static void
+analyze_overlap_thread (GTask        *task,
+                        gpointer      source_object,
+                        gpointer      task_data,
+                        GCancellable *cancellable)
+{
+  Analysis *analysis = task_data;
+  g_autoptr(GArray) sorted_pairs = NULL;
+  g_autoptr(GVariantBuilder) pairs_builder = NULL;
+  g_autofree guchar *buffer = g_malloc (ANALYZE_CHUNK_SIZE);
+  gint64 start = get_thread_cpu_time ();
+  GHashTableIter iter;
+  gpointer value;
+  guint32 i;
+
+  for (i = analysis->batch_start; i < analysis->batch_end; i++)
+    {
+      AnalyzeBlob *blob = &g_array_index (analysis->blobs, AnalyzeBlob, i);
+
+      if (analysis->used_usec + get_thread_cpu_time () - start > analysis->budget_usec)
+        {
+          analysis->finished = TRUE;
+          break;
+        }
+
+      /* Blobs that died meanwhile have no fd */
+      if (blob->fd >= 0)
+        analyze_blob (analysis, analysis->pages, analysis->pairs, i, buffer);
+      close_fd (&blob->fd);
+    }
+
+  analysis->used_usec += get_thread_cpu_time () - start;
+
+  if (i == analysis->blobs->len)
+    {
+      analysis->complete = TRUE;
+      analysis->finished = TRUE;
+    }
+
+  if (!analysis->finished)
+    {
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  sorted_pairs = g_array_new (FALSE, FALSE, sizeof (OverlapPair));
+  pairs_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(sst)"));
+
+  g_hash_table_iter_init (&iter, analysis->pairs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_array_append_vals (sorted_pairs, value, 1);
+  g_array_sort (sorted_pairs, compare_overlap_pairs);
+
+  for (i = 0; i < sorted_pairs->len && i < analysis->max_pairs; i++)
+    {
+      OverlapPair *pair = &g_array_index (sorted_pairs, OverlapPair, i);
+      AnalyzeBlob *a = &g_array_index (analysis->blobs, AnalyzeBlob, pair->pair >> 32);
+      AnalyzeBlob *b = &g_array_index (analysis->blobs, AnalyzeBlob, pair->pair & 0xffffffff);
+
+      g_variant_builder_add (pairs_builder, "(sst)", a->checksum, b->checksum,
+                             (guint64)pair->n_pages * UNIQUE_PAGE_SIZE);
+    }
+
+  analysis->top_pairs = g_variant_ref_sink (g_variant_builder_end (pairs_builder));
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void analyze_overlap_done (GObject      *source_object,
+                                  GAsyncResult *res,
+                                  gpointer      user_data);
+
+/* Dups the fds of the next batch of blobs, and hands it to a worker */
+static void
+analyze_next_batch (Analysis *analysis)
+{
+  g_autoptr(GTask) task = NULL;
+  guint i;
+
+  analysis->batch_start = analysis->batch_end;
+  analysis->batch_end = MIN (analysis->batch_start + ANALYZE_BATCH_SIZE, analysis->blobs->len);
+
+  for (i = analysis->batch_start; i < analysis->batch_end; i++)
+    {
+      AnalyzeBlob *analyze_blob = &g_array_index (analysis->blobs, AnalyzeBlob, i);
+      Blob *blob = g_hash_table_lookup (blobs, analyze_blob->key);
+
+      /* The blob may have become a ghost, or been packed, meanwhile */
+      if (blob != NULL && blob->fd >= 0 && blob->segment == NULL)
+        analyze_blob->fd = fcntl (blob->fd, F_DUPFD_CLOEXEC, 3);
+    }
+
+  task = g_task_new (NULL, NULL, analyze_overlap_done, analysis);
+  g_task_set_task_data (task, analysis, NULL);
+  g_task_run_in_thread (task, analyze_overlap_thread);
+}
+
+static void
+analyze_overlap_done (GObject      *source_object,
+                      GAsyncResult *res,
+                      gpointer      user_data)
+{
+  Analysis *analysis = user_data;
+  g_autofree char *analyzed_size = NULL;
+  g_autofree char *duplicate_size = NULL;
+
+  if (!analysis->finished)
+    {
+      analyze_next_batch (analysis);
+      return;
+    }
+
+  analyzed_size = g_format_size (analysis->analyzed_bytes);
+  duplicate_size = g_format_size (analysis->duplicate_bytes);
+  g_debug ("Overlap analysis of %u blobs%s: %s in non-zero pages, %s duplicated between blobs",
+           analysis->blobs->len, analysis->complete ? "" : " (out of budget)",
+           analyzed_size, duplicate_size);
+
+  g_dbus_method_invocation_return_value (analysis->invocation,
+                                         g_variant_new ("(tt@a(sst)b)",
+                                                        analysis->analyzed_bytes,
+                                                        analysis->duplicate_bytes,
+                                                        analysis->top_pairs,
+                                                        analysis->complete));
+
+  analysis_free (analysis);
+  analysis_in_progress = FALSE;
+}
+
+static void
+analyze_overlap (GDBusConnection       *connection,
+                 const gchar           *sender,
+                 GVariant              *parameters,
+                 GDBusMethodInvocation *invocation)
+{
+  Peer *peer = lookup_peer (sender);
+  g_autofree char *domain_prefix = g_strconcat (peer->domain, "/", NULL);
+  Analysis *analysis;
+  GHashTableIter iter;
+  gpointer value;
+  guint32 budget_msec;
+  guint32 max_pairs;
+
+  g_debug ("Got AnalyzeOverlap request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(uu)")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  if (analysis_in_progress)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_LIMITS_EXCEEDED, "An analysis is already running");
+      return;
+    }
+
+  g_variant_get (parameters, "(uu)", &budget_msec, &max_pairs);
+
+  analysis = g_new0 (Analysis, 1);
+  analysis->invocation = g_object_ref (invocation);
+  analysis->budget_usec = (gint64)(budget_msec ? MIN (budget_msec, MAX_ANALYZE_BUDGET_MSEC) : DEFAULT_ANALYZE_BUDGET_MSEC) * 1000;
+  analysis->max_pairs = MIN (max_pairs, MAX_ANALYZE_PAIRS);
+  analysis->blobs = g_array_new (FALSE, FALSE, sizeof (AnalyzeBlob));
+  g_array_set_clear_func (analysis->blobs, (GDestroyNotify)analyze_blob_clear);
+  analysis->pages = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+  analysis->pairs = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, g_free);
+
+  g_hash_table_iter_init (&iter, blobs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Blob *blob = value;
+      AnalyzeBlob analyze_blob;
+
+      /* Packed blobs are smaller than a page, so there is nothing to share */
+      if (blob->fd < 0 || blob->segment != NULL)
+        continue;
+
+      /* Only our own user gets to see the blobs of other domains */
+      if (peer->uid != getuid () &&
+          !g_str_has_prefix (blob->key, domain_prefix) &&
+          !g_str_has_prefix (blob->key, GLOBAL_DOMAIN "/"))
+        continue;
+
+      analyze_blob.key = g_strdup (blob->key);
+      analyze_blob.checksum = g_strdup (blob->checksum);
+      analyze_blob.fd = -1;
+      analyze_blob.len = blob->len;
+      g_array_append_val (analysis->blobs, analyze_blob);
+    }
+
+  analysis_in_progress = TRUE;
+  analyze_next_batch (analysis);
+}
+
+/* Returns the totals print_stats() logs, and for every blob with data
+   its size, the device and inode of its fd (so that mappings in
+   /proc/<pid>/smaps can be attributed to it, packed blobs share the
+   inode of their segment), its number of handles and the pids of the
+   peers holding them. Global blobs are held across users, so only our
+   own user sees the pids of other users' peers. */
+static void
+get_stats (GDBusConnection       *connection,
+           const gchar           *sender,
+           GVariant              *parameters,
+           GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GVariantBuilder) totals_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{st}"));
+  g_autoptr(GVariantBuilder) blobs_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(stttuau)"));
+  g_autoptr(GHashTable) holders = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_array_unref);
+  g_autoptr(GHashTable) n_handles = g_hash_table_new (NULL, NULL);
+  Peer *peer = lookup_peer (sender);
+  g_autofree char *domain_prefix = g_strconcat (peer->domain, "/", NULL);
+  gboolean see_all = peer->uid == getuid ();
+  GHashTableIter iter, blob_iter;
+  gpointer value;
+
+  g_debug ("Got GetStats request from %s", sender);
+
+  g_variant_builder_add (totals_builder, "{st}", "apparent", (guint64)apparent_blob_size);
+  g_variant_builder_add (totals_builder, "{st}", "real", (guint64)real_blob_size);
+  g_variant_builder_add (totals_builder, "{st}", "cached", (guint64)cache_size);
+  g_variant_builder_add (totals_builder, "{st}", "elided", (guint64)elided_blob_size);
+  g_variant_builder_add (totals_builder, "{st}", "ghosts", (guint64)ghost_blob_size);
+  g_variant_builder_add (totals_builder, "{st}", "reaped", (guint64)reaped_blob_size);
+  g_variant_builder_add (totals_builder, "{st}", "migrated", (guint64)migrated_blob_size);
+  g_variant_builder_add (totals_builder, "{st}", "packed", (guint64)packed_blob_size);
+  g_variant_builder_add (totals_builder, "{st}", "unhashed", (guint64)unhashed_blob_size);
+  g_variant_builder_add (totals_builder, "{st}", "blobs", (guint64)g_hash_table_size (blobs));
+  g_variant_builder_add (totals_builder, "{st}", "peers", (guint64)g_hash_table_size (peers));
+
+  /* Each peer once per blob, however many handles it has for it */
+  g_hash_table_iter_init (&iter, peers);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Peer *holder = value;
+      g_autoptr(GHashTable) seen = g_hash_table_new (NULL, NULL);
+
+      g_hash_table_iter_init (&blob_iter, holder->blobs);
+      while (g_hash_table_iter_next (&blob_iter, NULL, &value))
+        {
+          PeerBlob *peer_blob = value;
+          GArray *pids;
+          guint n;
+
+          n = GPOINTER_TO_UINT (g_hash_table_lookup (n_handles, peer_blob->blob));
+          g_hash_table_insert (n_handles, peer_blob->blob, GUINT_TO_POINTER (n + 1));
+
+          if (!g_hash_table_add (seen, peer_blob->blob) ||
+              (!see_all && holder->uid != peer->uid))
+            continue;
+
+          pids = g_hash_table_lookup (holders, peer_blob->blob);
+          if (pids == NULL)
+            {
+              pids = g_array_new (FALSE, FALSE, sizeof (guint32));
+              g_hash_table_insert (holders, peer_blob->blob, pids);
+            }
+          g_array_append_val (pids, holder->pid);
+        }
+    }
+
+  g_hash_table_iter_init (&iter, blobs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Blob *blob = value;
+      GArray *pids = g_hash_table_lookup (holders, blob);
+      struct stat statbuf;
+
+      if (blob->fd < 0 || fstat (blob->fd, &statbuf) != 0)
+        continue;
+
+      /* Only our own user gets to see the blobs of other domains */
+      if (!see_all &&
+          !g_str_has_prefix (blob->key, domain_prefix) &&
+          !g_str_has_prefix (blob->key, GLOBAL_DOMAIN "/"))
+        continue;
+
+      g_variant_builder_add (blobs_builder, "(stttu@au)",
+                             blob->checksum, (guint64)blob->len,
+                             (guint64)statbuf.st_dev, (guint64)statbuf.st_ino,
+                             GPOINTER_TO_UINT (g_hash_table_lookup (n_handles, blob)),
+                             g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+                                                        pids ? pids->data : NULL,
+                                                        pids ? pids->len : 0,
+                                                        sizeof (guint32)));
+    }
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(a{st}a(stttuau))", totals_builder, blobs_builder));
+}
+
+static void
+forget (GDBusConnection       *connection,
+        const gchar           *sender,
+        GVariant              *parameters,
+        GDBusMethodInvocation *invocation)
+{
+  guint32 blob_id;
+
+  g_debug ("Got Forget request from %s", sender);
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(u)")))
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
+      return;
+    }
+
+  g_variant_get (parameters, "(u)", &blob_id);
+
+  remove_blob_from_peer (sender, blob_id);
+
+  print_stats ();
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+}
+
+static void
+dispatch_method_call (GDBusMethodInvocation *invocation)
+{
+  GDBusConnection *connection = g_dbus_method_invocation_get_connection (invocation);
+  const gchar *sender = g_dbus_method_invocation_get_sender (invocation);
+  const gchar *interface_name = g_dbus_method_invocation_get_interface_name (invocation);
+  const gchar *method_name = g_dbus_method_invocation_get_method_name (invocation);
+  GVariant *parameters = g_dbus_method_invocation_get_parameters (invocation);
+
+  /* Handlers may still look at the call after replying to it */
+  g_object_ref (invocation);
+
+  if (g_str_equal (method_name, "MakeUnique"))
+    make_unique (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "MakeUniqueRanges"))
+    make_unique_ranges (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "Forget"))
+    forget (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "Put"))
+    put (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "Get"))
+    get (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "Prefetch"))
+    prefetch (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "Publish"))
+    publish (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "Subscribe"))
+    subscribe (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "Unsubscribe"))
+    unsubscribe (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "GetInternTable"))
+    get_intern_table (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "Intern"))
+    intern (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "AnalyzeOverlap"))
+    analyze_overlap (connection,sender, parameters, invocation);
+  else if (g_str_equal (method_name, "GetStats"))
+    get_stats (connection,sender, parameters, invocation);
+  else
+    g_dbus_method_invocation_return_error (invocation,
+                                           G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                           "Method %s is not implemented on interface %s", method_name, interface_name);
+
+  g_object_unref (invocation);
+}
+
+static void
+method_call (GDBusConnection       *connection,
+             const gchar           *sender,
+             const gchar           *object_path,
+             const gchar           *interface_name,
+             const gchar           *method_name,
+             GVariant              *parameters,
+             GDBusMethodInvocation *invocation,
+             gpointer               user_data)
+{
+  Peer *peer = g_hash_table_lookup (peers, sender);
 
-static void
-blob_unref (Blob *blob)
-{
-  blob->ref_count--;
-  if (blob->ref_count == 0)
+  /* Forgetting needs no domain, and a peer we don't know has no
+     handles to forget */
+  if (peer == NULL && g_str_equal (method_name, "Forget"))
     {
-      g_debug ("Blob for %s destroyed", blob->checksum);
+      dispatch_method_call (invocation);
+      return;
+    }
 
-      real_blob_size -= blob->len;
-      g_hash_table_remove (blobs, blob->checksum);
+  if (peer == NULL)
+    peer = add_peer (sender);
 
-      close (blob->fd);
-      g_free (blob->checksum);
-      g_free (blob);
-    }
+  /* Calls are handled in order once we know who sent them */
+  if (peer->domain == NULL)
+    g_queue_push_tail (&peer->pending_calls, invocation);
+  else
+    dispatch_method_call (invocation);
 }
 
-G_DEFINE_AUTOPTR_CLEANUP_FUNC (Blob, blob_unref)
+/* Shared memfd pages are charged to the memory cgroup of the process
+   that wrote them. With --rematerialize, when the creator of a blob dies
+   we copy the blob into a memfd we write ourselves, so the charge moves
+   to our cgroup instead of staying with a dead (or unrelated) one, and
+   tell all holders to remap. This is done one blob per idle callback. */
+static GQueue rematerialize_queue = G_QUEUE_INIT;
+static guint rematerialize_idle_id;
 
-static Blob *
-blob_new (int fd,
-          const char *checksum,
-          gsize size)
+/* Copies len bytes at offset in src_fd into a new sealed memfd,
+   keeping holes */
+static int
+copy_data (int         src_fd,
+           gsize       offset,
+           gsize       len,
+           const char *checksum)
 {
-  Blob *blob = g_new0 (Blob, 1);
-
-  blob->checksum = g_strdup (checksum);
-  blob->fd = fd;
-  blob->len = size;
-  blob->ref_count = 1;
+  g_autofree char *name = g_strdup_printf ("uniqued-%.16s", checksum);
+  guchar buffer[64 * 1024];
+  auto_fd int fd = -1;
+  off_t data_start, data_end;
 
-  real_blob_size += blob->len;
+  fd = memfd_create (name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0 || ftruncate (fd, len) != 0)
+    return -1;
 
-  g_hash_table_insert (blobs, blob->checksum, blob);
+  data_start = 0;
+  while (data_start < len)
+    {
+      data_start = lseek (src_fd, offset + data_start, SEEK_DATA);
+      if (data_start < 0 || data_start >= offset + len)
+        break; /* ENXIO, only holes left */
+      data_start -= offset;
 
-  return blob;
-}
+      data_end = lseek (src_fd, offset + data_start, SEEK_HOLE);
+      if (data_end < 0 || data_end > offset + len)
+        data_end = len;
+      else
+        data_end -= offset;
 
-static Blob *
-lookup_blob (const char *checksum)
-{
-  Blob *blob = g_hash_table_lookup (blobs, checksum);
+      while (data_start < data_end)
+        {
+          ssize_t n = pread (src_fd, buffer, MIN (sizeof (buffer), data_end - data_start), offset + data_start);
+          if (n < 0 && errno == EINTR)
+            continue;
+          if (n <= 0 ||
+              pwrite (fd, buffer, n, data_start) != n)
+            return -1;
+          data_start += n;
+        }
+    }
 
-  if (blob)
-    return blob_ref (blob);
+  if (fcntl (fd, F_ADD_SEALS, ALL_SEALS) != 0)
+    return -1;
 
-  return NULL;
+  return steal_fd (&fd);
 }
 
-static void
-removed_blob_from_peer_cb (Blob *blob)
+/* Copies the data of blob into a new sealed memfd of its own */
+static int
+copy_blob_fd (Blob *blob)
 {
-  apparent_blob_size -= blob->len;
-  blob_unref (blob);
+  return copy_data (blob->fd, blob->offset, blob->len, blob->checksum);
 }
 
-/* return value owned by peers table, only destroyed when peer dies */
-static Peer *
-lookup_peer (const char *name)
+static void
+rematerialize_blob (Blob *blob)
 {
-  Peer *peer = g_hash_table_lookup (peers, name);
+  int fd;
 
-  if (peer == NULL)
+  fd = copy_blob_fd (blob);
+  if (fd < 0)
     {
-      peer = g_new0 (Peer, 1);
-      peer->name = g_strdup (name);
-      peer->next_blob_id = 1;
-      peer->blobs = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)removed_blob_from_peer_cb);
-      g_hash_table_insert (peers, peer->name, peer);
+      g_warning ("Failed to rematerialize blob %s", blob->checksum);
+      return;
     }
 
-  return peer;
-}
+  g_debug ("Rematerialized blob %s", blob->checksum);
 
-static void
-peer_free (Peer *peer)
-{
-  g_hash_table_destroy (peer->blobs);
-  g_free (peer->name);
-  g_free (peer);
+  blob_replace_fd (blob, fd);
+  migrated_blob_size += blob->len - blob->hole_len;
 }
 
-static guint32
-add_blob_to_peer (const char *peer_name, Blob *blob)
+static gboolean
+rematerialize_idle (gpointer user_data)
 {
-  Peer *peer = lookup_peer (peer_name);
-  guint32 blob_id = peer->next_blob_id++;
+  g_autoptr(Blob) blob = g_queue_pop_head (&rematerialize_queue);
 
-  apparent_blob_size += blob->len;
-  g_hash_table_insert (peer->blobs, GUINT_TO_POINTER(blob_id), blob_ref (blob));
+  /* Skip blobs only kept alive by the queue, and ones we since packed
+     into a segment we wrote ourselves */
+  if (blob != NULL && blob->ref_count > 1 && blob->segment == NULL)
+    {
+      rematerialize_blob (blob);
+      if (g_queue_is_empty (&rematerialize_queue))
+        print_stats ();
+    }
 
-  g_debug ("Added blob %d (with checksum %s) for peer %s", blob_id, blob->checksum, peer_name);
+  if (!g_queue_is_empty (&rematerialize_queue))
+    return G_SOURCE_CONTINUE;
 
-  return blob_id;
+  rematerialize_idle_id = 0;
+  return G_SOURCE_REMOVE;
 }
 
 static void
-remove_blob_from_peer (const char *peer_name, guint32 blob_id)
-{
-  Peer *peer = lookup_peer (peer_name);
-
-  g_debug ("Removing blob %d for peer %s", blob_id, peer_name);
-
-  g_hash_table_remove (peer->blobs, GUINT_TO_POINTER(blob_id));
-}
-
-static GDBusInterfaceInfo *
-get_interface (void)
+queue_rematerialize_for_creator (const char *creator)
 {
-  static GDBusInterfaceInfo *interface_info;
+  GHashTableIter iter;
+  gpointer value;
 
-  if (interface_info == NULL)
+  g_hash_table_iter_init (&iter, blobs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
     {
-      GError *error = NULL;
-      GDBusNodeInfo *info;
+      Blob *blob = value;
 
-      info = g_dbus_node_info_new_for_xml ("<node>"
-                                           "  <interface name='org.freedesktop.portal.Unique'>"
-                                           "    <method name='MakeUnique'>"
-                                           "      <arg type='h' name='memfd' direction='in'/>"
-                                           "      <arg type='ah' name='content' direction='out'/>"
-                                           "      <arg type='u' name='handle' direction='out'/>"
-                                           "    </method>"
-                                           "    <method name='Forget'>"
-                                           "      <arg type='u' name='handle' direction='in'/>"
-                                           "    </method>"
-                                           "  </interface>"
-                                           "</node>", &error);
-      if (info == NULL)
-        g_error ("%s", error->message);
-      interface_info = g_dbus_node_info_lookup_interface (info, "org.freedesktop.portal.Unique");
-      g_assert (interface_info != NULL);
-      g_dbus_interface_info_ref (interface_info);
-      g_dbus_node_info_unref (info);
+      if (blob->creator == NULL || strcmp (blob->creator, creator) != 0)
+        continue;
+
+      g_clear_pointer (&blob->creator, g_free);
+      if (rematerialize && blob->fd >= 0)
+        g_queue_push_tail (&rematerialize_queue, blob_ref (blob));
     }
 
-  return interface_info;
+  if (!g_queue_is_empty (&rematerialize_queue) && rematerialize_idle_id == 0)
+    rematerialize_idle_id = g_idle_add (rematerialize_idle, NULL);
 }
 
-#define ALL_SEALS (F_SEAL_SEAL | \
-                   F_SEAL_SHRINK | \
-                   F_SEAL_GROW |   \
-                   F_SEAL_WRITE)
+/* Blobs smaller than a page still take up a whole one, here and in
+   every process mapping them, and a VMA and TLB entry per mapping. With
+   --compact-interval we periodically pack the small blobs nobody has a
+   handle for (typically memo cache entries not in use right now) into
+   shared segments, ordered so that blobs submitted by the same peer at
+   about the same time end up next to each other. Whoever asks for them
+   next gets the segment and an offset, and clients map each segment
+   only once. Whoever gets a segment can read all of it, so a segment
+   never holds blobs from more than one sharing domain.
+
+   Blobs that peers hold are left alone: the data pointers of their
+   existing mappings can't move into a shared page, so packing those
+   would only add a copy. */
+#define MAX_PACKED_BLOB_SIZE 2048
+#define SEGMENT_SIZE (256 * 1024)
+#define SEGMENT_ALIGN 8 /* Same as for unique tables */
+#define MAX_SEGMENTS_PER_PASS 16
+
+typedef struct {
+  Blob *blob;
+  gsize offset;
+} SegmentMember;
 
+/* Compares the domain part of the domain/checksum keys */
 static int
-steal_one_fd_from_list (GUnixFDList *fd_list,
-                        gint32 handle)
+compare_blob_domains (const Blob *blob_a,
+                      const Blob *blob_b)
 {
-  int n_fds, i, fd, *fds;
+  gsize len_a = strrchr (blob_a->key, '/') - blob_a->key;
+  gsize len_b = strrchr (blob_b->key, '/') - blob_b->key;
+  int res;
 
-  if (fd_list == NULL ||
-      handle >= g_unix_fd_list_get_length (fd_list))
-    return -1;
+  res = memcmp (blob_a->key, blob_b->key, MIN (len_a, len_b));
+  if (res != 0)
+    return res;
 
-  fds = g_unix_fd_list_steal_fds (fd_list, &n_fds);
-  for (i = 0; i < n_fds; i++)
-    {
-      if (i != handle)
-        close (fds[i]);
-    }
+  return (len_a > len_b) - (len_a < len_b);
+}
 
-  fd = fds[handle];
-  g_free (fds);
-  return fd;
+static gint
+compare_pack_order (gconstpointer a,
+                    gconstpointer b)
+{
+  const Blob *blob_a = *(const Blob **)a;
+  const Blob *blob_b = *(const Blob **)b;
+  int res;
+
+  res = compare_blob_domains (blob_a, blob_b);
+  if (res != 0)
+    return res;
+
+  if (blob_a->creator == NULL || blob_b->creator == NULL)
+    res = (blob_a->creator == NULL) - (blob_b->creator == NULL);
+  else
+    res = strcmp (blob_a->creator, blob_b->creator);
+  if (res != 0)
+    return res;
+
+  if (blob_a->fd_time != blob_b->fd_time)
+    return blob_a->fd_time < blob_b->fd_time ? -1 : 1;
+
+  /* Keep the order of blobs we packed together before */
+  return (blob_a->offset > blob_b->offset) - (blob_a->offset < blob_b->offset);
 }
 
+/* Switches blob over to the copy at offset in segment, whose fd we
+   own. Nobody has it mapped, so there is nobody to remap, and fd_time
+   is left alone so we keep ordering by when it was submitted. */
 static void
-make_unique (GDBusConnection       *connection,
-             const gchar           *sender,
-             GVariant              *parameters,
-             GDBusMethodInvocation *invocation)
+blob_pack (Blob    *blob,
+           int      fd,
+           Segment *segment,
+           gsize    offset)
 {
-  GDBusMessage *message = g_dbus_method_invocation_get_message (invocation);
-  GUnixFDList *fd_list = g_dbus_message_get_unix_fd_list (message);
-  g_autoptr(GUnixFDList) ret_fds = NULL;
-  gint32 handle;
-  auto_fd int fd = -1;
-  unsigned int seals;
-  g_autoptr(GChecksum) checksummer = NULL;
-  g_autoptr(GVariantBuilder) array_builder = NULL;
-  const gchar *checksum;
-  g_autoptr(Blob) blob = NULL;
-  guint32 blob_id;
-  struct stat statbuf;
-  void *memfd_data;
+  blob_unpack (blob);
+  close (blob->fd);
+  blob->fd = fd;
+  blob->offset = offset;
+  blob->segment = segment;
+  segment->ref_count++;
+  segment->live_size += blob->len;
+  packed_blob_size += blob->len;
 
-  g_debug ("Got MakeUnique request from %s", sender);
+  elided_blob_size -= blob->hole_len;
+  blob->hole_len = 0;
+  g_clear_pointer (&blob->creator, g_free);
+}
 
-  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(h)")))
+/* Writes the first size bytes of data into a new segment, and moves
+   the members over to it */
+static gboolean
+write_segment (const guchar *data,
+               gsize         size,
+               GArray       *members)
+{
+  auto_fd int fd = -1;
+  Segment *segment;
+  guint i;
+
+  fd = memfd_create ("uniqued-segment", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0 ||
+      ftruncate (fd, size) != 0 ||
+      pwrite (fd, data, size, 0) != (ssize_t)size ||
+      fcntl (fd, F_ADD_SEALS, ALL_SEALS) != 0)
     {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
-                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
-      return;
+      g_warning ("Failed to create segment: %s", g_strerror (errno));
+      return FALSE;
     }
 
-  g_variant_get (parameters, "(h)", &handle);
+  segment = g_new0 (Segment, 1);
+  segment->size = size;
 
-  fd = steal_one_fd_from_list (fd_list, handle);
-  if (fd == -1 ||
-      fstat (fd, &statbuf) != 0)
+  for (i = 0; i < members->len; i++)
     {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
-                                             G_DBUS_ERROR_INVALID_ARGS, "Invalid fd passed");
-      return;
-    }
+      SegmentMember *member = &g_array_index (members, SegmentMember, i);
+      int blob_fd = fcntl (fd, F_DUPFD_CLOEXEC, 3);
 
-  seals = fcntl (fd, F_GET_SEALS);
-  if (seals == -1 ||  (seals & ALL_SEALS) != ALL_SEALS)
-    {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
-                                             G_DBUS_ERROR_INVALID_ARGS, "Fd not sealed");
-      return;
-    }
+      if (blob_fd < 0)
+        continue;
 
-  checksummer = g_checksum_new (G_CHECKSUM_SHA1);
-  memfd_data = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (memfd_data == MAP_FAILED)
-    {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
-                                             G_DBUS_ERROR_INVALID_ARGS, "Can't read data");
-      return;
+      blob_pack (member->blob, blob_fd, segment, member->offset);
     }
 
-  g_checksum_update (checksummer, memfd_data, statbuf.st_size);
-  munmap (memfd_data, statbuf.st_size);
-
-  checksum = g_checksum_get_string (checksummer);
+  if (segment->ref_count == 0)
+    segment_free (segment);
 
-  array_builder = g_variant_builder_new (G_VARIANT_TYPE ("ah"));
+  return TRUE;
+}
 
-  ret_fds = g_unix_fd_list_new ();
+static gboolean
+compact_timeout (gpointer user_data)
+{
+  g_autoptr(GHashTable) held = g_hash_table_new (NULL, NULL);
+  g_autoptr(GPtrArray) candidates = g_ptr_array_new ();
+  g_autoptr(GArray) members = g_array_new (FALSE, FALSE, sizeof (SegmentMember));
+  g_autofree guchar *buffer = NULL;
+  GHashTableIter iter, blob_iter;
+  gpointer value;
+  guint n_packed = 0, n_segments = 0;
+  gsize pos = 0;
+  guint i;
 
-  blob = lookup_blob (checksum);
-  if (blob == NULL)
+  g_hash_table_iter_init (&iter, peers);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
     {
-      blob = blob_new (steal_fd (&fd), checksum, statbuf.st_size);
-      g_debug ("Created new blob for %s (size %ld)", checksum, blob->len);
+      Peer *peer = value;
+
+      g_hash_table_iter_init (&blob_iter, peer->blobs);
+      while (g_hash_table_iter_next (&blob_iter, NULL, &value))
+        g_hash_table_add (held, ((PeerBlob *)value)->blob);
     }
-  else
+
+  g_hash_table_iter_init (&iter, blobs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
     {
-      gint fd_handle = g_unix_fd_list_append (ret_fds, blob->fd, NULL);
-      if (fd_handle < 0)
-        {
-          g_dbus_method_invocation_return_error (invocation,  G_DBUS_ERROR,
-                                                 G_DBUS_ERROR_FAILED, "Failed to dup fd");
-          return;
-        }
+      Blob *blob = value;
 
-      g_debug ("Reusing old blob for %s", checksum);
-      g_variant_builder_add (array_builder, "h", fd_handle);
+      if (blob->fd < 0 || blob->len == 0 || blob->len > MAX_PACKED_BLOB_SIZE ||
+          g_hash_table_contains (held, blob))
+        continue;
+
+      /* Repack blobs from segments that are mostly dead */
+      if (blob->segment != NULL && blob->segment->live_size * 2 >= blob->segment->size)
+        continue;
+
+      g_ptr_array_add (candidates, blob);
     }
 
-  blob_id = add_blob_to_peer (sender, blob);
+  if (candidates->len < 2)
+    return G_SOURCE_CONTINUE;
 
-  print_stats ();
+  g_ptr_array_sort (candidates, compare_pack_order);
 
-  g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
-                                                           g_variant_new ("(ahu)", array_builder, blob_id),
-                                                           ret_fds);
-}
+  buffer = g_malloc (SEGMENT_SIZE);
+  for (i = 0; i < candidates->len; i++)
+    {
+      Blob *blob = g_ptr_array_index (candidates, i);
+      SegmentMember member = { blob, (pos + SEGMENT_ALIGN - 1) & ~(gsize)(SEGMENT_ALIGN - 1) };
 
-static void
-forget (GDBusConnection       *connection,
-        const gchar           *sender,
-        GVariant              *parameters,
-        GDBusMethodInvocation *invocation)
-{
-  guint32 blob_id;
+      /* Candidates are sorted by domain, so a new domain starts a new segment */
+      if (member.offset + blob->len > SEGMENT_SIZE ||
+          (members->len > 0 &&
+           compare_blob_domains (g_array_index (members, SegmentMember, 0).blob, blob) != 0))
+        {
+          if (write_segment (buffer, pos, members))
+            n_packed += members->len;
+          g_array_set_size (members, 0);
+          if (++n_segments == MAX_SEGMENTS_PER_PASS)
+            break;
+          member.offset = pos = 0;
+        }
 
-  g_debug ("Got Forget request from %s", sender);
+      if (pread (blob->fd, buffer + member.offset, blob->len, blob->offset) != (ssize_t)blob->len)
+        continue;
 
-  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(u)")))
-    {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
-                                             G_DBUS_ERROR_INVALID_ARGS, "Wrong argument types");
-      return;
-    }
+      /* Don't leak old heap contents into the alignment padding */
+      memset (buffer + pos, 0, member.offset - pos);
 
-  g_variant_get (parameters, "(u)", &blob_id);
+      g_array_append_val (members, member);
+      pos = member.offset + blob->len;
+    }
 
-  remove_blob_from_peer (sender, blob_id);
+  if (members->len > 0 && write_segment (buffer, pos, members))
+    {
+      n_packed += members->len;
+      n_segments++;
+    }
 
+  g_debug ("Packed %u small blobs into %u segments", n_packed, n_segments);
   print_stats ();
 
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
-}
-
-static void
-method_call (GDBusConnection       *connection,
-             const gchar           *sender,
-             const gchar           *object_path,
-             const gchar           *interface_name,
-             const gchar           *method_name,
-             GVariant              *parameters,
-             GDBusMethodInvocation *invocation,
-             gpointer               user_data)
-{
-  if (g_str_equal (method_name, "MakeUnique"))
-    make_unique (connection,sender, parameters, invocation);
-  else if (g_str_equal (method_name, "Forget"))
-    forget (connection,sender, parameters, invocation);
-  else
-    g_dbus_method_invocation_return_error (invocation,
-                                           G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
-                                           "Method %s is not implemented on interface %s", method_name, interface_name);
+  return G_SOURCE_CONTINUE;
 }
 
 static void
@@ -389,6 +4318,8 @@ name_owner_changed (GDBusConnection *connection,
       if (g_hash_table_remove (peers, name))
         {
           g_debug ("Peer %s died", name);
+          remove_channel_peer (name);
+          queue_rematerialize_for_creator (name);
           print_stats ();
         }
     }
@@ -407,6 +4338,8 @@ on_bus_acquired (GDBusConnection *connection,
     method_call,
   };
 
+  bus = connection;
+
   g_dbus_connection_signal_subscribe (connection,
                                       DBUS_NAME_DBUS,
                                       DBUS_INTERFACE_DBUS,
@@ -458,13 +4391,30 @@ main (int argc, char **argv)
   GMainLoop *loop;
   gboolean replace;
   gboolean verbose;
+  gint cache_size_mb;
+  gboolean system_bus;
+  g_autofree char *address = NULL;
+  g_autofree char *sharing_domain = NULL;
+  g_auto(GStrv) trusted_uid_strings = NULL;
   GOptionContext *context;
-  GDBusConnection *session_bus;
+  GDBusConnection *connection;
   GBusNameOwnerFlags flags;
   g_autoptr(GError) error = NULL;
   const GOptionEntry options[] = {
     { "replace", 'r', 0, G_OPTION_ARG_NONE, &replace,  "Replace old daemon.", NULL },
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,  "Enable debug output.", NULL },
+    { "cache-size", 0, 0, G_OPTION_ARG_INT, &cache_size_mb,  "Memo cache budget in MiB (default 64).", "MB" },
+    { "admission-threshold", 0, 0, G_OPTION_ARG_DOUBLE, &admission_threshold,  "Only keep blobs with at least this estimated chance of being shared, 0 to keep all (default 0.1).", "P" },
+    { "reap-interval", 0, 0, G_OPTION_ARG_INT, &reap_interval,  "Release handles that peers no longer map every SECONDS, 0 to disable (default 0).", "SECONDS" },
+    { "reap-budget", 0, 0, G_OPTION_ARG_INT, &reap_budget_ms,  "CPU time per reaper run in milliseconds (default 20).", "MS" },
+    { "compact-interval", 0, 0, G_OPTION_ARG_INT, &compact_interval,  "Pack small blobs nobody has a handle for into shared segments every SECONDS, 0 to disable (default 0).", "SECONDS" },
+    { "rematerialize", 0, 0, G_OPTION_ARG_NONE, &rematerialize,  "Copy blobs into our own memfds when their creator exits, moving the memory charge to our cgroup.", NULL },
+    { "system", 0, 0, G_OPTION_ARG_NONE, &system_bus,  "Serve all sessions on the system bus.", NULL },
+    { "address", 0, 0, G_OPTION_ARG_STRING, &address,  "Serve on the message bus at ADDRESS.", "ADDRESS" },
+    { "sharing-domain", 0, 0, G_OPTION_ARG_STRING, &sharing_domain,  "Share blobs between peers with the same uid, group or all (default global on the session bus, uid otherwise).", "uid|group|global" },
+    { "global-class", 0, 0, G_OPTION_ARG_STRING_ARRAY, &global_classes,  "Share cache keys starting with CLASS: between all peers.", "CLASS" },
+    { "trusted-uid", 0, 0, G_OPTION_ARG_STRING_ARRAY, &trusted_uid_strings,  "Let UID write global class keys, as well as our own user.", "UID" },
+    { "parent", 0, 0, G_OPTION_ARG_STRING, &parent_address,  "Forward to the uniqued on the message bus at ADDRESS (e.g. the host's, from a container).", "ADDRESS" },
     { NULL }
   };
 
@@ -476,6 +4426,11 @@ main (int argc, char **argv)
 
   replace = FALSE;
   verbose = FALSE;
+  system_bus = FALSE;
+  cache_size_mb = 64;
+  admission_threshold = 0.1;
+  reap_interval = 0;
+  reap_budget_ms = 20;
 
   g_option_context_set_summary (context, "Uniqued");
   g_option_context_add_main_entries (context, options, GETTEXT_PACKAGE);
@@ -494,28 +4449,89 @@ main (int argc, char **argv)
   if (verbose)
     g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, message_handler, NULL);
 
-  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
-  if (session_bus == NULL)
+  if (sharing_domain == NULL)
+    sharing_domain_kind = (system_bus || address != NULL) ? SHARING_DOMAIN_UID : SHARING_DOMAIN_GLOBAL;
+  else if (g_str_equal (sharing_domain, "uid"))
+    sharing_domain_kind = SHARING_DOMAIN_UID;
+  else if (g_str_equal (sharing_domain, "group"))
+    sharing_domain_kind = SHARING_DOMAIN_GROUP;
+  else if (g_str_equal (sharing_domain, "global"))
+    sharing_domain_kind = SHARING_DOMAIN_GLOBAL;
+  else
+    {
+      g_printerr ("Unknown sharing domain %s\n", sharing_domain);
+      return 1;
+    }
+
+  if (trusted_uid_strings != NULL)
+    {
+      int i;
+
+      trusted_uids = g_array_new (FALSE, FALSE, sizeof (guint32));
+      for (i = 0; trusted_uid_strings[i] != NULL; i++)
+        {
+          guint64 uid;
+          guint32 uid32;
+
+          if (!g_ascii_string_to_unsigned (trusted_uid_strings[i], 10, 0, G_MAXUINT32 - 1, &uid, NULL))
+            {
+              g_printerr ("Invalid uid %s\n", trusted_uid_strings[i]);
+              return 1;
+            }
+          uid32 = uid;
+          g_array_append_val (trusted_uids, uid32);
+        }
+    }
+
+  if (address != NULL)
+    connection = g_dbus_connection_new_for_address_sync (address,
+                                                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                         G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                         NULL, NULL, &error);
+  else
+    connection = g_bus_get_sync (system_bus ? G_BUS_TYPE_SYSTEM : G_BUS_TYPE_SESSION, NULL, &error);
+  if (connection == NULL)
     {
       g_printerr ("Can't find bus: %s\n", error->message);
       return 1;
     }
 
+  g_dbus_connection_set_exit_on_close (connection, TRUE);
+
+  blobs = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL); // No destroy, instead blob destry removes from hash
+  fingerprints = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  unhashed_ghosts = g_hash_table_new (g_str_hash, g_str_equal);
+  peers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)peer_free);
+  cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)cache_entry_free);
+  channels = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)channel_free);
+  arena_segments = g_hash_table_new (arena_segment_hash, arena_segment_equal);
+  cache_budget = (gsize)MAX (cache_size_mb, 0) * 1024 * 1024;
+
   flags = G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT;
   if (replace)
     flags |= G_BUS_NAME_OWNER_FLAGS_REPLACE;
 
-  owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
-                             "org.freedesktop.portal.Unique",
-                             flags,
-                             on_bus_acquired,
-                             on_name_acquired,
-                             on_name_lost,
-                             NULL,
-                             NULL);
+  on_bus_acquired (connection, NULL, NULL);
 
-  blobs = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL); // No destroy, instead blob destry removes from hash
-  peers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)peer_free);
+  if (parent_address != NULL)
+    {
+      parent_blobs = g_hash_table_new (NULL, NULL);
+      connect_to_parent ();
+    }
+
+  owner_id = g_bus_own_name_on_connection (connection,
+                                           "org.freedesktop.portal.Unique",
+                                           flags,
+                                           on_name_acquired,
+                                           on_name_lost,
+                                           NULL,
+                                           NULL);
+
+  if (reap_interval > 0)
+    g_timeout_add_seconds (reap_interval, reap_timeout, NULL);
+
+  if (compact_interval > 0)
+    g_timeout_add_seconds (compact_interval, compact_timeout, NULL);
 
   loop = g_main_loop_new (NULL, FALSE);
   g_main_loop_run (loop);